@@ -39,29 +39,14 @@ PureAffineCostFunction<VDim, TReal>
   m_Level = level;
   m_Parent = parent;
 
-  // Allocate the working images, but do not allocate. We will allocate on demand because
-  // these affine cost functions may be created without needing to do any computation
+  // The SSD and MI metrics are accumulated without per-voxel images. NCC needs a metric
+  // image, which is allocated on demand because these affine cost functions may be created
+  // without needing to do any computation
   m_Allocated = false;
 
-  m_Phi = VectorImageType::New();
-  m_Phi->CopyInformation(helper->GetReferenceSpace(level));
-  m_Phi->SetRegions(helper->GetReferenceSpace(level)->GetBufferedRegion());
-
-  m_GradMetric = VectorImageType::New();
-  m_GradMetric->CopyInformation(helper->GetReferenceSpace(level));
-  m_GradMetric->SetRegions(helper->GetReferenceSpace(level)->GetBufferedRegion());
-
-  m_GradMask = VectorImageType::New();
-  m_GradMask->CopyInformation(helper->GetReferenceSpace(level));
-  m_GradMask->SetRegions(helper->GetReferenceSpace(level)->GetBufferedRegion());
-
   m_Metric = ImageType::New();
   m_Metric->CopyInformation(helper->GetReferenceSpace(level));
   m_Metric->SetRegions(helper->GetReferenceSpace(level)->GetBufferedRegion());
-
-  m_Mask = ImageType::New();
-  m_Mask->CopyInformation(helper->GetReferenceSpace(level));
-  m_Mask->SetRegions(helper->GetReferenceSpace(level)->GetBufferedRegion());
 }
 
 
@@ -79,17 +64,6 @@ PureAffineCostFunction<VDim, TReal>
   // Allocate a vector to hold the per-component metric values
   vnl_vector<double> comp_metric;
 
-  // Allocate the memory if needed
-  if(!m_Allocated)
-    {
-    m_Phi->Allocate();
-    m_GradMetric->Allocate();
-    m_GradMask->Allocate();
-    m_Metric->Allocate();
-    m_Mask->Allocate();
-    m_Allocated = true;
-    }
-
   // Compute the gradient
   double val = 0.0;
 
@@ -112,21 +86,25 @@ PureAffineCostFunction<VDim, TReal>
   // Perform actual metric computation
   if(m_Param->metric == GreedyParameters::SSD)
     {
-    m_OFHelper->ComputeAffineMSDMatchAndGradient(
-          m_Level, tran, m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad);
-
+    m_OFHelper->ComputeAffineMSDMatchAndGradient(m_Level, tran, out_metric, grad);
     }
   else if(m_Param->metric == GreedyParameters::NCC)
     {
+    // Allocate the metric image if needed
+    if(!m_Allocated)
+      {
+      m_Metric->Allocate();
+      m_Allocated = true;
+      }
+
     m_OFHelper->ComputeAffineNCCMatchAndGradient(
           m_Level, tran, array_caster<VDim>::to_itkSize(m_Param->metric_radius),
-          m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad);
+          m_Metric, out_metric, grad);
     }
   else if(m_Param->metric == GreedyParameters::MI || m_Param->metric == GreedyParameters::NMI)
     {
     m_OFHelper->ComputeAffineMIMatchAndGradient(
-          m_Level, m_Param->metric == GreedyParameters::NMI,
-          tran, m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad);
+          m_Level, m_Param->metric == GreedyParameters::NMI, tran, out_metric, grad);
     }
 
   // Handle the gradient
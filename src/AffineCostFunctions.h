@@ -97,9 +97,8 @@ protected:
   bool m_Allocated;
   int m_Level;
 
-  // Storage for the gradient of the similarity map
-  VectorImagePointer m_Phi, m_GradMetric, m_GradMask;
-  ImagePointer m_Metric, m_Mask;
+  // Working metric image (only needed by the NCC metric)
+  ImagePointer m_Metric;
 
   // Last set of coefficients evaluated
   vnl_vector<double> last_coeff;
@@ -46,6 +46,7 @@
 
 #include "MultiImageRegistrationHelper.h"
 #include "FastWarpCompositeImageFilter.h"
+#include "FastNearestNeighborWarpImageFilter.h"
 #include "MultiComponentImageMetricBase.h"
 #include "WarpFunctors.h"
 
@@ -500,17 +501,129 @@ GreedyApproach<VDim, TReal>
 
 
 #include <itkBinaryErodeImageFilter.h>
+#include <itkRegionOfInterestImageFilter.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+
+// Test whether a pixel belongs to the foreground for automatic cropping
+template <class TPixel>
+bool IsForegroundPixel(const TPixel &pix, double threshold)
+{
+  return pix > threshold;
+}
+
+template <class TPixel>
+bool IsForegroundPixel(const itk::VariableLengthVector<TPixel> &pix, double threshold)
+{
+  for(unsigned int k = 0; k < pix.GetSize(); k++)
+    if(pix[k] > threshold)
+      return true;
+  return false;
+}
+
+// Expand the bounding box [lo, hi] to include the foreground of an image
+template <class TImage>
+void ExpandForegroundBoundingBox(TImage *img, double threshold,
+                                 itk::Index<TImage::ImageDimension> &lo,
+                                 itk::Index<TImage::ImageDimension> &hi)
+{
+  const unsigned int VDim = TImage::ImageDimension;
+  typedef itk::ImageRegionConstIteratorWithIndex<TImage> IterType;
+  for(IterType it(img, img->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    if(IsForegroundPixel(it.Get(), threshold))
+      {
+      const itk::Index<VDim> &idx = it.GetIndex();
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        lo[d] = std::min(lo[d], idx[d]);
+        hi[d] = std::max(hi[d], idx[d]);
+        }
+      }
+    }
+}
+
+// Make a header-only copy of the space of an image
+template <class TImageBase>
+itk::SmartPointer<TImageBase> CopyImageSpace(TImageBase *img)
+{
+  itk::SmartPointer<TImageBase> space = TImageBase::New();
+  space->CopyInformation(img);
+  space->SetRegions(img->GetBufferedRegion());
+  return space;
+}
+
+// Extract a region of an image, keeping its physical coordinates
+template <class TImage>
+itk::SmartPointer<TImage> CropImageToRegion(TImage *img, const itk::ImageRegion<TImage::ImageDimension> &region)
+{
+  typedef itk::RegionOfInterestImageFilter<TImage, TImage> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+  filter->SetInput(img);
+  filter->SetRegionOfInterest(region);
+  filter->Update();
+  return filter->GetOutput();
+}
+
+// Linear part of the physical map x -> x + u(x) of a displacement field, by a least
+// squares affine fit over the voxels. This is exact when the field is affine
+template <class TVectorImage>
+vnl_matrix<double> FitLinearPartOfWarp(TVectorImage *warp)
+{
+  const unsigned int VDim = TVectorImage::ImageDimension;
+  vnl_vector<double> sx(VDim, 0.0), sy(VDim, 0.0), x(VDim), y(VDim);
+  vnl_matrix<double> sxx(VDim, VDim, 0.0), sxy(VDim, VDim, 0.0);
+  double n = 0;
+
+  typedef itk::ImageRegionConstIteratorWithIndex<TVectorImage> IterType;
+  for(IterType it(warp, warp->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    itk::Point<double, VDim> pt;
+    warp->TransformIndexToPhysicalPoint(it.GetIndex(), pt);
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      x[d] = pt[d];
+      y[d] = pt[d] + it.Get()[d];
+      }
+    sx += x; sy += y;
+    sxx += outer_product(x, x);
+    sxy += outer_product(x, y);
+    n++;
+    }
+
+  // Centered second moments, y = L x + b gives cov(x, y) = cov(x, x) L^T
+  vnl_matrix<double> cxx = sxx / n - outer_product(sx / n, sx / n);
+  vnl_matrix<double> cxy = sxy / n - outer_product(sx / n, sy / n);
+  return (vnl_svd<double>(cxx).pinverse() * cxy).transpose();
+}
 
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::ReadImages(GreedyParameters &param, OFHelperType &ofhelper)
 {
+  // The per-level thread counts must have one entry per level (a single count applies to
+  // all levels). This is checked before any image is read
+  unsigned int nlevels = param.iter_per_level.size();
+  const std::vector<int> *thread_tables[] = {
+    &param.threads_metric, &param.threads_smooth, &param.threads_compose };
+  for(int s = 0; s < 3; s++)
+    if(thread_tables[s]->size() > 1 && thread_tables[s]->size() != nlevels)
+      throw GreedyException("Per-level thread counts (-threads-stage) have %d entries, expected %d (one per level)",
+                            (int) thread_tables[s]->size(), (int) nlevels);
+
   // If the parameters include a sequence of transforms, apply it first
   VectorImagePointer moving_pre_warp;
 
   // Keep a pointer to the fixed image space
   typename OFHelperType::ImageBaseType *ref_space = NULL;
 
+  // The images are collected first, so that they can be cropped before being
+  // passed on to the helper
+  std::vector<CompositeImagePointer> fixed, moving;
+
+  // Moving images before the pre-warp, used to sample the downsampled levels directly
+  std::vector<CompositeImagePointer> moving_orig;
+  bool moving_orig_nans = false;
+
   // Read the input images and stick them into an image array
   for(int i = 0; i < param.inputs.size(); i++)
     {
@@ -537,24 +650,28 @@ void GreedyApproach<VDim, TReal>
       // Interpolate the moving image using the transform chain
       LDDMMType::interp_cimg(imgMov, moving_pre_warp, warped_moving, false, true);
 
-      // Add the image pair to the helper
-      ofhelper.AddImagePair(imgFix, warped_moving, param.inputs[i].weight);
-      }
-    else
-      {
-      // Add to the helper object
-      ofhelper.AddImagePair(imgFix, imgMov, param.inputs[i].weight);
+      // NaNs would be spread by the smoothing applied before sampling the coarse levels
+      if(param.flag_prewarp_per_level)
+        {
+        moving_orig.push_back(imgMov);
+        const TReal *p_mov = imgMov->GetBufferPointer();
+        for(size_t q = 0; q < imgMov->GetPixelContainer()->Size() && !moving_orig_nans; q++)
+          moving_orig_nans = std::isnan(p_mov[q]);
+        }
+
+      imgMov = warped_moving;
       }
+
+    fixed.push_back(imgFix);
+    moving.push_back(imgMov);
     }
 
   // Read the fixed-space mask
+  typedef typename OFHelperType::FloatImageType MaskType;
+  typename MaskType::Pointer imgGradMask, imgMovMask, imgFixMask;
   if(param.gradient_mask.size())
     {
-    typedef typename OFHelperType::FloatImageType MaskType;
-    typename MaskType::Pointer imgMask =
-        ReadImageViaCache<MaskType>(param.gradient_mask);
-
-    ofhelper.SetGradientMask(imgMask);
+    imgGradMask = ReadImageViaCache<MaskType>(param.gradient_mask);
     }
 
   if(param.gradient_mask_trim_radius.size() == VDim)
@@ -568,9 +685,7 @@ void GreedyApproach<VDim, TReal>
   // Read the moving-space mask
   if(param.moving_mask.size())
     {
-    typedef typename OFHelperType::FloatImageType MaskType;
-    typename MaskType::Pointer imgMovMask =
-        ReadImageViaCache<MaskType>(param.moving_mask);
+    imgMovMask = ReadImageViaCache<MaskType>(param.moving_mask);
 
     if(moving_pre_warp.IsNotNull())
       {
@@ -579,24 +694,206 @@ void GreedyApproach<VDim, TReal>
 
       // Interpolate the moving image using the transform chain
       LDDMMType::interp_img(imgMovMask, moving_pre_warp, warped_moving_mask, false, true);
+      imgMovMask = warped_moving_mask;
+      }
+    }
+
+  // Set the fixed mask (distinct from gradient mask)
+  if(param.fixed_mask.size())
+    {
+    imgFixMask = ReadImageViaCache<MaskType>(param.fixed_mask);
+    }
+
+  // Crop the registration domain to the bounding box of the foreground
+  GreedyStdOut gout(param.verbosity);
+  m_UncroppedFixedSpace = NULL;
+  m_UncroppedMovingSpace = NULL;
+  if(param.auto_crop_pad >= 0 && fixed.size()
+     && (param.mode == GreedyParameters::GREEDY || param.mode == GreedyParameters::AFFINE))
+    {
+    // The moving images can only be cropped along with the fixed images if they
+    // share the same voxel grid
+    itk::ImageRegion<VDim> full_region = fixed[0]->GetBufferedRegion();
+    bool crop_moving = true;
+    for(unsigned int i = 0; i < fixed.size(); i++)
+      if(moving[i]->GetBufferedRegion() != full_region)
+        crop_moving = false;
+
+    if(!crop_moving && param.mode == GreedyParameters::GREEDY)
+      throw GreedyException("Foreground cropping in deformable mode requires the moving images "
+                            "to have the same dimensions as the fixed image (use -it to resample them)");
+
+    // Compute the bounding box of the foreground
+    itk::Index<VDim> lo, hi;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      lo[d] = full_region.GetIndex(d) + full_region.GetSize(d);
+      hi[d] = full_region.GetIndex(d) - 1;
+      }
 
-      // Add the warped mask to the helper
-      ofhelper.SetMovingMask(warped_moving_mask);
+    if(imgGradMask)
+      {
+      ExpandForegroundBoundingBox(imgGradMask.GetPointer(), 0.5, lo, hi);
       }
     else
       {
-      // Add the mask to the helper object
-      ofhelper.SetMovingMask(imgMovMask);
+      for(unsigned int i = 0; i < fixed.size(); i++)
+        {
+        ExpandForegroundBoundingBox(fixed[i].GetPointer(), param.auto_crop_threshold, lo, hi);
+        if(crop_moving)
+          ExpandForegroundBoundingBox(moving[i].GetPointer(), param.auto_crop_threshold, lo, hi);
+        }
+      }
+
+    // Pad the bounding box and clip it to the image
+    itk::ImageRegion<VDim> crop_region;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      if(hi[d] < lo[d])
+        throw GreedyException("Foreground for cropping is empty");
+      long r_lo = std::max((long) lo[d] - param.auto_crop_pad, (long) full_region.GetIndex(d));
+      long r_hi = std::min((long) hi[d] + param.auto_crop_pad,
+                           (long) (full_region.GetIndex(d) + full_region.GetSize(d)) - 1);
+      crop_region.SetIndex(d, r_lo);
+      crop_region.SetSize(d, r_hi - r_lo + 1);
+      }
+
+    if(crop_region != full_region)
+      {
+      m_UncroppedFixedSpace = CopyImageSpace<ImageBaseType>(fixed[0]);
+      if(crop_moving)
+        m_UncroppedMovingSpace = CopyImageSpace<ImageBaseType>(moving[0]);
+      m_CropRegion = crop_region;
+
+      for(unsigned int i = 0; i < fixed.size(); i++)
+        {
+        fixed[i] = CropImageToRegion(fixed[i].GetPointer(), crop_region);
+        if(crop_moving)
+          moving[i] = CropImageToRegion(moving[i].GetPointer(), crop_region);
+        }
+
+      if(imgGradMask)
+        imgGradMask = CropImageToRegion(imgGradMask.GetPointer(), crop_region);
+      if(imgFixMask)
+        imgFixMask = CropImageToRegion(imgFixMask.GetPointer(), crop_region);
+      if(imgMovMask && crop_moving)
+        imgMovMask = CropImageToRegion(imgMovMask.GetPointer(), crop_region);
+
+      gout.printf("Cropped registration domain to foreground: %4.1f%% of %lu voxels\n",
+                  crop_region.GetNumberOfPixels() * 100.0 / full_region.GetNumberOfPixels(),
+                  (unsigned long) full_region.GetNumberOfPixels());
       }
     }
 
-  // Set the fixed mask (distinct from gradient mask)
-  if(param.fixed_mask.size())
-    {
-    typedef typename OFHelperType::FloatImageType MaskType;
-    typename MaskType::Pointer imgFixMask =
-        ReadImageViaCache<MaskType>(param.fixed_mask);
+  // Add the image pairs and masks to the helper object
+  for(unsigned int i = 0; i < fixed.size(); i++)
+    ofhelper.AddImagePair(fixed[i], moving[i], param.inputs[i].weight);
+
+  if(imgGradMask)
+    ofhelper.SetGradientMask(imgGradMask);
+
+  if(imgMovMask)
+    ofhelper.SetMovingMask(imgMovMask);
+
+  if(imgFixMask)
     ofhelper.SetFixedMask(imgFixMask);
+
+  // With a pre-warp and -it-levels, the downsampled levels of the moving images are
+  // sampled from the original moving images through the transform chain evaluated on the
+  // level grid. This replaces downsampling of the full resolution pre-warped images, saving
+  // an interpolation pass and the smoothing of the pre-warped images
+  if(moving_orig.size() && !moving_orig_nans)
+    {
+    int n_levels = ofhelper.GetNumberOfLevels();
+
+    // The transform chain on the grid of each downsampled level, and the covariance of the
+    // smoothing applied by the pyramid, which is defined along the fixed image axes
+    std::vector<VectorImagePointer> level_warp(n_levels);
+    std::vector<typename ImageBaseType::Pointer> level_space(n_levels);
+    std::vector<vnl_matrix<double> > level_cov(n_levels);
+    vnl_matrix<double> dir_fix = fixed[0]->GetDirection().GetVnlMatrix();
+    for(int level = 0; level < n_levels; level++)
+      {
+      if(ofhelper.GetPyramidFactor(level) == 1)
+        continue;
+
+      level_space[level] = ofhelper.GetPyramidLevelSpace(level);
+      ReadTransformChain(param.moving_pre_transforms, level_space[level], level_warp[level]);
+
+      vnl_matrix<double> var(VDim, VDim, 0.0);
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        double sigma_d = 0.5 * ofhelper.GetPyramidAxisFactors(level)[d] * fixed[0]->GetSpacing()[d];
+        var(d, d) = sigma_d * sigma_d;
+        }
+      level_cov[level] = dir_fix * var * dir_fix.transpose();
+      }
+
+    // Smoothing the pre-warped image with covariance S is the same as smoothing the
+    // moving image with covariance L S L^T, where L is the linear part of the chain
+    vnl_matrix<double> L = FitLinearPartOfWarp(moving_pre_warp.GetPointer());
+
+    // Each moving image is smoothed incrementally, from the finest downsampled level to the
+    // coarsest, so that only one smoothed copy is held at a time. The original image is
+    // released once its first smoothed copy exists
+    for(unsigned int i = 0; i < moving_orig.size(); i++)
+      {
+      // Map the covariances into the axes of this moving image. The smoothing is separable,
+      // so images for which the mapped covariance is not close to diagonal (i.e., the chain
+      // rotates anisotropic kernels off the moving axes) keep the pre-warped pyramid
+      vnl_matrix<double> dir_mov = moving_orig[i]->GetDirection().GetVnlMatrix();
+      std::vector<vnl_vector<double> > level_var(n_levels);
+      bool separable = true;
+      for(int level = 0; level < n_levels && separable; level++)
+        {
+        if(level_warp[level].IsNull())
+          continue;
+
+        vnl_matrix<double> cov =
+            dir_mov.transpose() * L * level_cov[level] * L.transpose() * dir_mov;
+        level_var[level] = cov.get_diagonal();
+        for(unsigned int a = 0; a < VDim; a++)
+          for(unsigned int b = 0; b < a; b++)
+            if(fabs(cov(a, b)) > 0.05 * sqrt(cov(a, a) * cov(b, b)))
+              separable = false;
+        }
+
+      if(!separable)
+        {
+        gout.printf("Moving image %d: pre-transform is not axis-aligned with the pyramid "
+                    "smoothing, downsampling the pre-warped image\n", i);
+        moving_orig[i] = NULL;
+        continue;
+        }
+
+      std::vector<CompositeImagePointer> levels(n_levels);
+      int nc = moving_orig[i]->GetNumberOfComponentsPerPixel();
+      CompositeImagePointer current = moving_orig[i];
+      moving_orig[i] = NULL;
+
+      vnl_vector<double> var_current(VDim, 0.0);
+      for(int level = n_levels - 1; level >= 0; level--)
+        {
+        if(level_warp[level].IsNull())
+          continue;
+
+        // Gaussian variances add up, so only the difference is applied to the current image
+        typename LDDMMType::Vec sigma;
+        for(unsigned int j = 0; j < VDim; j++)
+          sigma[j] = sqrt(std::max(level_var[level][j] - var_current[j], 0.0));
+
+        CompositeImagePointer smooth = LDDMMType::new_cimg(current, nc);
+        LDDMMType::cimg_smooth(current, smooth, sigma);
+        current = smooth;
+        var_current = level_var[level];
+
+        levels[level] = LDDMMType::new_cimg(level_space[level], nc);
+        LDDMMType::interp_cimg(current, level_warp[level], levels[level], false, true);
+        }
+
+      ofhelper.SetMovingPyramid(i, levels);
+      }
+    moving_orig.clear();
     }
 
   // Generate the optimized composite images. For the NCC metric, we add random noise to
@@ -604,13 +901,112 @@ void GreedyApproach<VDim, TReal>
   double noise = (param.metric == GreedyParameters::NCC) ? param.ncc_noise_factor : 0.0;
 
   // Build the composite images
+  ofhelper.SetMemoryLean(param.flag_memory_lean);
+  ofhelper.SetTiledMovingThresholds(param.tile_moving_rotation, param.tile_moving_displacement);
+
+  // The moving gradient can be precomputed at selected levels
+  if(param.moving_gradient_levels.size() && param.moving_gradient_levels.size() != param.iter_per_level.size())
+    throw GreedyException("The -moving-grad option must have one entry per level (%d)",
+                          (int) param.iter_per_level.size());
+  ofhelper.SetPrecomputedMovingGradientLevels(param.moving_gradient_levels);
+
+  // The key is computed before the composites are built from the fixed images
+  std::string stats_key = GetFixedStatisticsKey(param, ofhelper, fixed, imgFixMask, imgGradMask);
+
+  // The helper now holds the only references to the inputs that are not in the image
+  // cache, so that in memory-lean mode it can release them once the pyramid is built
+  fixed.clear();
+  moving.clear();
   ofhelper.BuildCompositeImages(noise);
 
+  if(param.flag_memory_lean)
+    {
+    double mb_released, mb_shared, mb_pinned;
+    ofhelper.GetMemoryLeanReport(mb_released, mb_shared, mb_pinned);
+    gout.printf("Memory-lean mode: %.1f MB of input images released, %.1f MB shared with the pyramid, "
+                "%.1f MB still held by the image cache\n", mb_released, mb_shared, mb_pinned);
+    }
+
+  // Share the statistics of the fixed images with earlier runs on the same fixed images
+  if(stats_key.size())
+    {
+    // Only the statistics of the most recent fixed images are kept, since the binned
+    // images are held for all levels and an unused entry would never be released
+    typedef typename OFHelperType::FixedStatisticsType FixedStatisticsType;
+    if(m_FixedStatisticsCache.find(stats_key) == m_FixedStatisticsCache.end())
+      m_FixedStatisticsCache.clear();
+    itk::Object::Pointer &entry = m_FixedStatisticsCache[stats_key];
+    if(entry.IsNull())
+      entry = FixedStatisticsType::New().GetPointer();
+    ofhelper.SetFixedStatistics(dynamic_cast<FixedStatisticsType *>(entry.GetPointer()));
+    }
+
   // If the metric is NCC, then also apply special processing to the gradient masks
   if(param.metric == GreedyParameters::NCC)
     ofhelper.DilateCompositeGradientMasksForNCC(array_caster<VDim>::to_itkSize(param.metric_radius));
 }
 
+template <unsigned int VDim, typename TReal>
+std::string
+GreedyApproach<VDim, TReal>
+::GetFixedStatisticsKey(const GreedyParameters &param, const OFHelperType &ofhelper,
+                        const std::vector<CompositeImagePointer> &fixed,
+                        itk::Object *fixed_mask, itk::Object *gradient_mask)
+{
+  // The crop region depends on the moving images, so cropped runs are not shared
+  if(param.auto_crop_pad >= 0)
+    return std::string();
+
+  // The images are identified by their address and modification time, so that images read
+  // again from disk are not matched with stale statistics. Images written in place through
+  // GraftOutput keep their modification time, so the code that does so (e.g., the mask
+  // thresholding in the helper) must call Modified() on them
+  std::ostringstream oss;
+  for(unsigned int i = 0; i < fixed.size(); i++)
+    oss << fixed[i].GetPointer() << ":" << fixed[i]->GetMTime() << "|";
+
+  oss << "fm:";
+  if(fixed_mask)
+    oss << fixed_mask << ":" << fixed_mask->GetMTime();
+  oss << "|gm:";
+  if(gradient_mask)
+    oss << gradient_mask << ":" << gradient_mask->GetMTime();
+  oss << "|gt:";
+  for(unsigned int d = 0; d < param.gradient_mask_trim_radius.size(); d++)
+    oss << param.gradient_mask_trim_radius[d] << ",";
+
+  oss << "|pf:";
+  for(int i = 0; i < ofhelper.GetNumberOfLevels(); i++)
+    oss << ofhelper.GetPyramidFactor(i) << ",";
+  oss << "|ap:" << param.flag_anisotropic_pyramid;
+
+  // With NCC, noise is added to the fixed composites, so they are not shared with other metrics
+  if(param.metric == GreedyParameters::NCC)
+    oss << "|ncc";
+
+  return oss.str();
+}
+
+template <unsigned int VDim, typename TReal>
+typename GreedyApproach<VDim, TReal>::VectorImagePointer
+GreedyApproach<VDim, TReal>
+::UncropWarp(VectorImageType *warp)
+{
+  if(m_UncroppedFixedSpace.IsNull())
+    return warp;
+
+  // Allocate a zero warp over the full fixed space and copy the cropped warp into it
+  VectorImagePointer full = LDDMMType::new_vimg(m_UncroppedFixedSpace);
+  typedef itk::ImageRegionConstIterator<VectorImageType> InIter;
+  typedef itk::ImageRegionIterator<VectorImageType> OutIter;
+  InIter it_in(warp, warp->GetBufferedRegion());
+  OutIter it_out(full, m_CropRegion);
+  for(; !it_in.IsAtEnd(); ++it_in, ++it_out)
+    it_out.Set(it_in.Get());
+
+  return full;
+}
+
 #include <vnl/algo/vnl_lbfgs.h>
 
 template <unsigned int VDim, typename TReal>
@@ -760,6 +1156,86 @@ int GreedyApproach<VDim, TReal>
 */
 
 
+#include "itkMultiThreader.h"
+
+/**
+ * Sets the default number of threads of the ITK filters created while it is in scope,
+ * and restores the previous default when it goes out of scope. The filters are created
+ * deep inside LDDMMData and the metric code, so the count is passed to them through the
+ * process-wide ITK default. While a count is set, filters created by other threads of
+ * the process (e.g., another GreedyApproach running concurrently) get it as well, so the
+ * per-stage thread options should not be used when registrations run concurrently. The
+ * global default is not touched unless a count is actually set.
+ */
+class ScopedDefaultThreads
+{
+public:
+  ScopedDefaultThreads()
+    : m_Saved(itk::MultiThreader::GetGlobalDefaultNumberOfThreads()), m_Changed(false) {}
+  ~ScopedDefaultThreads() { Set(0); }
+
+  // Use n threads, or the previous default if n is 0
+  void Set(int n)
+  {
+    if(n > 0 || m_Changed)
+      itk::MultiThreader::SetGlobalDefaultNumberOfThreads(n > 0 ? n : m_Saved);
+    m_Changed = n > 0;
+  }
+
+  itk::ThreadIdType GetSaved() const { return m_Saved; }
+
+protected:
+  itk::ThreadIdType m_Saved;
+  bool m_Changed;
+};
+
+template <unsigned int VDim, typename TReal>
+int GreedyApproach<VDim, TReal>
+::GetStageThreads(const GreedyParameters &param, ThreadStage stage, int level,
+                  unsigned long n_voxels, double cost_per_voxel)
+{
+  const std::vector<int> &ovr =
+      stage == STAGE_METRIC ? param.threads_metric
+                            : (stage == STAGE_SMOOTH ? param.threads_smooth : param.threads_compose);
+  if(ovr.size())
+    {
+    // The number of entries is checked against the number of levels in ReadImages
+    int n = ovr.size() == 1 ? ovr[0] : ovr[level];
+    if(n > 0)
+      return n;
+    }
+
+  if(!param.flag_threads_auto)
+    return 0;
+
+  // Work per thread (in units of the SSD metric at one voxel) below which starting and
+  // joining a thread costs more than 10% of its work. Measured in 3D with a single-thread
+  // kernel: about 20 ns per voxel for the SSD metric, and 16 us to start and join a thread
+  const double min_work_per_thread = 8192.0;
+  double n = ceil(n_voxels * cost_per_voxel / min_work_per_thread);
+  double n_max = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  return (int) std::max(1.0, std::min(n, n_max));
+}
+
+template <unsigned int VDim, typename TReal>
+double GreedyApproach<VDim, TReal>
+::GetMetricCostPerVoxel(const GreedyParameters &param, OFHelperType &of_helper, int level)
+{
+  // Relative costs measured in 3D with kernels shaped like the metrics: the exact NCC
+  // (radius 2) costs 8 to 14 times the SSD metric, mutual information 4 to 6 times
+  double ncomp = of_helper.GetFixedComposite(level)->GetNumberOfComponentsPerPixel();
+  switch(param.metric)
+    {
+    case GreedyParameters::NCC:
+      return 10.0 * ncomp;
+    case GreedyParameters::MI:
+    case GreedyParameters::NMI:
+      return 4.0 * ncomp;
+    default:
+      return ncomp;
+    }
+}
+
 template <unsigned int VDim, typename TReal>
 int GreedyApproach<VDim, TReal>
 ::RunAffine(GreedyParameters &param)
@@ -777,6 +1253,7 @@ int GreedyApproach<VDim, TReal>
 
   // Set the scaling factors for multi-resolution
   of_helper.SetDefaultPyramidFactors(param.iter_per_level.size());
+  of_helper.SetAnisotropicPyramid(param.flag_anisotropic_pyramid);
 
   // Add random sampling jitter for affine stability at voxel edges
   of_helper.SetJitterSigma(param.affine_jitter);
@@ -799,6 +1276,13 @@ int GreedyApproach<VDim, TReal>
     // Add stage to metric log
     m_MetricLog.push_back(std::vector<MultiComponentMetricReport>());
 
+    // Number of threads for the metric at this level
+    ScopedDefaultThreads stage_threads;
+    stage_threads.Set(GetStageThreads(
+                        param, STAGE_METRIC, level,
+                        of_helper.GetReferenceSpace(level)->GetBufferedRegion().GetNumberOfPixels(),
+                        GetMetricCostPerVoxel(param, of_helper, level)));
+
     // Define the affine cost function
     AbstractAffineCostFunction *pure_acf, *acf;
     if(param.affine_dof == GreedyParameters::DOF_RIGID)
@@ -1245,6 +1729,7 @@ int GreedyApproach<VDim, TReal>
 
   // Set the scaling factors for multi-resolution
   of_helper.SetDefaultPyramidFactors(param.iter_per_level.size());
+  of_helper.SetAnisotropicPyramid(param.flag_anisotropic_pyramid);
 
   // Set the scaling mode depending on the metric
   if(param.metric == GreedyParameters::MAHALANOBIS)
@@ -1262,6 +1747,14 @@ int GreedyApproach<VDim, TReal>
   // Clear the metric log
   m_MetricLog.clear();
 
+  // The control lattice cannot be used with the incompressibility solver
+  if(param.control_lattice_factor > 1 && param.flag_incompressibility_mode)
+    throw GreedyException("Control lattice (-lattice) is not supported in incompressibility mode");
+
+  // The active set relies on the metric gradient at a voxel depending only on that voxel
+  if(param.active_set_threshold > 0.0 && param.metric != GreedyParameters::SSD)
+    throw GreedyException("Active set (-active-set) is only supported with the SSD metric");
+
   // Iterate over the resolution levels
   for(unsigned int level = 0; level < nlevels; ++level)
     {
@@ -1271,6 +1764,14 @@ int GreedyApproach<VDim, TReal>
     // Reference space
     ImageBaseType *refspace = of_helper.GetReferenceSpace(level);
 
+    // At the finest levels, the field may be represented on a coarser control lattice,
+    // in voxel units of the lattice. The metric is still computed at full resolution
+    int lattice = (param.control_lattice_factor > 1
+                   && (int) (level + param.control_lattice_levels) >= (int) nlevels)
+                  ? param.control_lattice_factor : 1;
+    typename ImageBaseType::Pointer latspace =
+        lattice > 1 ? CreateControlLattice(refspace, lattice) : typename ImageBaseType::Pointer(refspace);
+
     // Smoothing factors for this level, in physical units
     typename LDDMMType::Vec sigma_pre_phys =
         of_helper.GetSmoothingSigmasInPhysicalUnits(level, param.sigma_pre.sigma,
@@ -1289,6 +1790,33 @@ int GreedyApproach<VDim, TReal>
       gout.printf("%s%f", d==0 ? " " : "x", sigma_post_phys[d]);
     gout.printf("\n");
 
+    // Number of threads for the stages of an iteration at this level (0 keeps the default).
+    // With a control lattice, the smoothing and composition stages work partly on the
+    // full resolution grid and partly on the lattice, and each part is sized separately
+    ScopedDefaultThreads stage_threads;
+    unsigned long n_full = refspace->GetBufferedRegion().GetNumberOfPixels();
+    unsigned long n_lat = latspace->GetBufferedRegion().GetNumberOfPixels();
+    int thr_metric = GetStageThreads(param, STAGE_METRIC, level, n_full,
+                                     GetMetricCostPerVoxel(param, of_helper, level));
+    // Per vector component, recursive Gaussian smoothing costs about 2 voxels of the SSD
+    // metric and composition about 0.4 (measured in 3D like the metric costs)
+    int thr_smooth = GetStageThreads(param, STAGE_SMOOTH, level, n_full, 2.0 * VDim);
+    int thr_smooth_lat = GetStageThreads(param, STAGE_SMOOTH, level, n_lat, 2.0 * VDim);
+    int thr_compose = GetStageThreads(param, STAGE_COMPOSE, level, n_full, 0.4 * VDim);
+    int thr_compose_lat = GetStageThreads(param, STAGE_COMPOSE, level, n_lat, 0.4 * VDim);
+    if(thr_metric || thr_smooth || thr_compose)
+      {
+      int thr_def = stage_threads.GetSaved();
+      gout.printf("  Threads: metric %d, smoothing %d, composition %d",
+                  thr_metric ? thr_metric : thr_def, thr_smooth ? thr_smooth : thr_def,
+                  thr_compose ? thr_compose : thr_def);
+      if(n_lat < n_full)
+        gout.printf(" (on the lattice: smoothing %d, composition %d)",
+                    thr_smooth_lat ? thr_smooth_lat : thr_def,
+                    thr_compose_lat ? thr_compose_lat : thr_def);
+      gout.printf("\n");
+      }
+
     // Set up timers for different critical components of the optimization
     GreedyTimeProbe tm_Gradient, tm_Gaussian1, tm_Gaussian2, tm_Iteration,
       tm_Integration, tm_Update, tm_UpdatePDE, tm_PDE;
@@ -1299,6 +1827,12 @@ int GreedyApproach<VDim, TReal>
     VectorImagePointer uk = VectorImageType::New();
     VectorImagePointer uk1 = VectorImageType::New();
 
+    // Full resolution images used with the control lattice: the upsampled warp and the
+    // metric gradient, and a lattice-sized scalar image
+    VectorImagePointer vFull = VectorImageType::New();
+    VectorImagePointer gFull = VectorImageType::New();
+    ImagePointer iLat = iTemp;
+
     // This is the exponentiated uk, in stationary velocity mode it is uk^(2^N)
     VectorImagePointer uk_exp = VectorImageType::New();
 
@@ -1315,19 +1849,45 @@ int GreedyApproach<VDim, TReal>
     // Mask used for incompressibility purposes
     ImagePointer incompressibility_mask = NULL;
 
+    // Active set: blocks whose update is below threshold are frozen, and the metric is only
+    // computed in the active blocks and a halo covering the support of the pre-smoothing.
+    // It is not used on the control lattice, where the gradient is sampled at the nodes
+    bool active_set = param.active_set_threshold > 0.0 && lattice == 1
+                      && param.iter_per_level[level] > 0;
+    int as_block = param.active_set_block, as_halo = 0;
+    ImagePointer activeBlocks, activeMask;
+    double as_fraction = 0.0;
+    if(active_set)
+      {
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        double sigma_vox = sigma_pre_phys[d] / refspace->GetSpacing()[d];
+        as_halo = std::max(as_halo, (int) ceil((3.0 * sigma_vox) / as_block));
+        }
+      activeBlocks = ImageType::New();
+      activeMask = LDDMMType::new_img(refspace);
+      }
+
     // Allocate the intermediate data
     LDDMMType::alloc_vimg(uk, refspace);
     if(param.iter_per_level[level] > 0)
       {
       LDDMMType::alloc_img(iTemp, refspace);
-      LDDMMType::alloc_vimg(viTemp, refspace);
-      LDDMMType::alloc_vimg(uk1, refspace);
+      LDDMMType::alloc_vimg(viTemp, latspace);
+      LDDMMType::alloc_vimg(uk1, latspace);
+
+      if(lattice > 1)
+        {
+        LDDMMType::alloc_vimg(vFull, refspace);
+        LDDMMType::alloc_vimg(gFull, refspace);
+        iLat = LDDMMType::new_img(latspace);
+        }
 
       // These are only allocated in diffeomorphic demons mode
       if(param.flag_stationary_velocity_mode)
         {
-        LDDMMType::alloc_vimg(uk_exp, refspace);
-        LDDMMType::alloc_mimg(work_mat, refspace);
+        LDDMMType::alloc_vimg(uk_exp, latspace);
+        LDDMMType::alloc_mimg(work_mat, latspace);
         }
 
       if(param.flag_stationary_velocity_mode && param.flag_incompressibility_mode)
@@ -1349,7 +1909,12 @@ int GreedyApproach<VDim, TReal>
     if(uLevel.IsNotNull())
       {
       LDDMMType::vimg_resample_identity(uLevel, refspace, uk);
-      LDDMMType::vimg_scale_in_place(uk, 2.0);
+
+      // Scale each component by the change in the downsampling factor of its axis
+      typename LDDMMType::Vec scale;
+      for(unsigned int d = 0; d < VDim; d++)
+        scale[d] = of_helper.GetPyramidAxisFactors(level - 1)[d] / of_helper.GetPyramidAxisFactors(level)[d];
+      LDDMMType::vimg_scale_in_place(uk, scale);
       uLevel = uk;
       }
     else if(param.initial_warp.size())
@@ -1366,7 +1931,10 @@ int GreedyApproach<VDim, TReal>
 
       // Scale the initial warp by the pyramid level
       LDDMMType::vimg_resample_identity(uInit, refspace, uk);
-      LDDMMType::vimg_scale_in_place(uk, 1.0 / (1 << level));
+      typename LDDMMType::Vec scale;
+      for(unsigned int d = 0; d < VDim; d++)
+        scale[d] = 1.0 / of_helper.GetPyramidAxisFactors(level)[d];
+      LDDMMType::vimg_scale_in_place(uk, scale);
       uLevel = uk;
       itk::Index<VDim> test; test.Fill(24);
       }
@@ -1398,11 +1966,23 @@ int GreedyApproach<VDim, TReal>
       itk::Index<VDim> test; test.Fill(24);
       }
 
+    // Move the initial field onto the control lattice
+    if(lattice > 1)
+      {
+      VectorImagePointer uk_lat = LDDMMType::new_vimg(latspace);
+      LDDMMType::vimg_resample_identity(uk, latspace, uk_lat);
+      LDDMMType::vimg_scale_in_place(uk_lat, 1.0 / lattice);
+      uk = uk_lat;
+      gout.printf("  Control lattice: factor %d, %lu nodes\n", lattice,
+                  (unsigned long) latspace->GetBufferedRegion().GetNumberOfPixels());
+      }
+
     // Iterate for this level
     for(unsigned int iter = 0; iter < param.iter_per_level[level]; iter++)
       {
       // Start the iteration timer
       tm_Iteration.Start();
+      stage_threads.Set(thr_compose_lat);
 
       // The epsilon for this level
       double eps= param.epsilon_per_level[level];
@@ -1424,43 +2004,70 @@ int GreedyApproach<VDim, TReal>
         uFull = uk;
         }
 
+      // Upsample the lattice field for metric evaluation. The gradient is computed
+      // at full resolution into gFull
+      VectorImageType *grad = uk1;
+      if(lattice > 1)
+        {
+        stage_threads.Set(thr_compose);
+        LDDMMType::vimg_resample_identity(uFull, refspace, vFull);
+        LDDMMType::vimg_scale_in_place(vFull, (TReal) lattice);
+        uFull = vFull;
+        grad = gFull;
+        }
+
       // Create a metric report that will be returned by all metrics
       MultiComponentMetricReport metric_report;
 
       // Begin gradient computation
+      stage_threads.Set(thr_metric);
       tm_Gradient.Start();
 
       // Switch based on the metric
       if(param.metric == GreedyParameters::SSD)
         {
-        of_helper.ComputeOpticalFlowField(level, uFull, iTemp, metric_report, uk1, eps);
+        // All blocks are evaluated periodically and at the last iteration
+        bool full_pass = !active_set || iter % param.active_set_period == 0
+                         || iter + 1 == param.iter_per_level[level];
+        ImageType *metric_mask = full_pass ? NULL : activeMask.GetPointer();
+        if(active_set)
+          as_fraction += full_pass ? 1.0
+                                   : LDDMMType::img_voxel_sum(activeMask)
+                                     / refspace->GetBufferedRegion().GetNumberOfPixels();
+
+        of_helper.ComputeOpticalFlowField(level, uFull, iTemp, metric_report, grad, eps, metric_mask);
         metric_report.Scale(1.0 / eps);
 
         // If there is a mask, multiply the gradient by the mask
         if(param.gradient_mask.size())
-          LDDMMType::vimg_multiply_in_place(uk1, of_helper.GetGradientMask(level));
+          LDDMMType::vimg_multiply_in_place(grad, of_helper.GetGradientMask(level));
         }
 
       else if(param.metric == GreedyParameters::MI || param.metric == GreedyParameters::NMI)
         {
-        of_helper.ComputeMIFlowField(level, param.metric == GreedyParameters::NMI, uFull, iTemp, metric_report, uk1, eps);
+        of_helper.ComputeMIFlowField(level, param.metric == GreedyParameters::NMI, uFull, iTemp, metric_report, grad, eps);
 
         // If there is a mask, multiply the gradient by the mask
         if(param.gradient_mask.size())
-          LDDMMType::vimg_multiply_in_place(uk1, of_helper.GetGradientMask(level));
+          LDDMMType::vimg_multiply_in_place(grad, of_helper.GetGradientMask(level));
         }
 
       else if(param.metric == GreedyParameters::NCC)
         {
         itk::Size<VDim> radius = array_caster<VDim>::to_itkSize(param.metric_radius);
 
+        // Use the approximate metric at coarse levels if requested (no moving mask support)
+        bool approx_ncc = param.ncc_approx_exact_levels >= 0
+                          && (int) (level + param.ncc_approx_exact_levels) < (int) nlevels
+                          && param.moving_mask.size() == 0;
+
         // Compute the metric - no need to multiply by the mask, this happens already in the NCC metric code
-        of_helper.ComputeNCCMetricImage(level, uFull, radius, iTemp, metric_report, uk1, eps);
+        of_helper.ComputeNCCMetricImage(level, uFull, radius, iTemp, metric_report, grad, eps, approx_ncc);
         metric_report.Scale(1.0 / eps);
         }
       else if(param.metric == GreedyParameters::MAHALANOBIS)
         {
-        of_helper.ComputeMahalanobisMetricImage(level, uFull, iTemp, metric_report, uk1);
+        of_helper.ComputeMahalanobisMetricImage(level, uFull, iTemp, metric_report, grad);
         }
 
       // End gradient computation
@@ -1478,20 +2085,43 @@ int GreedyApproach<VDim, TReal>
         {
         char fname[256];
         sprintf(fname, "dump_gradient_lev%02d_iter%04d.nii.gz", level, iter);
-        LDDMMType::vimg_write(uk1, fname);
+        LDDMMType::vimg_write(grad, fname);
         }
 
       // We have now computed the gradient vector field. Next, we smooth it
+      stage_threads.Set(thr_smooth);
       tm_Gaussian1.Start();
-      LDDMMType::vimg_smooth_withborder(uk1, viTemp, sigma_pre_phys, 1);
+      if(lattice > 1)
+        {
+        // The smoothing also prevents aliasing when sampling the gradient on the lattice
+        LDDMMType::vimg_smooth_withborder(gFull, vFull, sigma_pre_phys, 1);
+        LDDMMType::vimg_resample_identity(vFull, latspace, viTemp);
+        LDDMMType::vimg_scale_in_place(viTemp, 1.0 / lattice);
+        }
+      else
+        {
+        LDDMMType::vimg_smooth_withborder(uk1, viTemp, sigma_pre_phys, 1);
+        }
       tm_Gaussian1.Stop();
 
       // After smoothing, compute the maximum vector norm and use it as a normalizing
-      // factor for the displacement field
+      // factor for the displacement field (the step size is in full resolution voxels)
       if(param.time_step_mode == GreedyParameters::SCALE)
-        LDDMMType::vimg_normalize_to_fixed_max_length(viTemp, iTemp, eps, false);
+        LDDMMType::vimg_normalize_to_fixed_max_length(viTemp, iLat, eps / lattice, false);
       else if (param.time_step_mode == GreedyParameters::SCALEDOWN)
-        LDDMMType::vimg_normalize_to_fixed_max_length(viTemp, iTemp, eps, true);
+        LDDMMType::vimg_normalize_to_fixed_max_length(viTemp, iLat, eps / lattice, true);
+
+      // Update the active set from the size of the update in each block
+      if(active_set)
+        {
+        LDDMMType::vimg_block_max_norm(viTemp, as_block, activeBlocks);
+        LDDMMType::img_threshold_in_place(activeBlocks, param.active_set_threshold, 1e100, 1.0, 0.0);
+        LDDMMType::img_block_expand(activeBlocks, as_block, as_halo, activeMask);
+
+        // Frozen blocks keep their displacement: the update is dropped there, and the
+        // composition below copies uk into uk1 without interpolating
+        LDDMMType::vimg_multiply_in_place(viTemp, activeMask);
+        }
 
       // Dump the smoothed gradient image if requested
       if(param.flag_dump_moving && 0 == iter % param.dump_frequency)
@@ -1502,6 +2132,7 @@ int GreedyApproach<VDim, TReal>
         }
 
       // Compute the updated deformation field - in uk1
+      stage_threads.Set(thr_compose_lat);
       tm_Update.Start();
       if(param.flag_stationary_velocity_mode)
         {
@@ -1533,8 +2164,9 @@ int GreedyApproach<VDim, TReal>
       else
         {
         // This is compositive (uk1 = viTemp + uk o viTemp), which is what is done with
-        // compositive demons and ANTS
-        LDDMMType::interp_vimg(uk, viTemp, 1.0, uk1);
+        // compositive demons and ANTS. Only the active blocks are interpolated
+        LDDMMType::interp_vimg(uk, viTemp, 1.0, uk1, false, false,
+                               active_set ? activeMask.GetPointer() : NULL);
         LDDMMType::vimg_add_in_place(uk1, viTemp);
         }
       tm_Update.Stop();
@@ -1548,9 +2180,11 @@ int GreedyApproach<VDim, TReal>
         }
 
       // Another layer of smoothing (diffusion-like)
+      stage_threads.Set(thr_smooth_lat);
       tm_Gaussian2.Start();
       LDDMMType::vimg_smooth_withborder(uk1, uk, sigma_post_phys, 1);
       tm_Gaussian2.Stop();
+      stage_threads.Set(0);
 
       // Optional incompressibility step
       tm_UpdatePDE.Start();
@@ -1599,13 +2233,22 @@ int GreedyApproach<VDim, TReal>
       tm_Iteration.Stop();
       }
 
-    // Store the end result
-    uLevel = uk;
+    // Store the end result, upsampled from the control lattice if needed
+    if(lattice > 1)
+      {
+      uLevel = LDDMMType::new_vimg(refspace);
+      LDDMMType::vimg_resample_identity(uk, refspace, uLevel);
+      LDDMMType::vimg_scale_in_place(uLevel, (TReal) lattice);
+      }
+    else
+      {
+      uLevel = uk;
+      }
 
     // Compute the jacobian of the deformation field - but only if we iterated at this level
     if(param.iter_per_level[level] > 0)
       {
-      LDDMMType::field_jacobian_det(uk, iTemp);
+      LDDMMType::field_jacobian_det(uLevel, iTemp);
       TReal jac_min, jac_max;
       LDDMMType::img_min_max(iTemp, jac_min, jac_max);
       gout.printf("END OF LEVEL %3d    DetJac Range: %8.4f  to %8.4f \n", level, jac_min, jac_max);
@@ -1631,6 +2274,8 @@ int GreedyApproach<VDim, TReal>
         }
       gout.printf("  Avg. Integration Time     : %6.4fs  %5.2f%% \n", t_update, 100 * t_update / t_total);
       gout.printf("  Avg. Total Iteration Time : %6.4fs \n", t_total);
+      if(active_set)
+        gout.printf("  Avg. Active Set Fraction  : %5.2f%% \n", 100 * as_fraction / n_it);
       }
 
       // Deallocate the incompressibility solver
@@ -1643,6 +2288,10 @@ int GreedyApproach<VDim, TReal>
   // into physical offset units - just scaled by the spacing?
   ImageBaseType *warp_ref_space = of_helper.GetMovingReferenceSpace(nlevels - 1);
 
+  // If the registration domain was cropped, the warps are written in the full space
+  if(m_UncroppedMovingSpace)
+    warp_ref_space = m_UncroppedMovingSpace;
+
   if(param.flag_stationary_velocity_mode)
     {
     // Take current warp to 'exponent' power - this is the actual warp
@@ -1653,26 +2302,26 @@ int GreedyApproach<VDim, TReal>
     // Write the resulting transformation field (if provided)
     if(param.output.size())
       {
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevelExp, param.output.c_str(), param.warp_precision);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, UncropWarp(uLevelExp), param.output.c_str(), param.warp_precision);
       }
 
     // If asked to write root warp, do so
     if(param.root_warp.size())
       {
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevel, param.root_warp.c_str(), 0);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, UncropWarp(uLevel), param.root_warp.c_str(), 0);
       }
 
     // Compute the inverse (this is probably unnecessary for small warps)
     if(param.inverse_warp.size())
       {
       of_helper.ComputeDeformationFieldInverse(uLevel, uLevelWork, 0);
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevelWork, param.inverse_warp.c_str(), param.warp_precision);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, UncropWarp(uLevelWork), param.inverse_warp.c_str(), param.warp_precision);
       }
     }
   else
     {
     // Write the resulting transformation field
-    WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevel, param.output.c_str(), param.warp_precision);
+    WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, UncropWarp(uLevel), param.output.c_str(), param.warp_precision);
 
     // If an inverse is requested, compute the inverse using the Chen 2008 fixed method.
     // A modification of this method is that if convergence is slow, we take the square
@@ -1691,7 +2340,7 @@ int GreedyApproach<VDim, TReal>
       of_helper.ComputeDeformationFieldInverse(uLevel, uInverse, param.warp_exponent);
 
       // Write the warp using compressed format
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uInverse, param.inverse_warp.c_str(), param.warp_precision);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, UncropWarp(uInverse), param.inverse_warp.c_str(), param.warp_precision);
       }
     }
   return 0;
@@ -1700,6 +2349,35 @@ int GreedyApproach<VDim, TReal>
 
 
 
+template <unsigned int VDim, typename TReal>
+typename GreedyApproach<VDim, TReal>::ImageBaseType::Pointer
+GreedyApproach<VDim, TReal>
+::CreateControlLattice(ImageBaseType *ref, int factor)
+{
+  // Lattice node j lies on voxel j * factor of the reference space, and the lattice
+  // extends past the last voxel so that the whole reference space is interpolated
+  typename ImageBaseType::Pointer lattice = ImageBaseType::New();
+  lattice->CopyInformation(ref);
+
+  typename ImageBaseType::SpacingType spacing = ref->GetSpacing();
+  itk::Size<VDim> size;
+  for(unsigned int d = 0; d < VDim; d++)
+    {
+    unsigned long n = ref->GetBufferedRegion().GetSize()[d];
+    size[d] = (n + factor - 2) / factor + 1;
+    spacing[d] *= factor;
+    }
+
+  // The origin is that of the first voxel of the buffered region
+  typename ImageBaseType::PointType origin;
+  ref->TransformIndexToPhysicalPoint(ref->GetBufferedRegion().GetIndex(), origin);
+
+  lattice->SetSpacing(spacing);
+  lattice->SetOrigin(origin);
+  lattice->SetRegions(itk::ImageRegion<VDim>(size));
+  return lattice;
+}
+
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::WriteCompressedWarpInPhysicalSpaceViaCache(
@@ -1893,61 +2571,125 @@ int GreedyApproach<VDim, TReal>
   // Reference space
   ImageBaseType *refspace = of_helper.GetReferenceSpace(0);
 
-  // Intermediate images
+  // Output images
   VectorImagePointer u_best = LDDMMType::new_vimg(refspace);
-  VectorImagePointer u_curr = LDDMMType::new_vimg(refspace);
-  ImagePointer m_curr = LDDMMType::new_img(refspace);
   ImagePointer m_best = LDDMMType::new_img(refspace);
 
-  // Allocate m_best to a negative value
-  m_best->FillBuffer(-100.0);
-
-  // Create a neighborhood for computing offsets
-  itk::Neighborhood<float, VDim> dummy_nbr;
+  // Each offset is evaluated with shifted box sums, without interpolating the moving image
   itk::Size<VDim> search_rad = array_caster<VDim>::to_itkSize(param.brute_search_radius);
   itk::Size<VDim> metric_rad = array_caster<VDim>::to_itkSize(param.metric_radius);
-  dummy_nbr.SetRadius(search_rad);
+  unsigned long n_updates = of_helper.ComputeNCCBruteForceSearch(
+        0, metric_rad, search_rad, param.flag_brute_subvoxel, m_best, u_best);
+
+  GreedyStdOut gout(param.verbosity);
+  gout.printf("Brute force search: %lu updates\n", n_updates);
+
+  LDDMMType::vimg_write(u_best, param.output.c_str());
+
+  if(param.brute_metric_output.size())
+    LDDMMType::img_write(m_best, param.brute_metric_output.c_str());
+
+  return 0;
+}
+
+
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
+
+template <unsigned int VDim, typename TReal>
+int GreedyApproach<VDim, TReal>
+::RunBlockMatch(GreedyParameters &param)
+{
+  // Check for valid parameters
+  if(param.metric != GreedyParameters::NCC)
+    throw GreedyException("Block matching requires NCC metric only");
+
+  if(param.block_match_param.search_radius.size() != VDim)
+    throw GreedyException("Block matching search radius must be same dimension as the images");
+
+  // Create an optical flow helper object
+  OFHelperType of_helper;
+  int nlevels = param.block_match_param.levels;
+  of_helper.SetDefaultPyramidFactors(nlevels);
+
+  // Read the image pairs to register
+  ReadImages(param, of_helper);
+
+  GreedyStdOut gout(param.verbosity);
+
+  // The full search is only done at the coarsest level. At finer levels, each block
+  // only searches one voxel around the candidates inherited from the coarser level
+  itk::Size<VDim> metric_rad = array_caster<VDim>::to_itkSize(param.metric_radius);
+  itk::Size<VDim> coarse_rad = array_caster<VDim>::to_itkSize(param.block_match_param.search_radius);
+  itk::Size<VDim> fine_rad; fine_rad.Fill(1);
 
-  // Iterate over all offsets
-  for(int k = 0; k < dummy_nbr.Size(); k++)
+  typedef typename OFHelperType::MultiComponentImageType MultiComponentImageType;
+  typename MultiComponentImageType::Pointer bm;
+  for(int level = 0; level < nlevels; level++)
     {
-    // Get the offset corresponding to this iteration
-    itk::Offset<VDim> offset = dummy_nbr.GetOffset(k);
+    bm = of_helper.ComputeNCCBlockMatch(
+           level, metric_rad, level == 0 ? coarse_rad : fine_rad,
+           param.block_match_param.candidates, bm);
+
+    gout.printf("Block matching level %d: %lu blocks\n",
+                level, (unsigned long) bm->GetBufferedRegion().GetNumberOfPixels());
+    }
 
-    // Fill the deformation field with this offset
-    typename LDDMMType::Vec vec_offset;
-    for(int i = 0; i < VDim; i++)
-      vec_offset[i] = offset[i];
-    u_curr->FillBuffer(vec_offset);
+  // Scatter the best offset of each block, weighted by its NCC, onto the finest grid.
+  // The last component holds the weights, so that smoothing the composite performs
+  // normalized convolution of the sparse offsets
+  int last = nlevels - 1;
+  ImageBaseType *refspace = of_helper.GetReferenceSpace(last);
+  CompositeImagePointer accum = LDDMMType::new_cimg(refspace, VDim + 1);
 
-    // Perform interpolation and metric computation
-    MultiComponentMetricReport metric_report;
-    of_helper.ComputeNCCMetricImage(0, u_curr, metric_rad, m_curr, metric_report);
+  typename CompositeImageType::PixelType apix(VDim + 1);
+  for(itk::ImageRegionConstIteratorWithIndex<MultiComponentImageType> it(bm, bm->GetBufferedRegion());
+      !it.IsAtEnd(); ++it)
+    {
+    typename MultiComponentImageType::PixelType bpix = it.Get();
+    TReal w = bpix[0];
+    if(!(w > 0.0))
+      continue;
 
-    // Temp: keep track of number of updates
-    unsigned long n_updates = 0;
+    typename ImageBaseType::PointType ptBlock;
+    itk::Index<VDim> idx;
+    bm->TransformIndexToPhysicalPoint(it.GetIndex(), ptBlock);
+    if(!refspace->TransformPhysicalPointToIndex(ptBlock, idx))
+      continue;
 
-    // Out of laziness, just take a quick pass over the images
-    typename VectorImageType::RegionType rgn = refspace->GetBufferedRegion();
-    itk::ImageRegionIterator<VectorImageType> it_u(u_best, rgn);
-    itk::ImageRegionConstIterator<ImageType> it_m_curr(m_curr, rgn);
-    itk::ImageRegionIterator<ImageType> it_m_best(m_best, rgn);
-    for(; !it_m_best.IsAtEnd(); ++it_m_best, ++it_m_curr, ++it_u)
+    // Offsets are stored in physical units along the image axes
+    for(unsigned int d = 0; d < VDim; d++)
+      apix[d] = w * bpix[1 + d] / refspace->GetSpacing()[d];
+    apix[VDim] = w;
+    accum->SetPixel(idx, apix);
+    }
+
+  // Smoothing defaults to the block size
+  typename LDDMMType::Vec sigmas;
+  if(param.block_match_param.sigma > 0)
+    sigmas = of_helper.GetSmoothingSigmasInPhysicalUnits(last, param.block_match_param.sigma, false);
+  else
+    for(unsigned int d = 0; d < VDim; d++)
+      sigmas[d] = bm->GetSpacing()[d];
+
+  LDDMMType::cimg_smooth(accum, accum, sigmas);
+
+  // Normalize to obtain a dense warp in voxel units
+  VectorImagePointer warp = LDDMMType::new_vimg(refspace);
+  itk::ImageRegionConstIterator<CompositeImageType> ita(accum, accum->GetBufferedRegion());
+  itk::ImageRegionIterator<VectorImageType> itw(warp, warp->GetBufferedRegion());
+  for(; !itw.IsAtEnd(); ++ita, ++itw)
+    {
+    const typename CompositeImageType::PixelType &p = ita.Get();
+    if(p[VDim] > 1.0e-6)
       {
-      float v_curr = it_m_curr.Value();
-      if(v_curr > it_m_best.Value())
-        {
-        it_m_best.Set(v_curr);
-        it_u.Set(vec_offset);
-        ++n_updates;
-        }
+      for(unsigned int d = 0; d < VDim; d++)
+        itw.Value()[d] = p[d] / p[VDim];
       }
-
-    std::cout << "offset: " << offset << "     updates: " << n_updates << std::endl;
     }
 
-  LDDMMType::vimg_write(u_best, param.output.c_str());
-  LDDMMType::img_write(m_best, "mbest.nii.gz");
+  // Write the warp in the same format as deformable registration, so it can be used with -id
+  of_helper.WriteCompressedWarpInPhysicalSpace(last, warp, param.output.c_str(), param.warp_precision);
 
   return 0;
 }
@@ -2091,7 +2833,6 @@ protected:
 #include "itkMeshFileReader.h"
 #include "itkMeshFileWriter.h"
 #include "itkMesh.h"
-#include "itkTransformMeshFilter.h"
 
 template <unsigned int VDim, typename TArray>
 class PhysicalCoordinateTransform
@@ -2159,81 +2900,233 @@ public:
 
 
 
+#include "itkMultiThreader.h"
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+/**
+ * Applies a warp, defined in the space of a reference image, to a large set of
+ * points. Points are stored in a flat array in NIFTI/RAS coordinates, which is
+ * our convention for meshes. The mapping from RAS coordinates to the continuous
+ * voxel index of the warp is precomputed as an affine, and the points are split
+ * into batches that are processed in parallel, each with its own interpolator.
+ */
 template <unsigned int VDim, typename TReal>
-class WarpMeshTransformFunctor : public itk::DataObject
+class BulkPointWarper
 {
 public:
-  typedef WarpMeshTransformFunctor<VDim, TReal>       Self;
-  typedef itk::DataObject                             Superclass;
-  typedef itk::SmartPointer<Self>                     Pointer;
-  typedef itk::SmartPointer<const Self>               ConstPointer;
-
-  itkTypeMacro(WarpMeshTransformFunctor, itk::DataObject)
-  itkNewMacro(Self)
-
-  typedef GreedyApproach<VDim, TReal> GreedyAPI;
-  typedef typename GreedyAPI::VectorImageType VectorImageType;
-  typedef typename GreedyAPI::ImageBaseType ImageBaseType;
+  typedef BulkPointWarper<VDim, TReal>                Self;
+  typedef GreedyApproach<VDim, TReal>                 GreedyAPI;
+  typedef typename GreedyAPI::VectorImageType         VectorImageType;
+  typedef typename GreedyAPI::ImageBaseType           ImageBaseType;
   typedef FastLinearInterpolator<VectorImageType, TReal, VDim> FastInterpolator;
-  typedef itk::ContinuousIndex<TReal, VDim> CIndexType;
-  typedef itk::Point<TReal, VDim> PointType;
+  typedef itk::Point<TReal, VDim>                     PointType;
 
-  void SetWarp(VectorImageType *warp)
+  BulkPointWarper(VectorImageType *warp, ImageBaseType *ref)
+    : m_Warp(warp)
   {
-    if(m_Interpolator) delete m_Interpolator;
-    m_Interpolator = new FastInterpolator(warp);
+    // Signs that map RAS coordinates to LPS and back
+    PointType ones, flip;
+    ones.Fill(1.0);
+    PhysicalCoordinateTransform<VDim, PointType>::ras_to_lps(ones, flip);
+
+    // The continuous index is P * (S * x - origin), with S the sign flip
+    for(unsigned int a = 0; a < VDim; a++)
+      {
+      m_Flip[a] = flip[a];
+      m_Offset[a] = 0.0;
+      for(unsigned int b = 0; b < VDim; b++)
+        {
+        m_Matrix[a][b] = ref->GetPhysicalPointToIndexMatrix()(a, b) * flip[b];
+        m_Offset[a] -= ref->GetPhysicalPointToIndexMatrix()(a, b) * ref->GetOrigin()[b];
+        }
+      }
   }
 
-  void SetReferenceSpace(ImageBaseType *ref)
+  // Apply the warp to n points stored as consecutive VDim-tuples
+  void TransformPoints(double *points, size_t n)
   {
-    m_ReferenceSpace = ref;
+    ThreadData td;
+    td.self = this;
+    td.points = points;
+    td.n = n;
+
+    itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+    mt->SetSingleMethod(&Self::ThreadCallback, &td);
+    mt->SingleMethodExecute();
   }
 
-  PointType TransformPoint(const PointType &x)
+  // Whether the file is a point list rather than a mesh
+  static bool IsPointFile(const std::string &fn)
   {
-    // Our convention is to use NIFTI/RAS coordinates for meshes, whereas ITK
-    // uses the DICOM/LPS convention. We transform point to LPS first
-    PointType x_lps, phi_x;
+    std::string ext = itksys::SystemTools::GetFilenameLastExtension(fn);
+    return ext == ".csv" || ext == ".gpt";
+  }
 
-    PhysicalCoordinateTransform<VDim, PointType>::ras_to_lps(x, x_lps);
+  // Read points from a CSV file (first VDim columns) or a binary .gpt file
+  static void ReadPoints(const std::string &fn, std::vector<double> &pts)
+  {
+    std::ifstream fin(fn.c_str(), std::ios::binary);
+    if(!fin.good())
+      throw GreedyException("Unable to read point file %s", fn.c_str());
 
-    CIndexType cix;
-    typename VectorImageType::PixelType vec;
-    vec.Fill(0.0);
-    m_ReferenceSpace->TransformPhysicalPointToContinuousIndex(x_lps, cix);
-    m_Interpolator->Interpolate(cix.GetDataPointer(), &vec);
+    pts.clear();
+    if(itksys::SystemTools::GetFilenameLastExtension(fn) == ".gpt")
+      {
+      // Binary format: magic, dimension, number of points, then the coordinates
+      char magic[4];
+      unsigned int dim;
+      unsigned long long n;
+      fin.read(magic, 4);
+      fin.read((char *) &dim, sizeof(dim));
+      fin.read((char *) &n, sizeof(n));
+      if(!fin.good() || strncmp(magic, "GPTS", 4) != 0)
+        throw GreedyException("File %s is not a binary point file", fn.c_str());
+      if(dim != VDim)
+        throw GreedyException("Binary point file %s has dimension %d", fn.c_str(), dim);
+
+      pts.resize(n * VDim);
+      fin.read((char *) pts.data(), pts.size() * sizeof(double));
+      if(!fin.good())
+        throw GreedyException("Binary point file %s is truncated", fn.c_str());
+      return;
+      }
 
-    for(int d = 0; d < VDim; d++)
+    // Read the whole CSV file and parse it in place
+    std::string buffer((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    const char *p = buffer.c_str(), *end = p + buffer.size();
+    int line = 0;
+    while(p < end)
       {
-      phi_x[d] = vec[d] + x_lps[d];
+      const char *eol = (const char *) memchr(p, '\n', end - p);
+      if(!eol) eol = end;
+      line++;
+
+      // Skip blank lines
+      const char *q = p;
+      while(q < eol && isspace(*q)) q++;
+      if(q < eol)
+        {
+        for(unsigned int a = 0; a < VDim; a++)
+          {
+          char *next;
+          double v = strtod(q, &next);
+          if(next == q || next > eol)
+            throw GreedyException("Error reading CSV file %s, line %d", fn.c_str(), line);
+          pts.push_back(v);
+          q = next;
+
+          // Skip the separator
+          if(a < VDim - 1)
+            {
+            while(q < eol && *q != ',') q++;
+            if(q == eol)
+              throw GreedyException("Error reading CSV file %s, line %d", fn.c_str(), line);
+            q++;
+            }
+          }
+        }
+
+      p = eol + 1;
       }
+  }
 
+  // Write points to a CSV file or a binary .gpt file
+  static void WritePoints(const std::string &fn, const std::vector<double> &pts)
+  {
+    FILE *f = fopen(fn.c_str(), "wb");
+    if(!f)
+      throw GreedyException("Unable to write point file %s", fn.c_str());
 
-    PhysicalCoordinateTransform<VDim, PointType>::lps_to_ras(phi_x, phi_x);
+    size_t n = pts.size() / VDim;
+    if(itksys::SystemTools::GetFilenameLastExtension(fn) == ".gpt")
+      {
+      unsigned int dim = VDim;
+      unsigned long long n_out = n;
+      fwrite("GPTS", 1, 4, f);
+      fwrite(&dim, sizeof(dim), 1, f);
+      fwrite(&n_out, sizeof(n_out), 1, f);
+      fwrite(pts.data(), sizeof(double), pts.size(), f);
+      }
+    else
+      {
+      char line[VDim * 32];
+      for(size_t i = 0; i < n; i++)
+        {
+        int len = 0;
+        for(unsigned int a = 0; a < VDim; a++)
+          len += snprintf(line + len, sizeof(line) - len, "%.8g%c",
+                          pts[i * VDim + a], a < VDim - 1 ? ',' : '\n');
+        fwrite(line, 1, len, f);
+        }
+      }
 
-    return phi_x;
+    fclose(f);
   }
 
 protected:
 
-  WarpMeshTransformFunctor() { m_Interpolator = NULL; }
-  ~WarpMeshTransformFunctor()
+  struct ThreadData
   {
-    if(m_Interpolator)
-      delete m_Interpolator;
+    Self *self;
+    double *points;
+    size_t n;
+  };
+
+  static ITK_THREAD_RETURN_TYPE ThreadCallback(void *arg)
+  {
+    typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+    ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+    ThreadData *td = static_cast<ThreadData *>(info->UserData);
+
+    // Each thread gets a contiguous batch of points
+    size_t n_threads = info->NumberOfThreads;
+    size_t batch = (td->n + n_threads - 1) / n_threads;
+    size_t i0 = info->ThreadID * batch, i1 = std::min(td->n, i0 + batch);
+    if(i0 < i1)
+      td->self->TransformBatch(td->points, i0, i1);
+
+    return ITK_THREAD_RETURN_VALUE;
   }
 
-private:
+  void TransformBatch(double *points, size_t i0, size_t i1)
+  {
+    FastInterpolator interp(m_Warp);
+    TReal cix[VDim];
+    typename VectorImageType::PixelType vec;
+    for(size_t i = i0; i < i1; i++)
+      {
+      double *x = points + i * VDim;
+      for(unsigned int a = 0; a < VDim; a++)
+        {
+        cix[a] = m_Offset[a];
+        for(unsigned int b = 0; b < VDim; b++)
+          cix[a] += m_Matrix[a][b] * x[b];
+        }
 
-  typename ImageBaseType::Pointer m_ReferenceSpace;
-  FastInterpolator *m_Interpolator;
+      vec.Fill(0.0);
+      interp.Interpolate(cix, &vec);
 
+      // The displacement is in LPS space
+      for(unsigned int a = 0; a < VDim; a++)
+        x[a] += m_Flip[a] * vec[a];
+      }
+  }
+
+private:
+  VectorImageType *m_Warp;
+  double m_Matrix[VDim][VDim], m_Offset[VDim], m_Flip[VDim];
 };
 
 /**
  * This code computes the jacobian determinant field for a deformation. The
  * recommended mode for this computation is to take the k-th root of the input
- * transformation and then compose the Jacobians
+ * transformation and then compose the Jacobians. Unless the root warp folds,
+ * only the scalar log determinant is carried through the composition. With -exp 0,
+ * det(I + Du) is computed directly from the input warp
  */
 template <unsigned int VDim, typename TReal>
 int GreedyApproach<VDim, TReal>
@@ -2248,47 +3141,81 @@ int GreedyApproach<VDim, TReal>
   // Convert the warp file into voxel units from physical units
   OFHelperType::PhysicalWarpToVoxelWarp(warp, warp, warp);
 
+  // The output determinant image
+  ImagePointer jac_det = ImageType::New();
+  LDDMMType::alloc_img(jac_det, warp);
+
+  // With a zero exponent, compute det(I + Du) directly from the warp
+  if(param.warp_exponent == 0)
+    {
+    LDDMMType::field_jacobian_det_direct(warp, jac_det);
+    LDDMMType::img_write(jac_det, param.jacobian_param.out_det_jac.c_str(), itk::ImageIOBase::FLOAT);
+    return 0;
+    }
+
   // Compute the root of the warp
   VectorImagePointer root_warp = VectorImageType::New();
   LDDMMType::alloc_vimg(root_warp, warp);
+  OFHelperType::ComputeWarpRoot(warp, root_warp, param.warp_exponent);
 
-  // Allocate a working warp
-  VectorImagePointer work_warp = VectorImageType::New();
-  LDDMMType::alloc_vimg(work_warp, warp);
+  // The input warp is no longer needed, use it as the working warp
+  VectorImagePointer work_warp = warp;
 
-  // Compute the root warp, which is not stored in the variable warp
-  OFHelperType::ComputeWarpRoot(warp, root_warp, param.warp_exponent);
+  // The log determinant cannot represent folding, so if the root warp folds anywhere, the
+  // Jacobian matrices are composed instead, which preserves the sign of the determinant
+  LDDMMType::field_jacobian_det_direct(root_warp, jac_det);
+  TReal det_min, det_max;
+  LDDMMType::img_min_max(jac_det, det_min, det_max);
+  if(det_min <= 0.0)
+    {
+    typedef typename LDDMMType::MatrixImageType JacobianImageType;
+    typename JacobianImageType::Pointer jac = LDDMMType::new_mimg(warp);
+    typename JacobianImageType::Pointer jac_work = LDDMMType::new_mimg(warp);
+
+    // Compute the Jacobian matrix of the root warp; jac[a] = D_a (warp)
+    LDDMMType::field_jacobian(root_warp, jac);
+    for(int k = 0; k < param.warp_exponent; k++)
+      {
+      // Compute the composition of the Jacobian with itself
+      LDDMMType::jacobian_of_composition(jac, jac, root_warp, jac_work);
 
-  // Initialize empty array of Jacobians
-  typedef typename LDDMMType::MatrixImageType JacobianImageType;
-  typename JacobianImageType::Pointer jac = LDDMMType::new_mimg(warp);
+      // Swap the pointers, so jac points to the actual composed jacobian
+      typename JacobianImageType::Pointer temp = jac_work.GetPointer();
+      jac_work = jac.GetPointer();
+      jac = temp.GetPointer();
 
-  typename JacobianImageType::Pointer jac_work = LDDMMType::new_mimg(warp);
+      // Compute the composition of the warp with itself, place into root_warp
+      LDDMMType::interp_vimg(root_warp, root_warp, 1.0, work_warp);
+      LDDMMType::vimg_add_in_place(root_warp, work_warp);
+      }
+
+    // jac+I holds the Jacobian of the original warp
+    LDDMMType::mimg_det(jac, 1.0, jac_det);
+    LDDMMType::img_write(jac_det, param.jacobian_param.out_det_jac.c_str(), itk::ImageIOBase::FLOAT);
+    return 0;
+    }
 
-  // Compute the Jacobian of the root warp
-  LDDMMType::field_jacobian(root_warp, jac);
+  // Compute the log Jacobian determinant of the root warp. Since
+  // det D(f o f)(x) = det Df(f(x)) det Df(x), the log determinant of the
+  // composition is the sum of the log determinant and its warped copy
+  ImagePointer log_det = jac_det, log_det_work = LDDMMType::new_img(warp);
+  for(itk::ImageRegionIterator<ImageType> it(log_det, log_det->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    it.Set(std::log(it.Get()));
 
-  // Compute the Jacobian matrix of the root warp; jac[a] = D_a (warp)
   for(int k = 0; k < param.warp_exponent; k++)
     {
-    // Compute the composition of the Jacobian with itself
-    LDDMMType::jacobian_of_composition(jac, jac, root_warp, jac_work);
-
-    // Swap the pointers, so jac points to the actual composed jacobian
-    typename JacobianImageType::Pointer temp = jac_work.GetPointer();
-    jac_work = jac.GetPointer();
-    jac = temp.GetPointer();
+    // Propagate the log determinant through the composition
+    LDDMMType::interp_img(log_det, root_warp, log_det_work);
+    LDDMMType::img_add_in_place(log_det, log_det_work);
 
     // Compute the composition of the warp with itself, place into root_warp
     LDDMMType::interp_vimg(root_warp, root_warp, 1.0, work_warp);
     LDDMMType::vimg_add_in_place(root_warp, work_warp);
     }
 
-  // At this point, root_warp should hold the original warp, and jac+I will hold
-  // the Jacobian of the original warp. We need to compute the determinant
-  ImagePointer jac_det = ImageType::New();
-  LDDMMType::alloc_img(jac_det, warp);
-  LDDMMType::mimg_det(jac, 1.0, jac_det);
+  // Exponentiate to get the determinant
+  for(itk::ImageRegionIterator<ImageType> it(jac_det, jac_det->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    it.Set(std::exp(it.Get()));
 
   // Write the computed Jacobian
   LDDMMType::img_write(jac_det, param.jacobian_param.out_det_jac.c_str(), itk::ImageIOBase::FLOAT);
@@ -2303,6 +3230,216 @@ class CompositeToLabelFunctor
     short operator () (itk::VariableLengthVector<TReal> const &p) const { return (short) p[0]; }
 };
 
+template <unsigned int VDim, typename TReal>
+template <class TLabel>
+void GreedyApproach<VDim, TReal>
+::ResliceNativeImageNN(const ResliceSpec &spec, VectorImageType *warp)
+{
+  typedef itk::VectorImage<TLabel, VDim> LabelImageType;
+  typename LabelImageType::Pointer moving = ReadImageViaCache<LabelImageType>(spec.moving);
+
+  typedef FastNearestNeighborWarpImageFilter<LabelImageType, VectorImageType> WarpFilter;
+  typename WarpFilter::Pointer filter = WarpFilter::New();
+  filter->SetDeformationField(warp);
+  filter->SetMovingImage(moving);
+  filter->SetOutsideValue((TLabel) spec.interp.outside_value);
+  filter->Update();
+
+  WriteImageViaCache(filter->GetOutput(), spec.output);
+}
+
+template <unsigned int VDim, typename TReal>
+itk::ImageIOBase::IOComponentType
+GreedyApproach<VDim, TReal>
+::ReadComponentTypeViaCache(const std::string &filename)
+{
+  // The component type of cached images is unknown
+  if(m_ImageCache.find(filename) != m_ImageCache.end())
+    return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+
+  // Read the header of the image to find the component type
+  itk::ImageIOBase::Pointer io =
+      itk::ImageIOFactory::CreateImageIO(filename.c_str(), itk::ImageIOFactory::ReadMode);
+  if(!io)
+    return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  io->SetFileName(filename.c_str());
+  io->ReadImageInformation();
+  return io->GetComponentType();
+}
+
+template <unsigned int VDim, typename TReal>
+typename GreedyApproach<VDim, TReal>::ImageBaseType::Pointer
+GreedyApproach<VDim, TReal>
+::ReadImageHeaderViaCache(const std::string &filename, int &ncomp,
+                          itk::ImageIOBase::IOComponentType &comp)
+{
+  // Cached images are already in memory
+  if(m_ImageCache.find(filename) != m_ImageCache.end())
+    {
+    CompositeImagePointer image = ReadImageViaCache<CompositeImageType>(filename, &comp);
+    ncomp = image->GetNumberOfComponentsPerPixel();
+    typename ImageBaseType::Pointer pointer = image.GetPointer();
+    return pointer;
+    }
+
+  // Read the image information only, the output has no pixel buffer
+  typedef itk::ImageFileReader<CompositeImageType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(filename.c_str());
+  reader->UpdateOutputInformation();
+  ncomp = reader->GetImageIO()->GetNumberOfComponents();
+  comp = reader->GetImageIO()->GetComponentType();
+
+  typename ImageBaseType::Pointer pointer = reader->GetOutput();
+  return pointer;
+}
+
+template <unsigned int VDim, typename TReal>
+bool GreedyApproach<VDim, TReal>
+::ResliceIntegerImageNN(const ResliceSpec &spec, VectorImageType *warp)
+{
+  // Cached outputs are floating point images, so they are handled by the float path
+  if(m_ImageCache.find(spec.output) != m_ImageCache.end())
+    return false;
+
+  switch(ReadComponentTypeViaCache(spec.moving))
+    {
+    case itk::ImageIOBase::UCHAR: ResliceNativeImageNN<unsigned char>(spec, warp); return true;
+    case itk::ImageIOBase::CHAR: ResliceNativeImageNN<char>(spec, warp); return true;
+    case itk::ImageIOBase::USHORT: ResliceNativeImageNN<unsigned short>(spec, warp); return true;
+    case itk::ImageIOBase::SHORT: ResliceNativeImageNN<short>(spec, warp); return true;
+    case itk::ImageIOBase::UINT: ResliceNativeImageNN<unsigned int>(spec, warp); return true;
+    case itk::ImageIOBase::INT: ResliceNativeImageNN<int>(spec, warp); return true;
+    case itk::ImageIOBase::ULONG: ResliceNativeImageNN<unsigned long>(spec, warp); return true;
+    case itk::ImageIOBase::LONG: ResliceNativeImageNN<long>(spec, warp); return true;
+    default: return false;
+    }
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ResliceImagesFused(const GreedyResliceParameters &r_param, VectorImageType *warp,
+                     ImageBaseType *ref, std::vector<bool> &done)
+{
+  // An image that takes part in fused reslicing. Only the header is read while the
+  // images are grouped, the pixels are read when the group is packed
+  struct FusedInput
+  {
+    int index, ncomp;
+    typename ImageBaseType::Pointer header;
+    itk::ImageIOBase::IOComponentType comp;
+  };
+
+  // Images are grouped if they have the same grid and the same interpolation options
+  std::vector< std::vector<FusedInput> > groups;
+  for(unsigned int i = 0; i < r_param.images.size(); i++)
+    {
+    const InterpSpec &interp = r_param.images[i].interp;
+    if(interp.mode == InterpSpec::LABELWISE)
+      continue;
+
+    // Integer images with nearest neighbor interpolation use the native path instead,
+    // unless the output is a cached (floating point) image
+    if(interp.mode == InterpSpec::NEAREST && !interp.jacobian_modulate
+       && m_ImageCache.find(r_param.images[i].output) == m_ImageCache.end())
+      {
+      itk::ImageIOBase::IOComponentType ct = ReadComponentTypeViaCache(r_param.images[i].moving);
+      if(ct != itk::ImageIOBase::UNKNOWNCOMPONENTTYPE
+         && ct != itk::ImageIOBase::FLOAT && ct != itk::ImageIOBase::DOUBLE)
+        continue;
+      }
+
+    FusedInput fi;
+    fi.index = i;
+    fi.header = ReadImageHeaderViaCache(r_param.images[i].moving, fi.ncomp, fi.comp);
+
+    unsigned int g = 0;
+    for(; g < groups.size(); g++)
+      {
+      const InterpSpec &gi = r_param.images[groups[g][0].index].interp;
+      ImageBaseType *ghdr = groups[g][0].header;
+      if(gi.mode == interp.mode && gi.outside_value == interp.outside_value
+         && gi.jacobian_modulate == interp.jacobian_modulate
+         && ghdr->GetLargestPossibleRegion() == fi.header->GetLargestPossibleRegion()
+         && ghdr->GetSpacing() == fi.header->GetSpacing()
+         && ghdr->GetOrigin() == fi.header->GetOrigin()
+         && ghdr->GetDirection() == fi.header->GetDirection())
+        break;
+      }
+
+    if(g == groups.size())
+      groups.push_back(std::vector<FusedInput>());
+    groups[g].push_back(fi);
+    }
+
+  // Reslice each group as a single composite image
+  for(unsigned int g = 0; g < groups.size(); g++)
+    {
+    std::vector<FusedInput> &grp = groups[g];
+    const InterpSpec &interp = r_param.images[grp[0].index].interp;
+
+    // Read the images of the group one at a time and pack them into a composite, so
+    // that at most one input is held next to the composite
+    CompositeImagePointer moving;
+    if(grp.size() == 1)
+      {
+      moving = ReadImageViaCache<CompositeImageType>(r_param.images[grp[0].index].moving);
+      }
+    else
+      {
+      int nc_total = 0;
+      for(unsigned int j = 0; j < grp.size(); j++)
+        nc_total += grp[j].ncomp;
+
+      for(int j = 0, off = 0; j < (int) grp.size(); j++)
+        {
+        CompositeImagePointer input =
+            ReadImageViaCache<CompositeImageType>(r_param.images[grp[j].index].moving);
+        if(j == 0)
+          moving = LDDMMType::new_cimg(input, nc_total);
+
+        int nc = grp[j].ncomp;
+        size_t nvox = moving->GetBufferedRegion().GetNumberOfPixels();
+        const TReal *src = input->GetBufferPointer();
+        TReal *trg = moving->GetBufferPointer() + off;
+        for(size_t v = 0; v < nvox; v++, src += nc, trg += nc_total)
+          for(int k = 0; k < nc; k++)
+            trg[k] = src[k];
+        off += nc;
+        }
+      }
+
+    // Perform the warp once for all images in the group
+    CompositeImagePointer warped = LDDMMType::new_cimg(ref, moving->GetNumberOfComponentsPerPixel());
+    LDDMMType::interp_cimg(moving, warp, warped, interp.mode == InterpSpec::NEAREST,
+                           true, interp.outside_value, interp.jacobian_modulate);
+    moving = NULL;
+
+    // Unpack and write the outputs
+    int nc_total = warped->GetNumberOfComponentsPerPixel();
+    size_t nvox = warped->GetBufferedRegion().GetNumberOfPixels();
+    for(int j = 0, off = 0; j < (int) grp.size(); j++)
+      {
+      CompositeImagePointer out = warped;
+      if(grp.size() > 1)
+        {
+        int nc = grp[j].ncomp;
+        out = LDDMMType::new_cimg(ref, nc);
+        const TReal *src = warped->GetBufferPointer() + off;
+        TReal *trg = out->GetBufferPointer();
+        for(size_t v = 0; v < nvox; v++, src += nc_total, trg += nc)
+          for(int k = 0; k < nc; k++)
+            trg[k] = src[k];
+        off += nc;
+        }
+
+      // Write, casting to the input component type
+      WriteImageViaCache(out.GetPointer(), r_param.images[grp[j].index].output.c_str(), grp[j].comp);
+      done[grp[j].index] = true;
+      }
+    }
+}
+
 /**
  * Run the reslice code - simply apply a warp or set of warps to images
  */
@@ -2349,9 +3486,17 @@ int GreedyApproach<VDim, TReal>
     }
 
 
+  // Reslice compatible images together if requested
+  std::vector<bool> done(r_param.images.size(), false);
+  if(r_param.flag_fused)
+    ResliceImagesFused(r_param, warp, ref, done);
+
   // Process image pairs
   for(int i = 0; i < r_param.images.size(); i++)
     {
+    if(done[i])
+      continue;
+
     const char *filename = r_param.images[i].moving.c_str();
 
     // Handle the special case of multi-label images
@@ -2361,6 +3506,8 @@ int GreedyApproach<VDim, TReal>
       typename CompositeImageType::Pointer moving = ReadImageViaCache<CompositeImageType>(filename);
       if(moving->GetNumberOfComponentsPerPixel() > 1)
         throw GreedyException("Label wise interpolation not supported for multi-component images");
+      if(r_param.images[i].interp.jacobian_modulate)
+        throw GreedyException("Jacobian modulation not supported with label wise interpolation");
 
       // Cast the image to an image of shorts
       typedef itk::Image<short, VDim> LabelImageType;
@@ -2454,6 +3601,12 @@ int GreedyApproach<VDim, TReal>
       }
     else
       {
+      // Nearest neighbor reslicing of integer images is done in the native voxel type
+      if(r_param.images[i].interp.mode == InterpSpec::NEAREST
+         && !r_param.images[i].interp.jacobian_modulate
+         && ResliceIntegerImageNN(r_param.images[i], warp))
+        continue;
+
       // Read the input image and record its type
       itk::ImageIOBase::IOComponentType comp;
       CompositeImagePointer moving = ReadImageViaCache<CompositeImageType>(filename, &comp);
@@ -2461,76 +3614,77 @@ int GreedyApproach<VDim, TReal>
       // Allocate the warped image
       CompositeImagePointer warped = LDDMMType::new_cimg(ref, moving->GetNumberOfComponentsPerPixel());
 
-      // Perform the warp
+      // Perform the warp, optionally modulating by the Jacobian determinant
       LDDMMType::interp_cimg(moving, warp, warped,
                              r_param.images[i].interp.mode == InterpSpec::NEAREST,
-                             true, r_param.images[i].interp.outside_value);
+                             true, r_param.images[i].interp.outside_value,
+                             r_param.images[i].interp.jacobian_modulate);
 
       // Write, casting to the input component type
       WriteImageViaCache(warped.GetPointer(), r_param.images[i].output.c_str(), comp);
       }
     }
 
-  // Process meshes
+  // Process meshes and point sets
+  typedef BulkPointWarper<VDim, TReal> PointWarperType;
+  PointWarperType point_warper(warp, ref);
   for(int i = 0; i < r_param.meshes.size(); i++)
     {
     typedef itk::Mesh<TReal, VDim> MeshType;
-    typedef itk::MeshFileReader<MeshType> MeshReader;
+    typedef typename MeshType::PointsContainer PointsContainer;
     typename MeshType::Pointer mesh;
+    std::vector<double> pts;
 
-    if(itksys::SystemTools::GetFilenameExtension(r_param.meshes[i].fixed) == ".csv")
+    if(PointWarperType::IsPointFile(r_param.meshes[i].fixed))
       {
-      mesh = MeshType::New();
-
-      std::ifstream fin(r_param.meshes[i].fixed.c_str());
-      std::string f_line, f_token;
-      unsigned int n_pts = 0;
-      while(std::getline(fin, f_line))
-        {
-        std::istringstream iss(f_line);
-        itk::Point<TReal, VDim> pt;
-        for(unsigned int a = 0; a < VDim; a++)
-          {
-          if(!std::getline(iss, f_token, ','))
-            throw GreedyException("Error reading CSV file, line %s", f_line.c_str());
-          pt[a] = atof(f_token.c_str());
-          }
-        mesh->SetPoint(n_pts++, pt);
-        }
+      PointWarperType::ReadPoints(r_param.meshes[i].fixed, pts);
       }
     else
       {
+      typedef itk::MeshFileReader<MeshType> MeshReader;
       typename MeshReader::Pointer reader = MeshReader::New();
       reader->SetFileName(r_param.meshes[i].fixed.c_str());
       reader->Update();
       mesh = reader->GetOutput();
-      }
-
-    typedef WarpMeshTransformFunctor<VDim, TReal> TransformType;
-    typename TransformType::Pointer transform = TransformType::New();
-    transform->SetWarp(warp);
-    transform->SetReferenceSpace(ref);
 
-    typedef itk::TransformMeshFilter<MeshType, MeshType, TransformType> FilterType;
-    typename FilterType::Pointer filter = FilterType::New();
-    filter->SetTransform(transform);
-    filter->SetInput(mesh);
-    filter->Update();
+      pts.reserve(mesh->GetNumberOfPoints() * VDim);
+      for(typename PointsContainer::ConstIterator it = mesh->GetPoints()->Begin();
+          it != mesh->GetPoints()->End(); ++it)
+        for(unsigned int a = 0; a < VDim; a++)
+          pts.push_back(it.Value()[a]);
+      }
 
-    mesh = filter->GetOutput();
+    // Warp all the points
+    point_warper.TransformPoints(pts.data(), pts.size() / VDim);
 
-    if(itksys::SystemTools::GetFilenameExtension(r_param.meshes[i].output) == ".csv")
+    if(PointWarperType::IsPointFile(r_param.meshes[i].output))
       {
-      std::ofstream out(r_param.meshes[i].output.c_str());
-      for(unsigned int i = 0; i < mesh->GetNumberOfPoints(); i++)
-        {
-        itk::Point<TReal, VDim> pt = mesh->GetPoint(i);
-        for(unsigned int a = 0; a < VDim; a++)
-          out << pt[a] << (a < VDim-1 ? "," : "\n");
-        }
+      PointWarperType::WritePoints(r_param.meshes[i].output, pts);
       }
     else
       {
+      // Place the points into the mesh, creating one if a point list was read
+      if(mesh)
+        {
+        const double *p_pts = pts.data();
+        for(typename PointsContainer::Iterator it = mesh->GetPoints()->Begin();
+            it != mesh->GetPoints()->End(); ++it, p_pts += VDim)
+          for(unsigned int a = 0; a < VDim; a++)
+            it.Value()[a] = p_pts[a];
+        }
+      else
+        {
+        mesh = MeshType::New();
+        unsigned int n_pts = pts.size() / VDim;
+        for(unsigned int k = 0; k < n_pts; k++)
+          {
+          itk::Point<TReal, VDim> pt;
+          for(unsigned int a = 0; a < VDim; a++)
+            pt[a] = pts[k * VDim + a];
+          mesh->SetPoint(k, pt);
+          }
+        }
+
       typedef itk::MeshFileWriter<MeshType> MeshWriter;
       typename MeshWriter::Pointer writer = MeshWriter::New();
       writer->SetInput(mesh);
@@ -2544,41 +3698,34 @@ int GreedyApproach<VDim, TReal>
   return 0;
 }
 
+#include "MultiComponentImageMomentsFilter.h"
+
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::ComputeImageMoments(CompositeImageType *image,
                       const std::vector<double> &weights,
-                      VecFx &m1, MatFx &m2)
+                      VecFx &m1, MatFx &m2, int downsample)
 {
-  int n = image->GetNumberOfComponentsPerPixel();
-  TReal sum_I = 0.0;
-  m1.fill(0.0); m2.fill(0.0);
-
-  typedef itk::ImageRegionConstIteratorWithIndex<CompositeImageType> Iterator;
-  for(Iterator it(image, image->GetBufferedRegion()); !it.IsAtEnd(); ++it)
-    {
-    typedef itk::Point<TReal, VDim> PointType;
-    PointType p_lps, p_ras;
-    image->TransformIndexToPhysicalPoint(it.GetIndex(), p_lps);
-    PhysicalCoordinateTransform<VDim, PointType>::lps_to_ras(p_lps, p_ras);
-    VecFx X(p_ras.GetDataPointer());
-    MatFx X2 = outer_product(X, X);
-
-    typename CompositeImageType::PixelType pix = it.Get();
+  // Compute the moments in LPS physical space
+  typedef MultiComponentImageMomentsFilter<CompositeImageType> MomentsFilter;
+  typename MomentsFilter::Pointer filter = MomentsFilter::New();
+  filter->SetInput(image);
+  filter->SetWeights(vnl_vector<double>(weights.data(), weights.size()));
+  filter->SetDownsampleFactor(downsample);
+  filter->Update();
 
-    // Just weight the components of intensity by weight vector - this sort of makes sense?
-    TReal val = 0.0;
-    for(int k = 0; k < n; k++)
-      val += weights[k] * pix[k];
+  // Map to RAS space, which only flips the sign of some coordinates
+  typedef itk::Point<TReal, VDim> PointType;
+  PointType p_ones, flip;
+  p_ones.Fill(1.0);
+  PhysicalCoordinateTransform<VDim, PointType>::lps_to_ras(p_ones, flip);
 
-    sum_I += val;
-    m1 += X * val;
-    m2 += X2 * val;
-    }
+  for(unsigned int a = 0; a < VDim; a++)
+    m1[a] = flip[a] * filter->GetMean()[a];
 
-  // Compute the mean and covariance from the sum of squares
-  m1 = m1 / sum_I;
-  m2 = (m2 - sum_I *  outer_product(m1, m1)) / sum_I;
+  for(unsigned int a = 0; a < VDim; a++)
+    for(unsigned int b = 0; b < VDim; b++)
+      m2(a, b) = flip[a] * flip[b] * filter->GetCovariance()(a, b);
 }
 
 template <unsigned int VDim, typename TReal>
@@ -2596,21 +3743,21 @@ int GreedyApproach<VDim, TReal>
   // Read the image pairs to register
   ReadImages(param, of_helper);
 
-  // Compute the moments of intertia for the fixed and moving images. For now
-  // this is done in an iterator loop, out of laziness. Should be converted to
-  // a filter if this whole moments business proves useful
+  // Compute the moments of intertia for the fixed and moving images
   VecFx m1f, m1m;
   MatFx m2f, m2m;
 
 
   std::cout << "--- MATCHING BY MOMENTS OF ORDER " << param.moments_order << " ---" << std::endl;
 
-  ComputeImageMoments(of_helper.GetFixedComposite(0), of_helper.GetWeights(), m1f, m2f);
+  ComputeImageMoments(of_helper.GetFixedComposite(0), of_helper.GetWeights(), m1f, m2f,
+                      param.moments_downsample);
 
   std::cout << "Fixed Mean        : " << m1f << std::endl;
   std::cout << "Fixed Covariance  : " << std::endl << m2f << std::endl;
 
-  ComputeImageMoments(of_helper.GetMovingComposite(0), of_helper.GetWeights(), m1m, m2m);
+  ComputeImageMoments(of_helper.GetMovingComposite(0), of_helper.GetWeights(), m1m, m2m,
+                      param.moments_downsample);
 
   std::cout << "Moving Mean       : " << m1m << std::endl;
   std::cout << "Moving Covariance : " << std::endl << m2m << std::endl;
@@ -2807,6 +3954,8 @@ MultiComponentMetricReport GreedyApproach<VDim, TReal>
   return MultiComponentMetricReport();
 }
 
+#include "ImageBufferPlacement.h"
+
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::ConfigThreads(const GreedyParameters &param)
@@ -2823,6 +3972,20 @@ void GreedyApproach<VDim, TReal>
     gout.printf("Executing with the default number of threads: %d\n",
                 itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
     }
+
+  ImageBufferPlacement::Settings &placement = ImageBufferPlacement::GetSettings();
+  placement.first_touch = param.flag_numa_first_touch;
+  placement.pin_threads = param.flag_numa_pin_threads;
+  placement.huge_pages = param.flag_numa_huge_pages;
+  if(placement.first_touch)
+    {
+    int n_nodes;
+    const std::vector<int> &cpus = ImageBufferPlacement::GetCPUList(&n_nodes);
+    gout.printf("NUMA placement: first-touch buffers%s%s, %d CPUs on %d node(s)\n",
+                placement.pin_threads ? ", pinned threads" : "",
+                placement.huge_pages ? ", huge pages" : "",
+                (int) cpus.size(), n_nodes);
+    }
 }
 
 template<unsigned int VDim, typename TReal>
@@ -2839,6 +4002,8 @@ int GreedyApproach<VDim, TReal>
       return Self::RunAffine(param);
     case GreedyParameters::BRUTE:
       return Self::RunBrute(param);
+    case GreedyParameters::BLOCK_MATCH:
+      return Self::RunBlockMatch(param);
     case GreedyParameters::MOMENTS:
       return Self::RunAlignMoments(param);
     case GreedyParameters::RESLICE:
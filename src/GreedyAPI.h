@@ -88,6 +88,8 @@ public:
 
   int RunBrute(GreedyParameters &param);
 
+  int RunBlockMatch(GreedyParameters &param);
+
   int RunReslice(GreedyParameters &param);
 
   int RunInvertWarp(GreedyParameters &param);
@@ -223,12 +225,73 @@ protected:
 
   void ReadImages(GreedyParameters &param, OFHelperType &ofhelper);
 
+  // Statistics of the fixed images (binned images for MI, dilated gradient masks for NCC)
+  // shared between the runs in a session that use the same fixed images, masks and pyramid.
+  // The statistics for all levels are kept until a run uses different fixed images
+  typedef std::map<std::string, itk::Object::Pointer> FixedStatisticsCache;
+  FixedStatisticsCache m_FixedStatisticsCache;
+
+  // Key identifying the fixed images and masks for the statistics cache, or an empty
+  // string if the statistics should not be shared
+  std::string GetFixedStatisticsKey(const GreedyParameters &param, const OFHelperType &ofhelper,
+                                    const std::vector<CompositeImagePointer> &fixed,
+                                    itk::Object *fixed_mask, itk::Object *gradient_mask);
+
+  // Stages of an iteration for which the number of threads is chosen separately
+  enum ThreadStage { STAGE_METRIC = 0, STAGE_SMOOTH, STAGE_COMPOSE };
+
+  // Number of threads for a stage at a level: the override in the parameters or, with
+  // automatic selection, enough threads for each to get a minimum amount of work (voxels
+  // times relative cost per voxel). Returns 0 to keep the default number of threads.
+  // The counts are applied through the process-wide ITK default, see ScopedDefaultThreads
+  static int GetStageThreads(const GreedyParameters &param, ThreadStage stage, int level,
+                             unsigned long n_voxels, double cost_per_voxel);
+
+  // Relative cost per voxel of computing the metric at a level
+  static double GetMetricCostPerVoxel(const GreedyParameters &param, OFHelperType &of_helper, int level);
+
+  // Create a control lattice that subsamples a reference space by an integer factor
+  static typename ImageBaseType::Pointer CreateControlLattice(ImageBaseType *ref, int factor);
+
+  // When the registration domain is cropped to the foreground (-crop-fg), these hold
+  // the full fixed and moving spaces and the crop region within them
+  typename ImageBaseType::Pointer m_UncroppedFixedSpace, m_UncroppedMovingSpace;
+  itk::ImageRegion<VDim> m_CropRegion;
+
+  // Paste a voxel-unit warp computed on the cropped domain into the full fixed space,
+  // with zero displacement outside of the crop region
+  VectorImagePointer UncropWarp(VectorImageType *warp);
+
   void ReadTransformChain(const std::vector<TransformSpec> &tran_chain,
                           ImageBaseType *ref_space,
                           VectorImagePointer &out_warp);
 
+  // Reslice groups of compatible images in a single pass over the warp. Images that are
+  // handled are marked in the done array
+  void ResliceImagesFused(const GreedyResliceParameters &r_param, VectorImageType *warp,
+                          ImageBaseType *ref, std::vector<bool> &done);
+
+  // Get the component type of an image file without reading it (unknown for cached images)
+  itk::ImageIOBase::IOComponentType ReadComponentTypeViaCache(const std::string &filename);
+
+  // Get the grid, number of components and component type of an image file without
+  // reading its pixels (for cached images, the cached image itself is returned)
+  typename ImageBaseType::Pointer ReadImageHeaderViaCache(const std::string &filename, int &ncomp,
+                                                          itk::ImageIOBase::IOComponentType &comp);
+
+  // Reslice an integer-valued image with nearest neighbor interpolation without
+  // converting it to floating point. Returns false if the image is not integer-valued
+  // or if the output is a cached image
+  bool ResliceIntegerImageNN(const ResliceSpec &spec, VectorImageType *warp);
+
+  // Nearest neighbor reslicing of an image with component type TLabel
+  template <class TLabel>
+  void ResliceNativeImageNN(const ResliceSpec &spec, VectorImageType *warp);
+
   // Compute the moments of a composite image (mean and covariance matrix of coordinate weighted by intensity)
-  void ComputeImageMoments(CompositeImageType *image, const std::vector<double> &weights, VecFx &m1, MatFx &m2);
+  // Only every k-th voxel along each dimension is used, where k is the downsample factor
+  void ComputeImageMoments(CompositeImageType *image, const std::vector<double> &weights,
+                           VecFx &m1, MatFx &m2, int downsample = 1);
 
 
 
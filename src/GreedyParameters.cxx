@@ -26,6 +26,8 @@
 =========================================================================*/
 #include "GreedyParameters.h"
 #include "CommandLineHelper.h"
+#include <cmath>
+#include <cstdlib>
 
 
 void
@@ -51,15 +53,41 @@ GreedyParameters
   param.warp_exponent = 6;
   param.warp_precision = 0.1;
   param.ncc_noise_factor = 0.001;
+  param.ncc_approx_exact_levels = -1;
+  param.control_lattice_factor = 1;
+  param.control_lattice_levels = 1;
+  param.active_set_threshold = 0.0;
+  param.active_set_period = 10;
+  param.active_set_block = 8;
+  param.tile_moving_rotation = -1.0;
+  param.tile_moving_displacement = -1.0;
   param.affine_init_mode = VOX_IDENTITY;
   param.affine_dof = GreedyParameters::DOF_AFFINE;
   param.affine_jitter = 0.5;
   param.flag_float_math = false;
+  param.flag_memory_lean = false;
+  param.flag_prewarp_per_level = false;
+  param.flag_anisotropic_pyramid = false;
+  param.flag_numa_first_touch = false;
+  param.flag_numa_pin_threads = false;
+  param.flag_numa_huge_pages = false;
+  param.flag_threads_auto = false;
+  param.auto_crop_pad = -1;
+  param.auto_crop_threshold = 0.0;
   param.flag_stationary_velocity_mode = false;
   param.flag_incompressibility_mode = false;
   param.flag_stationary_velocity_mode_use_lie_bracket = false;
   param.background = 0.0;
   param.current_weight = 1.0;
+  param.flag_brute_subvoxel = true;
+
+  // Reslice parameters
+  param.reslice_param.flag_fused = false;
+
+  // Block matching parameters
+  param.block_match_param.levels = 3;
+  param.block_match_param.candidates = 4;
+  param.block_match_param.sigma = 0.0;
 
   param.iter_per_level.push_back(100);
   param.iter_per_level.push_back(100);
@@ -68,6 +96,7 @@ GreedyParameters
   param.moments_flip_determinant = 0;
   param.flag_moments_id_covariance = false;
   param.moments_order = 1;
+  param.moments_downsample = 1;
   
   // Verbosity
   param.verbosity = VERB_DEFAULT;
@@ -83,6 +112,18 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->flag_float_math = true;
     }
+  else if(cmd == "-lean")
+    {
+    this->flag_memory_lean = true;
+    }
+  else if(cmd == "-it-levels")
+    {
+    this->flag_prewarp_per_level = true;
+    }
+  else if(cmd == "-pyr-aniso")
+    {
+    this->flag_anisotropic_pyramid = true;
+    }
   else if(cmd == "-n")
     {
     this->iter_per_level = cl.read_int_vector();
@@ -128,6 +169,41 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->ncc_noise_factor = cl.read_double();
     }
+  else if(cmd == "-ncc-approx")
+    {
+    this->ncc_approx_exact_levels = cl.command_arg_count() > 0 ? cl.read_integer() : 1;
+    if(this->ncc_approx_exact_levels < 0)
+      throw GreedyException("Parameter to -ncc-approx must be non-negative");
+    }
+  else if(cmd == "-lattice")
+    {
+    this->control_lattice_factor = cl.read_integer();
+    if(cl.command_arg_count() > 0)
+      this->control_lattice_levels = cl.read_integer();
+    if(this->control_lattice_factor < 1 || this->control_lattice_levels < 1)
+      throw GreedyException("Parameters to -lattice must be positive");
+    }
+  else if(cmd == "-active-set")
+    {
+    this->active_set_threshold = cl.read_double();
+    if(cl.command_arg_count() > 0)
+      this->active_set_period = cl.read_integer();
+    if(cl.command_arg_count() > 0)
+      this->active_set_block = cl.read_integer();
+    if(this->active_set_threshold < 0.0 || this->active_set_period < 1 || this->active_set_block < 1)
+      throw GreedyException("Invalid parameters to -active-set");
+    }
+  else if(cmd == "-tile-moving")
+    {
+    this->tile_moving_rotation = cl.read_double();
+    this->tile_moving_displacement = cl.read_double();
+    if(!(this->tile_moving_rotation < 90.0) || std::isnan(this->tile_moving_displacement))
+      throw GreedyException("Invalid parameters to -tile-moving (the rotation must be below 90 degrees)");
+    }
+  else if(cmd == "-moving-grad")
+    {
+    this->moving_gradient_levels = cl.read_int_vector();
+    }
   else if(cmd == "-s")
     {
     this->sigma_pre.sigma = cl.read_scalar_with_units(this->sigma_pre.physical_units);
@@ -217,6 +293,23 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->fixed_mask = cl.read_existing_filename();
     }
+  else if(cmd == "-crop-fg")
+    {
+    this->auto_crop_pad = cl.read_integer();
+    if(this->auto_crop_pad < 0)
+      throw GreedyException("Padding parameter to -crop-fg must be non-negative");
+
+    // The threshold may be negative, so an argument starting with '-' is taken to be
+    // the threshold rather than the next command if it is a number
+    if(!cl.is_at_end())
+      {
+      const char *arg = cl.peek_arg();
+      char *pend;
+      strtod(arg, &pend);
+      if(arg[0] != '-' || !*pend)
+        this->auto_crop_threshold = cl.read_double();
+      }
+    }
   else if(cmd == "-o")
     {
     this->output = cl.read_output_filename();
@@ -249,6 +342,36 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->threads = cl.read_integer();
     }
+  else if(cmd == "-threads-auto")
+    {
+    this->flag_threads_auto = true;
+    }
+  else if(cmd == "-threads-stage")
+    {
+    std::string stage = cl.read_string();
+    if(stage == "metric")
+      this->threads_metric = cl.read_int_vector();
+    else if(stage == "smooth")
+      this->threads_smooth = cl.read_int_vector();
+    else if(stage == "compose")
+      this->threads_compose = cl.read_int_vector();
+    else
+      throw GreedyException("Unknown stage %s for -threads-stage", stage.c_str());
+    }
+  else if(cmd == "-numa")
+    {
+    this->flag_numa_first_touch = true;
+    while(cl.command_arg_count() > 0)
+      {
+      std::string opt = cl.read_string();
+      if(opt == "pin")
+        this->flag_numa_pin_threads = true;
+      else if(opt == "thp")
+        this->flag_numa_huge_pages = true;
+      else
+        throw GreedyException("Unknown option to -numa: %s", opt.c_str());
+      }
+    }
   else if(cmd == "-a")
     {
     this->mode = GreedyParameters::AFFINE;
@@ -267,6 +390,35 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     this->mode = GreedyParameters::BRUTE;
     this->brute_search_radius = cl.read_int_vector();
     }
+  else if(cmd == "-brute-metric")
+    {
+    this->brute_metric_output = cl.read_output_filename();
+    }
+  else if(cmd == "-brute-int")
+    {
+    this->flag_brute_subvoxel = false;
+    }
+  else if(cmd == "-bm")
+    {
+    this->mode = GreedyParameters::BLOCK_MATCH;
+    this->block_match_param.search_radius = cl.read_int_vector();
+    }
+  else if(cmd == "-bm-levels")
+    {
+    this->block_match_param.levels = cl.read_integer();
+    if(this->block_match_param.levels < 1)
+      throw GreedyException("Parameter to -bm-levels must be positive");
+    }
+  else if(cmd == "-bm-topk")
+    {
+    this->block_match_param.candidates = cl.read_integer();
+    if(this->block_match_param.candidates < 1)
+      throw GreedyException("Parameter to -bm-topk must be positive");
+    }
+  else if(cmd == "-bm-sigma")
+    {
+    this->block_match_param.sigma = cl.read_double();
+    }
   else if(cmd == "-r")
     {
     this->mode = GreedyParameters::RESLICE;
@@ -324,6 +476,10 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->reslice_param.out_jacobian_image = cl.read_output_filename();
     }
+  else if(cmd == "-rfuse")
+    {
+    this->reslice_param.flag_fused = true;
+    }
   else if(cmd == "-oinv")
     {
     this->inverse_warp = cl.read_output_filename();
@@ -376,6 +532,10 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->current_interp.outside_value = cl.read_double();
     }
+  else if(cmd == "-rjm")
+    {
+    this->current_interp.jacobian_modulate = cl.read_integer() > 0;
+    }
   else if(cmd == "-wp")
     {
     this->warp_precision = cl.read_double();
@@ -391,6 +551,12 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->flag_moments_id_covariance = true;
     }
+  else if(cmd == "-moments-ds")
+    {
+    this->moments_downsample = cl.read_integer();
+    if(this->moments_downsample < 1)
+      throw GreedyException("Parameter to -moments-ds must be positive");
+    }
   else if(cmd == "-V")
     {
     int level = cl.read_integer();
@@ -458,9 +624,18 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->flag_float_math)
     oss << " -float ";
 
+  if(this->flag_memory_lean)
+    oss << " -lean";
+
+  if(this->flag_prewarp_per_level)
+    oss << " -it-levels";
+
   if(this->iter_per_level != def.iter_per_level)
     oss << " -n " << this->iter_per_level;
 
+  if(this->flag_anisotropic_pyramid)
+    oss << " -pyr-aniso";
+
   if(this->epsilon_per_level != def.epsilon_per_level)
     oss << " -e " << this->epsilon_per_level;
 
@@ -497,6 +672,23 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->ncc_noise_factor != def.ncc_noise_factor)
     oss << " -noise " << this->ncc_noise_factor;
 
+  if(this->ncc_approx_exact_levels != def.ncc_approx_exact_levels)
+    oss << " -ncc-approx " << this->ncc_approx_exact_levels;
+
+  if(this->control_lattice_factor != def.control_lattice_factor)
+    oss << " -lattice " << this->control_lattice_factor << " " << this->control_lattice_levels;
+
+  if(this->active_set_threshold != def.active_set_threshold)
+    oss << " -active-set " << this->active_set_threshold << " "
+        << this->active_set_period << " " << this->active_set_block;
+
+  if(this->tile_moving_rotation != def.tile_moving_rotation
+     || this->tile_moving_displacement != def.tile_moving_displacement)
+    oss << " -tile-moving " << this->tile_moving_rotation << " " << this->tile_moving_displacement;
+
+  if(this->moving_gradient_levels.size())
+    oss << " -moving-grad " << this->moving_gradient_levels;
+
   if(this->sigma_pre != def.sigma_pre || this->sigma_post != def.sigma_post)
     {
     oss << " -s " << this->sigma_pre << this->sigma_post;
@@ -566,6 +758,13 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->moving_mask.size())
     oss << " -fm " << this->fixed_mask;
 
+  if(this->auto_crop_pad != def.auto_crop_pad)
+    {
+    oss << " -crop-fg " << this->auto_crop_pad;
+    if(this->auto_crop_threshold != def.auto_crop_threshold)
+      oss << " " << this->auto_crop_threshold;
+    }
+
   if(this->output.size())
     oss << " -o " << this->output;
 
@@ -590,6 +789,22 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->threads != def.threads)
     oss << " -threads " << this->threads;
 
+  if(this->flag_threads_auto)
+    oss << " -threads-auto";
+
+  if(this->threads_metric.size())
+    oss << " -threads-stage metric " << this->threads_metric;
+
+  if(this->threads_smooth.size())
+    oss << " -threads-stage smooth " << this->threads_smooth;
+
+  if(this->threads_compose.size())
+    oss << " -threads-stage compose " << this->threads_compose;
+
+  if(this->flag_numa_first_touch)
+    oss << " -numa" << (this->flag_numa_pin_threads ? " pin" : "")
+        << (this->flag_numa_huge_pages ? " thp" : "");
+
   if(this->mode == GreedyParameters::AFFINE)
     {
     oss << " -a";
@@ -602,11 +817,33 @@ std::string GreedyParameters::GenerateCommandLine()
     if(this->flag_moments_id_covariance)
       oss << " -cov-id";
 
+    if(this->moments_downsample != def.moments_downsample)
+      oss << " -moments-ds " << this->moments_downsample;
+
     oss << " -moments " << this->moments_order;
     }
   else if(this->mode == GreedyParameters::BRUTE)
     {
     oss << " -brute " << this->brute_search_radius;
+
+    if(this->brute_metric_output.size())
+      oss << " -brute-metric " << this->brute_metric_output;
+
+    if(!this->flag_brute_subvoxel)
+      oss << " -brute-int";
+    }
+  else if(this->mode == GreedyParameters::BLOCK_MATCH)
+    {
+    oss << " -bm " << this->block_match_param.search_radius;
+
+    if(this->block_match_param.levels != def.block_match_param.levels)
+      oss << " -bm-levels " << this->block_match_param.levels;
+
+    if(this->block_match_param.candidates != def.block_match_param.candidates)
+      oss << " -bm-topk " << this->block_match_param.candidates;
+
+    if(this->block_match_param.sigma != def.block_match_param.sigma)
+      oss << " -bm-sigma " << this->block_match_param.sigma;
     }
   else if(this->mode == GreedyParameters::RESLICE)
     {
@@ -619,6 +856,9 @@ std::string GreedyParameters::GenerateCommandLine()
     if(this->reslice_param.out_jacobian_image.size())
       oss << " -rj " << this->reslice_param.out_jacobian_image;
 
+    if(this->reslice_param.flag_fused)
+      oss << " -rfuse";
+
     for(const ResliceSpec &rs : this->reslice_param.images)
       {
       switch(rs.interp.mode)
@@ -634,6 +874,8 @@ std::string GreedyParameters::GenerateCommandLine()
         }
       if(rs.interp.outside_value != 0)
         oss << " -rb " << rs.interp.outside_value;
+      if(rs.interp.jacobian_modulate)
+        oss << " -rjm 1";
 
       oss << " -rm " << rs.moving << " " << rs.output;
       }
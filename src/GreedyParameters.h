@@ -86,7 +86,10 @@ struct InterpSpec
   SmoothingParameters sigma;
   double outside_value;
 
-  InterpSpec() : mode(LINEAR), sigma(0.5, false), outside_value(0.0) {}
+  // Multiply the resliced values by the Jacobian determinant of the warp
+  bool jacobian_modulate;
+
+  InterpSpec() : mode(LINEAR), sigma(0.5, false), outside_value(0.0), jacobian_modulate(false) {}
 };
 
 struct ResliceSpec
@@ -148,6 +151,9 @@ struct GreedyResliceParameters
 
   // Output jacobian
   std::string out_jacobian_image;
+
+  // Reslice compatible images together, in a single traversal of the warp
+  bool flag_fused;
 };
 
 // Parameters for inverse warp command
@@ -168,6 +174,22 @@ struct GreedyWarpRootParameters
   std::string in_warp, out_warp;
 };
 
+// Parameters for hierarchical block matching mode
+struct GreedyBlockMatchParameters
+{
+  // Search radius (in voxels) at the coarsest level
+  std::vector<int> search_radius;
+
+  // Number of pyramid levels
+  int levels;
+
+  // Number of candidate offsets kept per block and passed to the next level
+  int candidates;
+
+  // Smoothing (in voxels) used to densify the block offsets; 0 means block size
+  double sigma;
+};
+
 template <class TAtomic>
 class PerLevelSpec
 {
@@ -227,7 +249,7 @@ struct GreedyParameters
 {
   enum MetricType { SSD = 0, NCC, MI, NMI, MAHALANOBIS };
   enum TimeStepMode { CONSTANT=0, SCALE, SCALEDOWN };
-  enum Mode { GREEDY=0, AFFINE, BRUTE, RESLICE, INVERT_WARP, ROOT_WARP, JACOBIAN_WARP, MOMENTS, METRIC };
+  enum Mode { GREEDY=0, AFFINE, BRUTE, RESLICE, INVERT_WARP, ROOT_WARP, JACOBIAN_WARP, MOMENTS, METRIC, BLOCK_MATCH };
   enum AffineDOF { DOF_RIGID=6, DOF_SIMILARITY=7, DOF_AFFINE=12 };
   enum Verbosity { VERB_NONE=0, VERB_DEFAULT, VERB_VERBOSE, VERB_INVALID };
 
@@ -252,6 +274,9 @@ struct GreedyParameters
   // Root warp parameters
   GreedyWarpRootParameters warproot_param;
 
+  // Block matching parameters
+  GreedyBlockMatchParameters block_match_param;
+
   // Registration mode
   Mode mode;
 
@@ -278,6 +303,12 @@ struct GreedyParameters
 
   std::vector<int> brute_search_radius;
 
+  // Optional output of the best metric value found by brute force search
+  std::string brute_metric_output;
+
+  // Whether brute force search refines the offsets to sub-voxel precision
+  bool flag_brute_subvoxel;
+
   // List of transforms to apply to the moving image before registration
   std::vector<TransformSpec> moving_pre_transforms;
 
@@ -301,6 +332,12 @@ struct GreedyParameters
   // Mask for the moving image
   std::string fixed_mask;
 
+  // Padding (in voxels) around the foreground bounding box to which the
+  // registration domain is cropped (-1 means no cropping), and the intensity
+  // threshold that defines the foreground when there is no gradient mask
+  int auto_crop_pad;
+  double auto_crop_threshold;
+
   // Inverse warp and root warp, for writing in deformable mode
   std::string inverse_warp, root_warp;
   int warp_exponent;
@@ -311,6 +348,32 @@ struct GreedyParameters
   // Noise for NCC
   double ncc_noise_factor;
 
+  // Number of finest levels at which the exact NCC metric is used when the
+  // approximate NCC metric is enabled (-1 means the approximate metric is off)
+  int ncc_approx_exact_levels;
+
+  // Subsampling factor of the control lattice on which the deformation is represented
+  // at the finest levels (1 means a dense field), and the number of such levels
+  int control_lattice_factor;
+  int control_lattice_levels;
+
+  // Active set for deformable iterations: blocks of the level grid whose update is below
+  // the threshold (in voxels) are frozen until all blocks are revisited, every so many
+  // iterations (a threshold of 0 means the active set is off)
+  double active_set_threshold;
+  int active_set_period;
+  int active_set_block;
+
+  // Rotation (degrees, affine) and displacement (voxels, deformable) of the moving image
+  // sampling grid past which the moving images are interpolated from a tiled copy with
+  // better memory locality (negative values mean the tiled copy is never used)
+  double tile_moving_rotation;
+  double tile_moving_displacement;
+
+  // Levels (non-zero entries, one per level) at which the gradient of the moving images is
+  // precomputed and interpolated with the values, instead of differentiating the interpolant
+  std::vector<int> moving_gradient_levels;
+
   // Debugging matrices
   bool flag_debug_aff_obj;
 
@@ -322,6 +385,9 @@ struct GreedyParameters
   int moments_order;
   bool flag_moments_id_covariance;
 
+  // Subsampling factor used when computing image moments
+  int moments_downsample;
+
   // Stationary velocity (Vercauteren 2008 LogDemons) mode
   bool flag_stationary_velocity_mode;
 
@@ -334,6 +400,26 @@ struct GreedyParameters
   // Floating point precision?
   bool flag_float_math;
 
+  // Release input images once the multi-resolution pyramid is built
+  bool flag_memory_lean;
+
+  // Sample the coarse levels of the moving pyramid through the pre-transforms (-it)
+  // directly, instead of downsampling the pre-warped full resolution image
+  bool flag_prewarp_per_level;
+
+  // Choose the pyramid downsampling factors per axis based on voxel spacing
+  bool flag_anisotropic_pyramid;
+
+  // NUMA placement: zero new image buffers from the threads that will use them, pin
+  // threads to CPUs matching their slab of the image, and ask for transparent huge pages
+  bool flag_numa_first_touch, flag_numa_pin_threads, flag_numa_huge_pages;
+
+  // Choose the number of threads of the metric, smoothing and composition stages of each
+  // level from their amount of work, and per-stage overrides for all levels or per level
+  // (0 means automatic, or the global number of threads when automatic selection is off)
+  bool flag_threads_auto;
+  std::vector<int> threads_metric, threads_smooth, threads_compose;
+
   // Weight applied to new image pairs
   double current_weight;
 
@@ -0,0 +1,170 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef COMPONENTEXTRACTIONFILTER_H
+#define COMPONENTEXTRACTIONFILTER_H
+
+#include <itkImageToImageFilter.h>
+#include <itkImageLinearConstIteratorWithIndex.h>
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include "ThreadedQuantileSearch.h"
+#include <limits>
+#include <vector>
+
+/**
+ * A filter that extracts a single component from a multi-component image and, in the
+ * same threaded pass, counts the NaN values in that component. An optional NaN mask
+ * marks additional voxels (mask > 0) that are set to NaN in the output. Optionally the
+ * filter also computes lower and upper intensity quantiles of the non-NaN values, which
+ * requires two more passes over the component.
+ *
+ * When ScanOnly is set, the output is not allocated and the filter only computes the
+ * statistics. This is used when the output can share the buffer of the input.
+ */
+template <class TInputImage, class TOutputImage>
+class ComponentExtractionFilter
+    : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  typedef ComponentExtractionFilter<TInputImage, TOutputImage> Self;
+  typedef itk::ImageToImageFilter<TInputImage, TOutputImage>  Superclass;
+  typedef itk::SmartPointer<Self>                             Pointer;
+  typedef itk::SmartPointer<const Self>                       ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( ComponentExtractionFilter, ImageToImageFilter )
+
+  /** Typedef to describe the output image region type. */
+  typedef typename Superclass::OutputImageRegionType         OutputImageRegionType;
+
+  /** Inherit some types from the superclass. */
+  typedef typename Superclass::InputImageType                InputImageType;
+  typedef typename InputImageType::InternalPixelType         InputComponentType;
+  typedef typename Superclass::OutputImageType               OutputImageType;
+  typedef typename OutputImageType::PixelType                OutputPixelType;
+  typedef TOutputImage                                       MaskImageType;
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, InputImageType::ImageDimension );
+
+  /** Set the optional NaN mask, voxels where the mask is positive become NaN */
+  itkNamedInputMacro(NaNMaskImage, MaskImageType, "nan_mask")
+
+  /** The component to extract */
+  itkSetMacro(Component, unsigned int)
+  itkGetMacro(Component, unsigned int)
+
+  /** Only compute the statistics, do not produce an output image */
+  itkSetMacro(ScanOnly, bool)
+  itkGetMacro(ScanOnly, bool)
+
+  /** Whether to compute the quantiles (off by default) */
+  itkSetMacro(ComputeQuantiles, bool)
+  itkGetMacro(ComputeQuantiles, bool)
+
+  /** Lower and upper quantiles (default 0.01 and 0.99) */
+  itkSetMacro(LowerQuantile, double)
+  itkSetMacro(UpperQuantile, double)
+
+  /** After the filter ran, get the number of NaN voxels */
+  unsigned long GetNumberOfNaNs() const { return m_NumberOfNaNs; }
+
+  /** After the filter ran, get the quantile values */
+  double GetLowerQuantileValue() const { return m_QuantileValues[0]; }
+  double GetUpperQuantileValue() const { return m_QuantileValues[1]; }
+
+protected:
+  ComponentExtractionFilter();
+  ~ComponentExtractionFilter() {}
+
+  virtual void AllocateOutputs() ITK_OVERRIDE;
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+  virtual void AfterThreadedGenerateData() ITK_OVERRIDE;
+  virtual void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                                    itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+private:
+  ComponentExtractionFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  unsigned int m_Component;
+  bool m_ScanOnly, m_ComputeQuantiles;
+  double m_LowerQuantile, m_UpperQuantile;
+
+  // Exact quantile search, shared with the MutualInformationPreprocessingFilter
+  ThreadedQuantileSearch m_QuantileSearch;
+
+  // Value of the component at position p in a line, NaN where the mask is positive
+  static double GetValue(const InputComponentType *line, const OutputPixelType *mask_line,
+                         long p, int ncomp)
+  {
+    return (mask_line && mask_line[p] > 0)
+        ? std::numeric_limits<double>::quiet_NaN()
+        : (double) line[p * ncomp];
+  }
+
+  // Passes the values of the component in a thread's region to the quantile search
+  struct ValueScanner
+  {
+    const InputImageType *input;
+    const MaskImageType *mask;
+    OutputImageRegionType region;
+    unsigned int component;
+    int ncomp;
+
+    ValueScanner(const InputImageType *in_input, const MaskImageType *in_mask,
+                 const OutputImageRegionType &in_region, unsigned int in_component)
+      : input(in_input), mask(in_mask), region(in_region), component(in_component),
+        ncomp(in_input->GetNumberOfComponentsPerPixel()) {}
+
+    template <class TFunctor> void operator()(TFunctor &f) const
+    {
+      typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> IterBase;
+      typedef IteratorExtender<IterBase> Iterator;
+      long line_length = region.GetSize(0);
+      for(Iterator it(input, region); !it.IsAtEnd(); it.NextLine())
+        {
+        const InputComponentType *line = it.GetPixelPointer(input) + component;
+        const OutputPixelType *mask_line = mask ? it.GetPixelPointer(mask) : NULL;
+        for(long p = 0; p < line_length; p++)
+          f(GetValue(line, mask_line, p, ncomp));
+        }
+    }
+  };
+
+  unsigned long m_NumberOfNaNs;
+  double m_QuantileValues[2];
+};
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "ComponentExtractionFilter.txx"
+#endif
+
+#endif // COMPONENTEXTRACTIONFILTER_H
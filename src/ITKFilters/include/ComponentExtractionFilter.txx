@@ -0,0 +1,136 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __ComponentExtractionFilter_txx_
+#define __ComponentExtractionFilter_txx_
+
+#include "ComponentExtractionFilter.h"
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "itkMultiThreader.h"
+#include "vnl/vnl_math.h"
+#include <algorithm>
+#include <cmath>
+
+template <class TInputImage, class TOutputImage>
+ComponentExtractionFilter<TInputImage, TOutputImage>
+::ComponentExtractionFilter()
+{
+  m_Component = 0;
+  m_ScanOnly = false;
+  m_ComputeQuantiles = false;
+  m_LowerQuantile = 0.01;
+  m_UpperQuantile = 0.99;
+  m_NumberOfNaNs = 0;
+  m_QuantileValues[0] = m_QuantileValues[1] = 0.0;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ComponentExtractionFilter<TInputImage, TOutputImage>
+::AllocateOutputs()
+{
+  if(!m_ScanOnly)
+    Superclass::AllocateOutputs();
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ComponentExtractionFilter<TInputImage, TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  // Code to determine the actual number of threads used below
+  itk::ThreadIdType nbOfThreads = this->GetNumberOfThreads();
+  if ( itk::MultiThreader::GetGlobalMaximumNumberOfThreads() != 0 )
+    {
+    nbOfThreads = vnl_math_min( this->GetNumberOfThreads(), itk::MultiThreader::GetGlobalMaximumNumberOfThreads() );
+    }
+
+  OutputImageRegionType splitRegion;  // dummy region - just to call the following method
+  nbOfThreads = this->SplitRequestedRegion(0, nbOfThreads, splitRegion);
+
+  m_QuantileSearch.Initialize(this->GetNumberOfThreads(), nbOfThreads, m_LowerQuantile, m_UpperQuantile);
+
+  m_NumberOfNaNs = 0;
+  m_QuantileValues[0] = m_QuantileValues[1] = 0.0;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ComponentExtractionFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
+{
+  const InputImageType *input = this->GetInput();
+  const MaskImageType *mask = this->GetNaNMaskImage();
+  OutputImageType *output = m_ScanOnly ? NULL : this->GetOutput();
+
+  int ncomp = input->GetNumberOfComponentsPerPixel();
+  long line_length = outputRegionForThread.GetSize(0);
+  long total_pixels = input->GetBufferedRegion().GetNumberOfPixels();
+
+  typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> IterBase;
+  typedef IteratorExtender<IterBase> Iterator;
+
+  // Pass 1: extract the component, apply the NaN mask, count NaNs and find the range
+  for(Iterator it(input, outputRegionForThread); !it.IsAtEnd(); it.NextLine())
+    {
+    const InputComponentType *line = it.GetPixelPointer(input) + m_Component;
+    const OutputPixelType *mask_line = mask ? it.GetPixelPointer(mask) : NULL;
+    OutputPixelType *out_line = output ? it.GetPixelPointer(output) : NULL;
+    for(long p = 0; p < line_length; p++)
+      {
+      double v = GetValue(line, mask_line, p, ncomp);
+      if(out_line)
+        out_line[p] = (OutputPixelType) v;
+      m_QuantileSearch.AddToRange(threadId, v);
+      }
+    }
+
+  // Without quantiles, the threads do not need to synchronize, and the NaN
+  // counts are summed after threading
+  if(!m_ComputeQuantiles)
+    return;
+
+  // Passes 2 and 3 find the quantiles
+  ValueScanner scanner(input, mask, outputRegionForThread, m_Component);
+  m_QuantileSearch.FindQuantiles(threadId, total_pixels, scanner);
+
+  if(threadId == 0)
+    {
+    m_QuantileValues[0] = m_QuantileSearch.GetQuantileValue(0);
+    m_QuantileValues[1] = m_QuantileSearch.GetQuantileValue(1);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ComponentExtractionFilter<TInputImage, TOutputImage>
+::AfterThreadedGenerateData()
+{
+  m_NumberOfNaNs = m_QuantileSearch.GetNumberOfNaNs();
+}
+
+#endif // __ComponentExtractionFilter_txx_
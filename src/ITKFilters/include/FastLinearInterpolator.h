@@ -31,6 +31,8 @@
 #include "itkVectorImage.h"
 #include "itkNumericTraits.h"
 #include "itkNumericTraitsCovariantVectorPixel.h"
+#include <algorithm>
+#include <vector>
 
 template <class TFloat, class TInputComponentType>
 struct FastLinearInterpolatorOutputTraits
@@ -71,10 +73,135 @@ struct FastWarpCompositeImageFilterInputImageTraits< itk::VectorImage<TPixel, VD
 
 
 /**
- * Base class for the fast linear interpolators
+ * Read-only copy of an image in which the voxels are stored in tiles of 2^TileShift
+ * cells along each axis. Each tile holds the voxels at both ends of its cells, so
+ * neighboring tiles share a layer of voxels and all corners of an interpolation cell
+ * lie in the same tile, within a few kilobytes of each other. This keeps the gathers
+ * of the interpolator local when the sampling grid is strongly rotated or deformed
+ * with respect to the image, at the cost of a second copy of the image.
+ */
+template <class TImage>
+class FastLinearInterpolatorTiles
+{
+public:
+  typedef TImage                                                  ImageType;
+  typedef typename ImageType::InternalPixelType                   InputComponentType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int, ImageType::ImageDimension );
+
+  FastLinearInterpolatorTiles() : m_Source(NULL), m_TileShift(0), m_NComp(0) {}
+
+  /** Copy an image into tiles with 2^tile_shift cells along each axis */
+  void Build(const ImageType *image, int tile_shift = 3)
+  {
+    const int T = 1 << tile_shift;
+    m_Source = image->GetBufferPointer();
+    m_TileShift = tile_shift;
+    m_NComp = FastWarpCompositeImageFilterInputImageTraits<TImage>::GetPointerIncrementSize(image);
+
+    long tile_volume = 1, n_tiles_total = 1;
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      {
+      m_Size[d] = (int) image->GetBufferedRegion().GetSize()[d];
+      m_NumberOfTiles[d] = std::max(1, (m_Size[d] + T - 2) >> tile_shift);
+      m_VoxelStride[d] = (d == 0) ? m_NComp : m_VoxelStride[d-1] * (T + 1);
+      tile_volume *= T + 1;
+      n_tiles_total *= m_NumberOfTiles[d];
+      }
+
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      m_TileStride[d] = (d == 0) ? tile_volume * m_NComp : m_TileStride[d-1] * m_NumberOfTiles[d-1];
+
+    m_Data.assign(n_tiles_total * tile_volume * m_NComp,
+                  itk::NumericTraits<InputComponentType>::ZeroValue());
+
+    // Fill the tiles one after the other. Voxels of the last tiles that fall past the
+    // edge of the image are never read by the interpolator and are left at zero
+    const InputComponentType *src = image->GetBufferPointer();
+    InputComponentType *dst = &m_Data[0];
+    int tidx[ImageDimension];
+    for(long t = 0; t < n_tiles_total; t++)
+      {
+      long q = t;
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        {
+        tidx[d] = (int) (q % m_NumberOfTiles[d]);
+        q /= m_NumberOfTiles[d];
+        }
+
+      for(long v = 0; v < tile_volume; v++, dst += m_NComp)
+        {
+        long r = v, offset = 0, stride = 1;
+        bool inside = true;
+        for(unsigned int d = 0; d < ImageDimension; d++)
+          {
+          int X = (tidx[d] << tile_shift) + (int) (r % (T + 1));
+          r /= T + 1;
+          if(X >= m_Size[d])
+            inside = false;
+          offset += X * stride;
+          stride *= m_Size[d];
+          }
+
+        if(inside)
+          for(int k = 0; k < m_NComp; k++)
+            dst[k] = src[offset * m_NComp + k];
+        }
+      }
+  }
+
+  /** Check if the tiles hold a copy of the given image buffer */
+  bool IsBuiltFrom(const ImageType *image) const
+  {
+    if(m_Data.empty() || m_Source != image->GetBufferPointer())
+      return false;
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      if(m_Size[d] != (int) image->GetBufferedRegion().GetSize()[d])
+        return false;
+    return true;
+  }
+
+  /** Free the tiles */
+  void Release()
+  {
+    std::vector<InputComponentType>().swap(m_Data);
+    m_Source = NULL;
+  }
+
+  /** Distance, in components, between neighboring voxels of a tile along axis d */
+  int GetVoxelStride(unsigned int d) const { return m_VoxelStride[d]; }
+
+  /**
+   * Get the voxel at the given index, taken from the tile in which it is the lower corner
+   * of a cell (or from the last tile for the voxels on the far edge of the image)
+   */
+  inline const InputComponentType *GetVoxel(const int *idx) const
+  {
+    long offset = 0;
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      {
+      int t = std::min(idx[d] >> m_TileShift, m_NumberOfTiles[d] - 1);
+      offset += t * m_TileStride[d] + (idx[d] - (t << m_TileShift)) * m_VoxelStride[d];
+      }
+    return &m_Data[0] + offset;
+  }
+
+protected:
+  std::vector<InputComponentType> m_Data;
+  const InputComponentType *m_Source;
+  int m_TileShift, m_NComp;
+  int m_Size[ImageDimension], m_NumberOfTiles[ImageDimension], m_VoxelStride[ImageDimension];
+  long m_TileStride[ImageDimension];
+};
+
+
+/**
+ * Base class for the fast linear interpolators. If VComp is non-zero, the image must
+ * have exactly VComp components, and the loops over the components have a fixed length
+ * that the compiler can unroll. Otherwise the number of components is read from the image
  */
 template<class TImage, class TFloat, unsigned int VDim,
-         class TMaskImage = itk::Image<float, VDim> >
+         class TMaskImage = itk::Image<float, VDim>, unsigned int VComp = 0>
 class FastLinearInterpolatorBase
 {
 public:
@@ -85,6 +212,7 @@ public:
   typedef typename ImageType::InternalPixelType                   InputComponentType;
   typedef FastLinearInterpolatorOutputTraits<TFloat, InputComponentType>  OutputTraits;
   typedef typename OutputTraits::OutputComponentType              OutputComponentType;
+  typedef FastLinearInterpolatorTiles<TImage>                     TilesType;
 
   /** Determine the image dimension. */
   itkStaticConstMacro(ImageDimension, unsigned int, ImageType::ImageDimension );
@@ -95,7 +223,7 @@ public:
    * Get the number that should be added to the input pointer when parsing the input and
    * output images. This will be 1 for itk::Image and Ncomp for itk::VectorImage
    */
-  int GetPointerIncrement() const { return nComp; }
+  int GetPointerIncrement() const { return VComp > 0 ? (int) VComp : nComp; }
 
   FastLinearInterpolatorBase(ImageType *image, MaskImageType *mask = NULL)
   {
@@ -108,6 +236,8 @@ public:
 
     // Store the moving mask pointer
     mask_buffer = mask ? mask->GetBufferPointer() : NULL;
+
+    tiles = NULL;
   }
 
   ~FastLinearInterpolatorBase()
@@ -128,6 +258,9 @@ protected:
   const InputComponentType *buffer;
   const MaskPixelType *mask_buffer;
 
+  // Optional tiled copy of the image, from which the image values are read instead
+  const TilesType *tiles;
+
   // Default value - for interpolation outside of the image bounds
   const InputComponentType *def_value;
   InputComponentType *def_value_store;
@@ -147,11 +280,11 @@ protected:
  * Arbitrary dimension fast linear interpolator - meant to be slow
  */
 template<class TImage, class TFloat, unsigned int VDim,
-         class TMaskImage = itk::Image<float, VDim> >
-class FastLinearInterpolator : public FastLinearInterpolatorBase<TImage, TFloat, VDim, TMaskImage>
+         class TMaskImage = itk::Image<float, VDim>, unsigned int VComp = 0>
+class FastLinearInterpolator : public FastLinearInterpolatorBase<TImage, TFloat, VDim, TMaskImage, VComp>
 {
 public:
-  typedef FastLinearInterpolatorBase<TImage, TFloat, VDim, TMaskImage>   Superclass;
+  typedef FastLinearInterpolatorBase<TImage, TFloat, VDim, TMaskImage, VComp>   Superclass;
   typedef typename Superclass::ImageType               ImageType;
   typedef typename Superclass::MaskImageType           MaskImageType;
   typedef typename Superclass::InputComponentType      InputComponentType;
@@ -176,6 +309,8 @@ public:
 
   void Splat(RealType *cix, const InputComponentType *value) {}
 
+  void SetTiles(const typename Superclass::TilesType *) {}
+
   template <class THistContainer>
   void PartialVolumeHistogramSample(RealType *cix, const InputComponentType *fixptr, THistContainer &hist) {}
 
@@ -189,25 +324,38 @@ protected:
 /**
  * 3D fast linear interpolator - optimized for speed
  */
-template <class TImage, class TFloat, class TMaskImage>
-class FastLinearInterpolator<TImage, TFloat, 3, TMaskImage>
-    : public FastLinearInterpolatorBase<TImage, TFloat, 3, TMaskImage>
+template <class TImage, class TFloat, class TMaskImage, unsigned int VComp>
+class FastLinearInterpolator<TImage, TFloat, 3, TMaskImage, VComp>
+    : public FastLinearInterpolatorBase<TImage, TFloat, 3, TMaskImage, VComp>
 {
 public:
   typedef TImage                                                           ImageType;
   typedef TMaskImage                                                       MaskImageType;
-  typedef FastLinearInterpolatorBase<ImageType, TFloat, 3, MaskImageType>  Superclass;
+  typedef FastLinearInterpolatorBase<ImageType, TFloat, 3, MaskImageType, VComp>  Superclass;
   typedef typename Superclass::InputComponentType                          InputComponentType;
   typedef typename Superclass::OutputComponentType                         OutputComponentType;
   typedef typename Superclass::RealType                                    RealType;
   typedef typename Superclass::InOut                                       InOut;
   typedef typename Superclass::MaskPixelType                               MaskPixelType;
+  typedef typename Superclass::TilesType                                   TilesType;
 
   FastLinearInterpolator(ImageType *image, MaskImageType *mask = NULL) : Superclass(image, mask)
   {
     xsize = image->GetLargestPossibleRegion().GetSize()[0];
     ysize = image->GetLargestPossibleRegion().GetSize()[1];
     zsize = image->GetLargestPossibleRegion().GetSize()[2];
+    SetTiles(NULL);
+  }
+
+  /**
+   * Read the image values from a tiled copy of the image (or from the image itself if
+   * NULL). The tiled copy is read-only, so Splat must not be used with it
+   */
+  void SetTiles(const TilesType *tiles)
+  {
+    this->tiles = tiles;
+    ystride = tiles ? tiles->GetVoxelStride(1) : xsize * this->GetPointerIncrement();
+    zstride = tiles ? tiles->GetVoxelStride(2) : xsize * ysize * this->GetPointerIncrement();
   }
 
   /**
@@ -232,16 +380,16 @@ public:
       // The sample point is completely inside
       dp = dens(x0, y0, z0);
       d000 = dp;
-      d100 = dp+this->nComp;
-      dp += xsize*this->nComp;
+      d100 = dp+this->GetPointerIncrement();
+      dp += ystride;
       d010 = dp;
-      d110 = dp+this->nComp;
-      dp += xsize*ysize*this->nComp;
+      d110 = dp+this->GetPointerIncrement();
+      dp += zstride;
       d011 = dp;
-      d111 = dp+this->nComp;
-      dp -= xsize*this->nComp;
+      d111 = dp+this->GetPointerIncrement();
+      dp -= ystride;
       d001 = dp;
-      d101 = dp+this->nComp;
+      d101 = dp+this->GetPointerIncrement();
 
       // Is there a mask? If so, sample the mask
       if(this->mask_buffer)
@@ -328,7 +476,7 @@ public:
     if(this->status != Superclass::OUTSIDE)
       {
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++, grad++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++, grad++,
           d000++, d001++, d010++, d011++,
           d100++, d101++, d110++, d111++)
         {
@@ -373,7 +521,7 @@ public:
     if(this->status != Superclass::OUTSIDE)
       {
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d000++, d001++, d010++, d011++,
           d100++, d101++, d110++, d111++)
         {
@@ -402,7 +550,7 @@ public:
         z0 >= 0 && z0 < zsize)
       {
       const InputComponentType *dp = dens(x0, y0, z0);
-      for(int iComp = 0; iComp < this->nComp; iComp++)
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++)
         {
         out[iComp] = dp[iComp];
         }
@@ -432,7 +580,7 @@ public:
       RealType w000 = 1.0 - fx - fy + fxy - w001;
 
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d000++, d001++, d010++, d011++,
           d100++, d101++, d110++, d111++, value++)
         {
@@ -471,7 +619,7 @@ public:
       RealType w000 = 1.0 - fx - fy + fxy - w001;
 
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d000++, d001++, d010++, d011++,
           d100++, d101++, d110++, d111++, fixptr++)
         {
@@ -491,7 +639,7 @@ public:
       }
     else
       {
-      for(int iComp = 0; iComp < this->nComp; iComp++, fixptr++)
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++, fixptr++)
         {
         // Just this line in the histogram
         RealType *hist_line = hist[iComp][*fixptr];
@@ -528,7 +676,7 @@ public:
       out_grad[2] = 0.0;
 
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d000++, d001++, d010++, d011++,
           d100++, d101++, d110++, d111++, fixptr++)
         {
@@ -620,7 +768,12 @@ protected:
 
   inline const InputComponentType *dens(int X, int Y, int Z)
   {
-    return this->buffer + this->nComp * (X+xsize*(Y+ysize*Z));
+    if(this->tiles)
+      {
+      int idx[] = { X, Y, Z };
+      return this->tiles->GetVoxel(idx);
+      }
+    return this->buffer + this->GetPointerIncrement() * (X+xsize*(Y+ysize*Z));
   }
 
   inline const MaskPixelType *mens(int X, int Y, int Z)
@@ -631,6 +784,9 @@ protected:
   // Image size
   int xsize, ysize, zsize;
 
+  // Distance between the corners of a cell along y and z in the image or tiles
+  int ystride, zstride;
+
   // State of current interpolation
   const InputComponentType *d000, *d001, *d010, *d011, *d100, *d101, *d110, *d111;
   RealType m000, m001, m010, m011, m100, m101, m110, m111;
@@ -645,24 +801,36 @@ protected:
 /**
  * 2D fast linear interpolator - optimized for speed
  */
-template <class TImage, class TFloat, class TMaskImage>
-class FastLinearInterpolator<TImage, TFloat, 2, TMaskImage>
-    : public FastLinearInterpolatorBase<TImage, TFloat, 2, TMaskImage>
+template <class TImage, class TFloat, class TMaskImage, unsigned int VComp>
+class FastLinearInterpolator<TImage, TFloat, 2, TMaskImage, VComp>
+    : public FastLinearInterpolatorBase<TImage, TFloat, 2, TMaskImage, VComp>
 {
 public:
   typedef TImage                                                            ImageType;
   typedef TMaskImage                                                        MaskImageType;
-  typedef FastLinearInterpolatorBase<ImageType, TFloat, 2, MaskImageType>   Superclass;
+  typedef FastLinearInterpolatorBase<ImageType, TFloat, 2, MaskImageType, VComp>   Superclass;
   typedef typename Superclass::InputComponentType                           InputComponentType;
   typedef typename Superclass::OutputComponentType                          OutputComponentType;
   typedef typename Superclass::RealType                                     RealType;
   typedef typename Superclass::InOut                                        InOut;
   typedef typename Superclass::MaskPixelType                                MaskPixelType;
+  typedef typename Superclass::TilesType                                    TilesType;
 
   FastLinearInterpolator(ImageType *image, MaskImageType *mask = NULL) : Superclass(image, mask)
   {
     xsize = image->GetLargestPossibleRegion().GetSize()[0];
     ysize = image->GetLargestPossibleRegion().GetSize()[1];
+    SetTiles(NULL);
+  }
+
+  /**
+   * Read the image values from a tiled copy of the image (or from the image itself if
+   * NULL). The tiled copy is read-only, so Splat must not be used with it
+   */
+  void SetTiles(const TilesType *tiles)
+  {
+    this->tiles = tiles;
+    ystride = tiles ? tiles->GetVoxelStride(1) : xsize * this->GetPointerIncrement();
   }
 
   /**
@@ -684,10 +852,10 @@ public:
       // The sample point is completely inside
       dp = dens(x0, y0);
       d00 = dp;
-      d10 = dp+this->nComp;
-      dp += xsize*this->nComp;
+      d10 = dp+this->GetPointerIncrement();
+      dp += ystride;
       d01 = dp;
-      d11 = dp+this->nComp;
+      d11 = dp+this->GetPointerIncrement();
 
       // Is there a mask? If so, sample the mask
       if(this->mask_buffer)
@@ -759,7 +927,7 @@ public:
     if(this->status != Superclass::OUTSIDE)
       {
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++, grad++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++, grad++,
           d00++, d01++, d10++, d11++)
         {
         // Interpolate the image intensity
@@ -788,7 +956,7 @@ public:
     if(this->status != Superclass::OUTSIDE)
       {
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d00++, d01++, d10++, d11++)
         {
         // Interpolate the image intensity
@@ -809,7 +977,7 @@ public:
     if (x0 >= 0 && x0 < xsize && y0 >= 0 && y0 < ysize)
       {
       const InputComponentType *dp = dens(x0, y0);
-      for(int iComp = 0; iComp < this->nComp; iComp++)
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++)
         {
         out[iComp] = dp[iComp];
         }
@@ -835,7 +1003,7 @@ public:
       RealType w00 = 1.0 - fx - fy + fxy;
 
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d00++, d01++, d10++, d11++, value++)
         {
         // Assign the appropriate weight to each part of the histogram
@@ -866,7 +1034,7 @@ public:
       RealType w00 = 1.0 - fx - fy + fxy;
 
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d00++, d01++, d10++, d11++, fixptr++)
         {
         // Just this line in the histogram
@@ -881,7 +1049,7 @@ public:
       }
     else
       {
-      for(int iComp = 0; iComp < this->nComp; iComp++, fixptr++)
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++, fixptr++)
         {
         // Just this line in the histogram
         RealType *hist_line = hist[iComp][*fixptr];
@@ -910,7 +1078,7 @@ public:
       out_grad[1] = 0.0;
 
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
+      for(int iComp = 0; iComp < this->GetPointerIncrement(); iComp++,
           d00++, d01++, d10++, d11++, fixptr++)
         {
         // Just this line in the histogram
@@ -973,7 +1141,12 @@ protected:
 
   inline const InputComponentType *dens(int X, int Y)
   {
-    return this->buffer + this->nComp * (X+xsize*Y);
+    if(this->tiles)
+      {
+      int idx[] = { X, Y };
+      return this->tiles->GetVoxel(idx);
+      }
+    return this->buffer + this->GetPointerIncrement() * (X+xsize*Y);
   }
 
   inline const MaskPixelType *mens(int X, int Y)
@@ -984,6 +1157,9 @@ protected:
   // Image size
   int xsize, ysize;
 
+  // Distance between the corners of a cell along y in the image or tiles
+  int ystride;
+
   // State of current interpolation
   const InputComponentType *d00, *d01, *d10, *d11;
   RealType m00, m01, m10, m11;
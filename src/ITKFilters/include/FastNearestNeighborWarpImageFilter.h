@@ -0,0 +1,111 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef FASTNEARESTNEIGHBORWARPIMAGEFILTER_H
+#define FASTNEARESTNEIGHBORWARPIMAGEFILTER_H
+
+#include "lddmm_common.h"
+#include "itkImageToImageFilter.h"
+#include <vnl/vnl_matrix_fixed.h>
+#include <vnl/vnl_vector_fixed.h>
+
+/**
+ * Nearest neighbor warp filter that works on images of any pixel type, e.g.,
+ * integer label images, without conversion to floating point. The displacement
+ * field is in physical units, like FastWarpCompositeImageFilter with physical
+ * space calculations turned on. Since there are no interpolation weights, the
+ * moving image is only indexed, and values are copied exactly.
+ */
+template <class TImage, class TDeformationField>
+class FastNearestNeighborWarpImageFilter
+        : public itk::ImageToImageFilter<TImage, TImage>
+{
+public:
+  typedef FastNearestNeighborWarpImageFilter<TImage,TDeformationField> Self;
+  typedef itk::ImageToImageFilter<TImage, TImage>                      Superclass;
+  typedef itk::SmartPointer<Self>                                      Pointer;
+  typedef itk::SmartPointer<const Self>                                ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( FastNearestNeighborWarpImageFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TImage::ImageDimension );
+
+  typedef TImage                                      ImageType;
+  typedef TDeformationField                           DeformationFieldType;
+  typedef typename Superclass::OutputImageRegionType  OutputImageRegionType;
+  typedef typename ImageType::InternalPixelType       ComponentType;
+  typedef typename ImageType::IndexType               IndexType;
+  typedef typename ImageType::IndexValueType          IndexValueType;
+  typedef typename ImageType::OffsetValueType         OffsetValueType;
+  typedef typename DeformationFieldType::PixelType    DeformationVectorType;
+
+  /** Set the deformation field */
+  itkNamedInputMacro(DeformationField, DeformationFieldType, "Primary")
+
+  /** Set the moving image */
+  itkNamedInputMacro(MovingImage, ImageType, "moving")
+
+  /** The value assigned to voxels that map outside of the moving image */
+  itkSetMacro(OutsideValue, ComponentType)
+  itkGetMacro(OutsideValue, ComponentType)
+
+protected:
+
+  FastNearestNeighborWarpImageFilter() : m_OutsideValue(0) {}
+  ~FastNearestNeighborWarpImageFilter() {}
+
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                            itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  ComponentType m_OutsideValue;
+
+  // Mapping from physical coordinates to continuous index in the moving image
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> m_PhysToIndex;
+  vnl_vector_fixed<double, ImageDimension> m_MovingOrigin;
+
+private:
+  FastNearestNeighborWarpImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "FastNearestNeighborWarpImageFilter.txx"
+#endif
+
+#endif // FASTNEARESTNEIGHBORWARPIMAGEFILTER_H
@@ -0,0 +1,147 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef FASTNEARESTNEIGHBORWARPIMAGEFILTER_TXX
+#define FASTNEARESTNEIGHBORWARPIMAGEFILTER_TXX
+
+#include "FastNearestNeighborWarpImageFilter.h"
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include <vnl/vnl_inverse.h>
+#include <cmath>
+
+template <class TImage, class TDeformationField>
+void
+FastNearestNeighborWarpImageFilter<TImage,TDeformationField>
+::BeforeThreadedGenerateData()
+{
+  ImageType *moving = this->GetMovingImage();
+
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> index_to_phys;
+  for(unsigned int a = 0; a < ImageDimension; a++)
+    {
+    m_MovingOrigin[a] = moving->GetOrigin()[a];
+    for(unsigned int b = 0; b < ImageDimension; b++)
+      index_to_phys(a, b) = moving->GetDirection()(a, b) * moving->GetSpacing()[b];
+    }
+
+  m_PhysToIndex = vnl_inverse(index_to_phys);
+}
+
+template <class TImage, class TDeformationField>
+void
+FastNearestNeighborWarpImageFilter<TImage,TDeformationField>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  const DeformationFieldType *def = this->GetDeformationField();
+  const ImageType *moving = this->GetMovingImage();
+  ImageType *output = this->GetOutput();
+
+  int line_len = outputRegionForThread.GetSize(0);
+  int ncomp = moving->GetNumberOfComponentsPerPixel();
+
+  // Moving image buffer geometry
+  const ComponentType *mov_buffer = moving->GetBufferPointer();
+  const typename ImageType::RegionType &mov_region = moving->GetBufferedRegion();
+  const OffsetValueType *mov_stride = moving->GetOffsetTable();
+
+  typedef itk::ImageLinearIteratorWithIndex<ImageType> IterBase;
+  typedef IteratorExtender<IterBase> IterType;
+
+  vnl_vector_fixed<double, ImageDimension> p0, p1, cix0, cix_step, cix;
+  for(IterType it(output, outputRegionForThread); !it.IsAtEnd(); it.NextLine())
+    {
+    const DeformationVectorType *phi = it.GetPixelPointer(def);
+    ComponentType *out = output->GetBufferPointer() + ncomp * output->ComputeOffset(it.GetIndex());
+
+    // The moving continuous index of the identity map is linear along the line
+    IndexType idx = it.GetIndex();
+    typename DeformationFieldType::PointType p;
+    def->TransformIndexToPhysicalPoint(idx, p);
+    for(unsigned int j = 0; j < ImageDimension; j++)
+      p0[j] = p[j] - m_MovingOrigin[j];
+    idx[0]++;
+    def->TransformIndexToPhysicalPoint(idx, p);
+    for(unsigned int j = 0; j < ImageDimension; j++)
+      p1[j] = p[j] - m_MovingOrigin[j];
+
+    cix0 = m_PhysToIndex * p0;
+    cix_step = m_PhysToIndex * p1 - cix0;
+
+    for(int i = 0; i < line_len; i++, out += ncomp)
+      {
+      // Add the displacement, mapped into moving index units
+      OffsetValueType offset = 0;
+      bool inside = true;
+      for(unsigned int a = 0; a < ImageDimension && inside; a++)
+        {
+        double c = cix0[a] + i * cix_step[a];
+        for(unsigned int b = 0; b < ImageDimension; b++)
+          c += m_PhysToIndex(a, b) * phi[i][b];
+
+        IndexValueType k = (IndexValueType) std::floor(c + 0.5) - mov_region.GetIndex(a);
+        if(k < 0 || k >= (IndexValueType) mov_region.GetSize(a))
+          inside = false;
+        else
+          offset += k * mov_stride[a];
+        }
+
+      if(inside)
+        {
+        const ComponentType *src = mov_buffer + ncomp * offset;
+        for(int k = 0; k < ncomp; k++)
+          out[k] = src[k];
+        }
+      else
+        {
+        for(int k = 0; k < ncomp; k++)
+          out[k] = m_OutsideValue;
+        }
+      }
+    }
+}
+
+template <class TImage, class TDeformationField>
+void
+FastNearestNeighborWarpImageFilter<TImage,TDeformationField>
+::GenerateInputRequestedRegion()
+{
+  this->GetDeformationField()->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
+  this->GetMovingImage()->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TImage, class TDeformationField>
+void
+FastNearestNeighborWarpImageFilter<TImage,TDeformationField>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  this->GetOutput()->SetNumberOfComponentsPerPixel(this->GetMovingImage()->GetNumberOfComponentsPerPixel());
+  this->GetOutput()->SetLargestPossibleRegion(this->GetDeformationField()->GetLargestPossibleRegion());
+}
+
+#endif // FASTNEARESTNEIGHBORWARPIMAGEFILTER_TXX
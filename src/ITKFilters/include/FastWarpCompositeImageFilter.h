@@ -29,6 +29,7 @@
 
 #include "lddmm_common.h"
 #include "itkImageToImageFilter.h"
+#include <vnl/vnl_matrix_fixed.h>
 
 /**
  * This is a warp filter that is fast, supports multi-component (vector) images
@@ -73,6 +74,7 @@ public:
   typedef typename OutputImageType::InternalPixelType OutputComponentType;
 
   typedef itk::ImageBase<ImageDimension>              ImageBaseType;
+  typedef itk::Image<DeforamtionScalarType, ImageDimension> MaskImageType;
 
   /** Set the fixed image */
   itkNamedInputMacro(DeformationField, DeformationFieldType, "Primary")
@@ -80,6 +82,14 @@ public:
   /** Set the moving image */
   itkNamedInputMacro(MovingImage, InputImageType, "moving")
 
+  /**
+   * Set the active mask [optional]. Where the mask is zero, the displacement is taken
+   * to be zero and the moving image value at the same voxel is copied to the output
+   * without interpolation. The moving image must then have the grid of the deformation
+   * field, as when composing a field with itself or with an update
+   */
+  itkNamedInputMacro(ActiveMask, MaskImageType, "active_mask")
+
   /**
    * Set whether the filter should use physical space calculations, i.e., the
    * displacement field is between physical coordinates of the voxels in the
@@ -116,24 +126,45 @@ public:
   itkSetMacro(OutsideValue, OutputComponentType);
   itkGetMacro(OutsideValue, OutputComponentType);
 
+  /**
+   * When set, the interpolated values are multiplied by the Jacobian determinant
+   * of the mapping x -> x + phi(x), computed from the deformation field by central
+   * differences during the same traversal. This preserves integrals of density
+   * images. In physical space mode, the determinant is in physical units.
+   */
+  itkSetMacro(JacobianModulation, bool)
+  itkGetMacro(JacobianModulation, bool)
+
 protected:
 
   FastWarpCompositeImageFilter()
   : m_UsePhysicalSpace(false), m_DeformationScaling(1.0),
-    m_UseNearestNeighbor(false), m_ExtrapolateBorders(true), m_OutsideValue(0.0) { }
+    m_UseNearestNeighbor(false), m_ExtrapolateBorders(true), m_JacobianModulation(false),
+    m_OutsideValue(0.0) { }
 
   ~FastWarpCompositeImageFilter() {}
 
   void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
                             itk::ThreadIdType threadId ) ITK_OVERRIDE;
 
+  friend struct MultiComponentDispatch;
+
+  // Implementation for VComp components (0 means any number)
+  template <unsigned int VComp>
+  void ThreadedGenerateDataWithComponents(const OutputImageRegionType& outputRegionForThread,
+                                          itk::ThreadIdType threadId);
+
   virtual void VerifyInputInformation() ITK_OVERRIDE {}
 
   virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
 
   virtual void GenerateOutputInformation() ITK_OVERRIDE;
 
-  bool m_UsePhysicalSpace, m_UseNearestNeighbor, m_ExtrapolateBorders;
+  // Jacobian determinant of x -> x + phi(x) at the given voxel of the deformation field
+  double ComputeJacobianDeterminant(const DeformationVectorType *phi, const IndexType &idx,
+                                    const vnl_matrix_fixed<double, ImageDimension, ImageDimension> &phys_to_vox);
+
+  bool m_UsePhysicalSpace, m_UseNearestNeighbor, m_ExtrapolateBorders, m_JacobianModulation;
   DeforamtionScalarType m_DeformationScaling;
 
   OutputComponentType m_OutsideValue;
@@ -29,17 +29,66 @@
 
 #include "FastLinearInterpolator.h"
 #include "FastWarpCompositeImageFilter.h"
+#include "MultiComponentImageMetricBase.h"
 #include "ImageRegionConstIteratorWithIndexOverride.h"
+#include <vnl/vnl_det.h>
+#include <vnl/vnl_inverse.h>
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+double
+FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
+::ComputeJacobianDeterminant(const DeformationVectorType *phi, const IndexType &idx,
+                             const vnl_matrix_fixed<double, ImageDimension, ImageDimension> &phys_to_vox)
+{
+  const DeformationFieldType *def = this->GetDeformationField();
+  const typename DeformationFieldType::RegionType &rgn = def->GetBufferedRegion();
+
+  // Derivative of the displacement with respect to the voxel index. At the edges of
+  // the buffer, one-sided differences are used, so affine fields are reproduced exactly
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> Du;
+  for(unsigned int b = 0; b < ImageDimension; b++)
+    {
+    long stride = def->GetOffsetTable()[b];
+    bool has_lo = idx[b] > rgn.GetIndex(b);
+    bool has_hi = idx[b] < rgn.GetIndex(b) + (IndexValueType) rgn.GetSize(b) - 1;
+    const DeformationVectorType &u_lo = has_lo ? phi[-stride] : phi[0];
+    const DeformationVectorType &u_hi = has_hi ? phi[stride] : phi[0];
+    int n_steps = (has_lo ? 1 : 0) + (has_hi ? 1 : 0);
+    for(unsigned int a = 0; a < ImageDimension; a++)
+      Du(a, b) = n_steps > 0 ? m_DeformationScaling * (u_hi[a] - u_lo[a]) / n_steps : 0.0;
+    }
+
+  // Convert to physical units if needed, and add the identity
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> J = Du * phys_to_vox;
+  for(unsigned int a = 0; a < ImageDimension; a++)
+    J(a, a) += 1.0;
+
+  return vnl_det(J);
+}
 
 template <class TInputImage, class TOutputImage, class TDeformationField>
 void
 FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
 ::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
                        itk::ThreadIdType threadId)
+{
+  // Use an interpolator with a fixed number of components for the common cases
+  int ncomp = FastWarpCompositeImageFilterInputImageTraits<TInputImage>::GetPointerIncrementSize(
+        this->GetMovingImage());
+  MultiComponentDispatch::ThreadedGenerateData(this, ncomp, outputRegionForThread, threadId);
+}
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+template <unsigned int VComp>
+void
+FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
+::ThreadedGenerateDataWithComponents(const OutputImageRegionType &outputRegionForThread,
+                                     itk::ThreadIdType threadId)
 {
   // Our images
   const DeformationFieldType *def = this->GetDeformationField();
   InputImageType *input = this->GetMovingImage();
+  const MaskImageType *mask = this->GetActiveMask();
 
   int line_len = outputRegionForThread.GetSize(0);
 
@@ -51,11 +100,25 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
   typedef typename itk::NumericTraits<OutputComponentType>::MeasurementVectorType::ValueType FloatType;
 
   // Create a fast interpolator for the moving image
-  typedef FastLinearInterpolator<TInputImage, FloatType, ImageDimension> FastInterpolator;
+  typedef FastLinearInterpolator<TInputImage, FloatType, ImageDimension,
+                                 itk::Image<float, ImageDimension>, VComp> FastInterpolator;
   FastInterpolator fi(input);
   fi.SetOutsideValue(m_OutsideValue);
 
-  int ncomp = fi.GetPointerIncrement();
+  const int ncomp = fi.GetPointerIncrement();
+
+  // For Jacobian modulation, derivatives along the grid are mapped to physical space
+  // by the inverse of the voxel to physical transform of the deformation field
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> phys_to_vox;
+  phys_to_vox.set_identity();
+  if(m_JacobianModulation && m_UsePhysicalSpace)
+    {
+    vnl_matrix_fixed<double, ImageDimension, ImageDimension> vox_to_phys;
+    for(unsigned int a = 0; a < ImageDimension; a++)
+      for(unsigned int b = 0; b < ImageDimension; b++)
+        vox_to_phys(a, b) = def->GetDirection()(a, b) * def->GetSpacing()[b];
+    phys_to_vox = vnl_inverse(vox_to_phys);
+    }
 
   // Loop over the lines in the image
   for(IterType it(this->GetOutput(), outputRegionForThread); !it.IsAtEnd(); it.NextLine())
@@ -64,8 +127,13 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
     const DeformationVectorType *phi = it.GetPixelPointer(def);
     OutputComponentType *out = it.GetPixelPointer(this->GetOutput());
 
+    // With an active mask, frozen voxels are copied from the moving image on the same grid
+    const DeforamtionScalarType *p_mask = mask ? it.GetPixelPointer(mask) : NULL;
+    const InputComponentType *p_input = mask ? it.GetPixelPointer(input) : NULL;
+
     // Voxel index
     IndexType idx = it.GetIndex();
+    IndexType idx_line = idx;
 
     // The current sample position
     itk::ContinuousIndex<FloatType, ImageDimension> cix;
@@ -102,6 +170,14 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
         idx[0]++;
         }
 
+      // Skip the interpolation in frozen voxels
+      if(p_mask && p_mask[i] == 0)
+        {
+        for(int k = 0; k < ncomp; k++)
+          *out++ = static_cast<OutputComponentType>(p_input[i * ncomp + k]);
+        continue;
+        }
+
       // Perform the interpolation
       typename  FastInterpolator::InOut status =
           m_UseNearestNeighbor
@@ -111,6 +187,13 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
       if(status == FastInterpolator::INSIDE ||
          (status == FastInterpolator::BORDER && m_ExtrapolateBorders))
         {
+        if(m_JacobianModulation)
+          {
+          idx_line[0] = it.GetIndex()[0] + i;
+          double det = ComputeJacobianDeterminant(phi + i, idx_line, phys_to_vox);
+          for(int k = 0; k < ncomp; k++)
+            out[k] *= det;
+          }
         out += ncomp;
         }
       else
@@ -127,9 +210,25 @@ void
 FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
 ::GenerateInputRequestedRegion()
 {
-  this->GetDeformationField()->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
+  // Jacobian modulation needs a one voxel margin of the deformation field
+  typename DeformationFieldType::RegionType rr_def = this->GetOutput()->GetRequestedRegion();
+  if(m_JacobianModulation)
+    {
+    rr_def.PadByRadius(1);
+    rr_def.Crop(this->GetDeformationField()->GetLargestPossibleRegion());
+    }
+  this->GetDeformationField()->SetRequestedRegion(rr_def);
   this->GetMovingImage()->SetRequestedRegionToLargestPossibleRegion();
 
+  // The active mask is read on the output grid, and frozen voxels are copied from the
+  // moving image at the same offset
+  if(this->GetActiveMask())
+    {
+    if(this->GetMovingImage()->GetBufferedRegion() != this->GetDeformationField()->GetBufferedRegion())
+      itkExceptionMacro("The moving image must have the grid of the deformation field when an active mask is used");
+    this->GetActiveMask()->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
+    }
+
 }
 
 template <class TInputImage, class TOutputImage, class TDeformationField>
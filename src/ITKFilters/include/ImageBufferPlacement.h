@@ -0,0 +1,296 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __ImageBufferPlacement_h_
+#define __ImageBufferPlacement_h_
+
+#include "itkImageRegion.h"
+#include "itkMultiThreader.h"
+#include "itkImageRegionSplitterSlowDimension.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+/**
+ * Placement of large image buffers, and of the threads that work on them, on NUMA machines.
+ *
+ * ITK filters split their region into slabs along the slowest axis, one slab per thread.
+ * With first-touch on, new buffers are zeroed with the same split, so that the pages of
+ * each slab are allocated on the NUMA node of the thread that zeroes it, rather than all
+ * on the node of the calling thread. With pinning on, a thread working on a slab is pinned
+ * to the CPU found at the same relative position in the list of allowed CPUs (ordered by
+ * NUMA node) as the slab along the slowest axis, so the threads that zero a slab and the
+ * threads that later process it run on the same node. Transparent huge pages can also be
+ * requested for large buffers.
+ *
+ * Everything is off by default. On a machine with a single node, the options only change
+ * which CPUs the threads run on, and on other platforms than Linux they have no effect.
+ */
+class ImageBufferPlacement
+{
+public:
+  struct Settings
+  {
+    bool first_touch, pin_threads, huge_pages;
+    Settings() : first_touch(false), pin_threads(false), huge_pages(false) {}
+  };
+
+  /** Global settings, shared by all images */
+  static Settings &GetSettings()
+  {
+    static Settings settings;
+    return settings;
+  }
+
+  /**
+   * CPUs that the process may run on, ordered by NUMA node, and the number of nodes that
+   * they belong to. The list is read on the first call, which is safe from any thread
+   */
+  static const std::vector<int> &GetCPUList(int *n_nodes = NULL)
+  {
+    static const CPUTopology topology = ReadCPUTopology();
+    if(n_nodes)
+      *n_nodes = topology.n_nodes;
+    return topology.cpus;
+  }
+
+  /**
+   * Pins the calling thread to a CPU, if pinning is on, and restores the previous
+   * affinity of the thread when released or destroyed. This matters for the thread
+   * that calls the filter, since ITK runs the first slab on it
+   */
+  class ScopedPin
+  {
+  public:
+    ScopedPin() : m_Pinned(false) {}
+    ~ScopedPin() { Release(); }
+
+    /** Pin to the CPU for the slab centered at the given fraction of the slowest axis */
+    void Pin(double fraction)
+    {
+#ifdef __linux__
+      if(!GetSettings().pin_threads || m_Pinned)
+        return;
+
+      const std::vector<int> &cpus = GetCPUList();
+      if(cpus.empty())
+        return;
+
+      int pos = std::min((int) cpus.size() - 1, std::max(0, (int) (fraction * cpus.size())));
+      cpu_set_t target;
+      CPU_ZERO(&target);
+      CPU_SET(cpus[pos], &target);
+      if(pthread_getaffinity_np(pthread_self(), sizeof(m_Saved), &m_Saved) == 0
+         && pthread_setaffinity_np(pthread_self(), sizeof(target), &target) == 0)
+        m_Pinned = true;
+#endif
+    }
+
+    /** Pin to the CPU for a slab of a region, as split by ITK */
+    template <unsigned int VDim>
+    void Pin(const itk::ImageRegion<VDim> &slab, const itk::ImageRegion<VDim> &region)
+    {
+      double n = region.GetSize(VDim-1);
+      if(n > 0)
+        Pin((slab.GetIndex(VDim-1) - region.GetIndex(VDim-1) + 0.5 * slab.GetSize(VDim-1)) / n);
+    }
+
+    void Release()
+    {
+#ifdef __linux__
+      if(m_Pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(m_Saved), &m_Saved);
+#endif
+      m_Pinned = false;
+    }
+
+  protected:
+#ifdef __linux__
+    cpu_set_t m_Saved;
+#endif
+    bool m_Pinned;
+  };
+
+  /**
+   * Zero a newly allocated image buffer of n_bytes covering the given region, applying
+   * the current settings. Only use this for types for which all zero bytes is zero
+   */
+  template <unsigned int VDim>
+  static void ZeroFill(void *buffer, size_t n_bytes, const itk::ImageRegion<VDim> &region)
+  {
+    Settings &s = GetSettings();
+
+    // Huge pages only make sense for buffers spanning a few of them
+    if(s.huge_pages && n_bytes >= 4 * HUGE_PAGE_SIZE)
+      AdviseHugePages(buffer, n_bytes);
+
+    // Small buffers are zeroed by the calling thread
+    if(!s.first_touch || n_bytes < (1 << 20) || region.GetNumberOfPixels() == 0)
+      {
+      memset(buffer, 0, n_bytes);
+      return;
+      }
+
+    typedef itk::ImageRegionSplitterSlowDimension SplitterType;
+    SplitterType::Pointer splitter = SplitterType::New();
+
+    ZeroFillData<VDim> data;
+    data.buffer = static_cast<char *>(buffer);
+    data.bytes_per_pixel = n_bytes / region.GetNumberOfPixels();
+    data.region = region;
+    data.splitter = splitter;
+
+    itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+    data.n_splits = splitter->GetNumberOfSplits(region, mt->GetNumberOfThreads());
+    mt->SetNumberOfThreads(data.n_splits);
+    mt->SetSingleMethod(&ImageBufferPlacement::ZeroFillCallback<VDim>, &data);
+    mt->SingleMethodExecute();
+  }
+
+protected:
+
+  enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+
+  struct CPUTopology
+  {
+    std::vector<int> cpus;
+    int n_nodes;
+  };
+
+  static CPUTopology ReadCPUTopology()
+  {
+    CPUTopology topo;
+    topo.n_nodes = 1;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    // Read the CPUs of each node from sysfs, in the form "0-3,8-11"
+    std::vector<bool> listed(CPU_SETSIZE, false);
+    int nodes_found = 0;
+    for(int node = 0; node < 256; node++)
+      {
+      char fn[64];
+      sprintf(fn, "/sys/devices/system/node/node%d/cpulist", node);
+      FILE *f = fopen(fn, "r");
+      if(!f)
+        continue;
+
+      bool any = false;
+      int a, b, c;
+      while(fscanf(f, "%d", &a) == 1)
+        {
+        b = a;
+        c = fgetc(f);
+        if(c == '-')
+          {
+          if(fscanf(f, "%d", &b) != 1)
+            break;
+          c = fgetc(f);
+          }
+        for(int k = a; k <= b && k < CPU_SETSIZE; k++)
+          if(CPU_ISSET(k, &allowed) && !listed[k])
+            {
+            topo.cpus.push_back(k);
+            listed[k] = any = true;
+            }
+        if(c != ',')
+          break;
+        }
+      fclose(f);
+      if(any)
+        nodes_found++;
+      }
+
+    // Allowed CPUs that are not listed under any node (e.g., sysfs is not mounted)
+    for(int k = 0; k < CPU_SETSIZE; k++)
+      if(CPU_ISSET(k, &allowed) && !listed[k])
+        topo.cpus.push_back(k);
+
+    topo.n_nodes = std::max(nodes_found, 1);
+#endif
+    return topo;
+  }
+
+  static void AdviseHugePages(void *buffer, size_t n_bytes)
+  {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Only whole huge pages within the buffer can be advised
+    size_t start = ((size_t) buffer + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+    size_t end = ((size_t) buffer + n_bytes) & ~((size_t) HUGE_PAGE_SIZE - 1);
+    if(end > start)
+      madvise((void *) start, end - start, MADV_HUGEPAGE);
+#endif
+  }
+
+  template <unsigned int VDim>
+  struct ZeroFillData
+  {
+    char *buffer;
+    size_t bytes_per_pixel;
+    itk::ImageRegion<VDim> region;
+    itk::ImageRegionSplitterBase *splitter;
+    unsigned int n_splits;
+  };
+
+  template <unsigned int VDim>
+  static ITK_THREAD_RETURN_TYPE ZeroFillCallback(void *arg)
+  {
+    typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+    ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+    ZeroFillData<VDim> *data = static_cast<ZeroFillData<VDim> *>(info->UserData);
+
+    itk::ImageRegion<VDim> slab = data->region;
+    data->splitter->GetSplit(info->ThreadID, data->n_splits, slab);
+
+    ScopedPin pin;
+    pin.Pin(slab, data->region);
+
+    // The slabs are cut along the slowest axis of size above one, so each slab is
+    // contiguous in the buffer, starting at the linear offset of its first index
+    size_t offset = 0, stride = 1;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      offset += (slab.GetIndex(d) - data->region.GetIndex(d)) * stride;
+      stride *= data->region.GetSize(d);
+      }
+
+    memset(data->buffer + offset * data->bytes_per_pixel, 0,
+           slab.GetNumberOfPixels() * data->bytes_per_pixel);
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+
+#endif
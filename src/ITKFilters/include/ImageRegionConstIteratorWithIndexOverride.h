@@ -29,6 +29,8 @@ public:
 
   const InternalPixelType *GetBeginPosition() { return this->m_Begin; }
 
+  long GetOffsetInPixels() { return this->m_Position - this->m_Image->GetBufferPointer(); }
+
   template <class TPixel, unsigned int VDim>
   TPixel *GetPixelPointer(itk::Image<TPixel, VDim> *image)
     {
@@ -29,8 +29,12 @@
 
 #include <itkImageToImageFilter.h>
 
-/** 
- * A class that computes a Jacobian determinant field from a warp field
+/**
+ * A class that computes the determinant of the Jacobian of a warp field,
+ * det(I + Du), where u is a displacement field in voxel units. The derivatives
+ * are central differences with the same zero-flux boundary handling as
+ * itk::GradientImageFilter, so the result matches LDDMMData::field_jacobian
+ * followed by mimg_det, but the Jacobian matrix is never stored.
  */
 template <class TInputImage, class TOutputImage>
 class JacobianDeterminantImageFilter
@@ -68,6 +72,8 @@ public:
 
   typedef itk::ImageBase<ImageDimension>              ImageBaseType;
 
+  /** The filter needs a one-voxel border around the output region */
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
 
 protected:
 
@@ -75,7 +81,8 @@ protected:
   ~JacobianDeterminantImageFilter() {}
 
   void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
-                            itk::ThreadIdType threadId );
+                            itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
 private:
 
   JacobianDeterminantImageFilter(const Self&); //purposely not implemented
@@ -30,6 +30,21 @@
 /**
  * Normalized cross-correlation metric similar to the one used in ANTS. The gradient
  * is an approximation, but it seems to work very well.
+ *
+ * Compared to MultiComponentNCCImageMetric, the gradient is taken along the gradient
+ * of the fixed image rather than the gradient of the warped moving image. This means
+ * that the moving image gradient is never interpolated, and the working image only
+ * holds 7 values per component (vs. 5 + 3 * VDim for the exact metric), so each
+ * iteration is cheaper in time and memory. The price is that the update direction
+ * is less accurate where the images are poorly aligned, and the metric value is the
+ * sum of squared correlations that is not normalized by the patch size, so it can not
+ * be compared directly to the values reported by the exact metric. It is intended
+ * for the coarse levels of the pyramid, with the exact metric used at the finest.
+ * With the default of one exact level, the exact NCC reached at the end of a run is
+ * expected to be within 5% (relative) of the NCC reached with the exact metric at all
+ * levels; testing/data/runnccapprox.sh checks this on the phantoms.
+ *
+ * Only the deformable gradient is supported; affine gradient is not.
  */
 template <class TMetricTraits>
 class ITK_EXPORT MultiComponentApproximateNCCImageMetric :
@@ -125,10 +140,6 @@ private:
 
   // Radius of the cross-correlation
   SizeType m_Radius;
-
-  // Whether to compute the approximate gradient of the metric, as in Avants et al., 2008.
-  // When not set, the exact gradient is computed
-  bool m_ApproximateGradient;
 };
 
 
@@ -141,10 +152,10 @@ private:
  * \brief Helps compute the NCC metric
  *
  * This filter takes a pair of images plus a warp and computes the components that
- * are used to calculate the cross-correlation metric between them and
- * the gradient. These components are in the form I, I*J, and
- * so on. These components must then be mean-filtered and combined to get the
- * metric and the gradient.
+ * are used to calculate the cross-correlation metric between them. It runs in two
+ * stages: the first computes the intensities whose neighborhood means are needed,
+ * the second computes mean-subtracted intensities and their products, which must
+ * then be mean-filtered and combined to get the metric and the gradient.
  *
  * The output of this filter must be a vector image. The input may be a vector image.
  *
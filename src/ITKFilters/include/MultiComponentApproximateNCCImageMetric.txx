@@ -27,6 +27,7 @@
 #include "MultiComponentApproximateNCCImageMetric.h"
 #include "OneDimensionalInPlaceAccumulateFilter.h"
 #include "itkImageFileWriter.h"
+#include <itkVectorImageCentralDifferenceImageFunction.h>
 
 
 
@@ -65,26 +66,24 @@ int
 MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
 ::GetNumberOfOutputComponents()
 {
-  // This is complex! The number of components depends on what we are computing.
+  // Seven output values per input component, plus the patch size
   int nc = m_Parent->GetFixedImage()->GetNumberOfComponentsPerPixel();
-
-  // If there are no gradients computed, we just need 7 output pixels per input comp.
   return 1 + nc * 7;
 }
 
 /**
  * Compute the output for the region specified by outputRegionForThread.
  *
- * Coding:
+ * The output is organized in two blocks, so that each stage of the neighborhood
+ * accumulation can operate on a contiguous range of components:
+ *
  *    1
- *    f
- *    m
- *    f
- *    m
- *    f*f
- *    m*m
- *    f*m
- *    ...
+ *    f_1, m_1, ..., f_n, m_n
+ *    f_1, m_1, f_1*f_1, m_1*m_1, f_1*m_1, ..., f_n, m_n, f_n*f_n, m_n*m_n, f_n*m_n
+ *
+ * In the first stage, the first block holds raw intensities and is summed over
+ * the neighborhood to obtain local means. In the second stage, both blocks hold
+ * mean-subtracted intensities, and only the second block is summed.
  */
 template <class TMetricTraits, class TOutputImage>
 void
@@ -111,78 +110,41 @@ MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
       // Get the output pointer for this voxel
       OutputComponentType *out = iter.GetOutputLine();
 
-      // Interpolate the moving image at the current position. The worker knows
-      // whether to interpolate the gradient or not
+      // Interpolate the moving image at the current position. Outside of the moving
+      // image, the moving intensity is taken to be zero
       typename FastInterpolator::InOut status = iter.Interpolate();
+      const InputComponentType *x_fix = iter.GetFixedLine();
+      const InputComponentType *x_mov =
+          (status == FastInterpolator::OUTSIDE) ? NULL : iter.GetMovingSample();
 
-      // Border should be ok here because we are not sampling the gradient
-      if(status == FastInterpolator::OUTSIDE)
+      if(m_Stage == FIRST)
         {
-        // Place a zero in the output
         *out++ = 1.0;
-
-        // Iterate over the components
         for(int k = 0; k < ncomp_in; k++)
           {
-          InputComponentType x_fix = iter.GetFixedLine()[k];
-          *out++ = x_fix;
-          *out++ = 0.0;
-          *out++ = x_fix;
-          *out++ = 0.0;
-          *out++ = x_fix * x_fix;
-          *out++ = 0.0;
-          *out++ = 0.0;
+          *out++ = x_fix[k];
+          *out++ = x_mov ? x_mov[k] : 0.0;
           }
         }
-
       else
         {
-        if(m_Stage == FIRST)
-          {
-          // Place a zero in the output
-          *out++ = 1.0;
-
-          // Iterate over the components
-          for(int k = 0; k < ncomp_in; k++)
-            {
-            InputComponentType x_mov = iter.GetMovingSample()[k];
-            InputComponentType x_fix = iter.GetFixedLine()[k];
-
-            // Write the five components
-            *out++ = x_fix;
-            *out++ = x_mov;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            }
-          }
-        else
+        // The first value holds the number of voxels in the neighborhood
+        OutputComponentType one_over_n = 1.0 / *out++;
+        OutputComponentType *out_sums = out + 2 * ncomp_in;
+
+        for(int k = 0; k < ncomp_in; k++)
           {
-          // Get the number of neighbors from last round
-          InputComponentType n_nbr = *out;
-
-          // Place a one in the output
-          out++;
-
-          // Iterate over the components
-          for(int k = 0; k < ncomp_in; k++)
-            {
-            InputComponentType x_mov_raw = iter.GetMovingSample()[k];
-            InputComponentType x_fix_raw = iter.GetFixedLine()[k];
-
-            // Write the five components
-            InputComponentType x_fix = x_fix_raw - *out / n_nbr;
-            *out++ = x_fix;
-            InputComponentType x_mov = x_mov_raw - *out / n_nbr;
-            *out++ = x_mov;
-            *out++ = x_fix;
-            *out++ = x_mov;
-            *out++ = x_fix * x_fix;
-            *out++ = x_mov * x_mov;
-            *out++ = x_fix * x_mov;
-            }
+          // Subtract the neighborhood means computed in the first stage
+          OutputComponentType f = x_fix[k] - out[0] * one_over_n;
+          OutputComponentType m = (x_mov ? x_mov[k] : 0.0) - out[1] * one_over_n;
+          *out++ = f;
+          *out++ = m;
+
+          *out_sums++ = f;
+          *out_sums++ = m;
+          *out_sums++ = f * f;
+          *out_sums++ = m * m;
+          *out_sums++ = f * m;
           }
         }
       }
@@ -200,226 +162,141 @@ MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
 
 
 /**
- * This is a similar function to above, but uses the approximate algorithm described by Avants et al.
- * in the 2008 NeuroImage paper. This is not the exact gradient of the metric. This is useful for
- * comparing Greedy with ANTS
+ * This is a similar function to MultiImageNNCPostComputeFunction, but uses the
+ * approximate algorithm described by Avants et al. in the 2008 NeuroImage paper.
+ * This is not the exact gradient of the metric, it is taken along the gradient
+ * of the fixed image, which does not change between iterations.
  */
-template <class TPixel, class TWeight, class TMetric, class TGradient>
-TPixel *
+template <class TPixel, class TWeight, class TMetric, class TGradient, class TReal>
+void
 MultiImageApproximateNNCPostComputeFunction(
-    TPixel *ptr, TPixel *ptr_end, TWeight *weights, TMetric *ptr_metric, TGradient *ptr_gradient, int ImageDimension,
-    const TPixel *grad_fix, bool debug)
+    const TPixel *ptr, int n_comp, const TWeight *weights, TMetric *ptr_metric,
+    TPixel *ptr_comp_metrics, TGradient *ptr_gradient, int ImageDimension, const TReal *grad_fix)
 {
   // Get the size of the mean filter kernel
-  TPixel n = *ptr++, one_over_n = 1.0 / n;
+  TPixel n = *ptr, one_over_n = 1.0 / n;
 
-  // Loop over components
-  int i_wgt = 0;
+  // The centered intensities and the neighborhood sums
+  const TPixel *ptr_ctr = ptr + 1, *ptr_sums = ptr + 1 + 2 * n_comp;
 
   // Initialize metric to zero
   *ptr_metric = 0;
 
-  for(; ptr < ptr_end; ++i_wgt)
+  for(int k = 0; k < n_comp; k++, ptr_ctr += 2, ptr_sums += 5)
     {
-    TPixel I_bar = *ptr++;
-    TPixel J_bar = *ptr++;
-    TPixel I_2bar = *ptr++;
-    TPixel J_2bar = *ptr++;
-    TPixel x_fix_sq = *ptr++;
-    TPixel x_mov_sq = *ptr++;
-    TPixel x_fix_mov = *ptr++;
+    TPixel I_bar = ptr_ctr[0];
+    TPixel J_bar = ptr_ctr[1];
+    TPixel I_2bar = ptr_sums[0];
+    TPixel J_2bar = ptr_sums[1];
+    TPixel x_fix_sq = ptr_sums[2];
+    TPixel x_mov_sq = ptr_sums[3];
+    TPixel x_fix_mov = ptr_sums[4];
 
     TPixel sff = x_fix_sq - I_2bar * I_2bar * one_over_n;
     TPixel smm = x_mov_sq - J_2bar * J_2bar * one_over_n;
     TPixel smf = x_fix_mov - I_2bar * J_2bar * one_over_n;
 
-
-    if(sff == 0 || smm == 0)
-      {
-      if(ptr_gradient)
-        ptr += 3 * ImageDimension;
+    if(sff <= 0 || smm <= 0)
       continue;
-      }
 
-    TWeight w = weights[i_wgt];
+    TWeight w = weights[k];
     TPixel zoop = w * (smf / (sff * smm));
 
     if(ptr_gradient)
       {
-
-      // Term to multiply the gradient by...
+      // Term to multiply the gradient by: 2 * sfm / (sff * smm) * ( Ji - sfm / sff * Ii )
       TPixel factor = -2.0 * zoop * (J_bar - (smf / sff) * I_bar);
-
-      //  2.0 * sfm / (sff * smm) * ( Ji - sfm / sff * Ii )
-
-      if(debug)
-        {
-        printf("Ii = %f, Ji = %f, sff = %f, sfm = %f, smm = %f\n", I_bar, J_bar, sff, smf, smm);
-        printf("Metric = %f\n", zoop * smf);
-        printf("GradF = %f, %f, %f\n", grad_fix[0], grad_fix[1], grad_fix[2]);
-        }
-
       for(int i = 0; i < ImageDimension; i++)
-        {
-        (*ptr_gradient)[i] += factor * (*grad_fix++);
-        }
-
-      if(debug)
-        {
-        printf("Deriv = %g, %g, %g\n", (*ptr_gradient)[0], (*ptr_gradient)[1], (*ptr_gradient)[2]);
-        }
+        (*ptr_gradient)[i] += factor * grad_fix[i * n_comp + k];
       }
 
-
     // Accumulate the metric
-    *ptr_metric += zoop * smf;
+    TPixel r_sq = zoop * smf;
+    *ptr_metric += r_sq;
+    ptr_comp_metrics[k] += r_sq;
     }
-
-  return ptr;
 }
 
-
-// #define DUMP_NCC 1
-
 template <class TMetricTraits>
 void
 MultiComponentApproximateNCCImageMetric<TMetricTraits>
 ::BeforeThreadedGenerateData()
 {
+  // The approximate metric is only used for deformable registration
+  if(this->m_ComputeAffine)
+    itkExceptionMacro("Approximate NCC metric does not support affine gradients");
+
   // Call the parent method
   Superclass::BeforeThreadedGenerateData();
 
-  // Pre-compute filter 1
+  // Pre-compute filter
   typedef MultiImageApproximateNCCPrecomputeFilter<TMetricTraits, InputImageType> PreFilterType;
   typename PreFilterType::Pointer preFilter1 = PreFilterType::New();
-
-  // Configure the precompute filter
   preFilter1->SetParent(this);
   preFilter1->SetInput(this->GetFixedImage());
 
   // Number of components in the working image
   int ncomp = preFilter1->GetNumberOfOutputComponents();
+  int nc_img = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
 
-  // If the user supplied a working image, configure it and graft it as output
-  if(m_WorkingImage)
+  // Allocate the working image unless it can be reused
+  if(m_WorkingImage.IsNull())
+    m_WorkingImage = InputImageType::New();
+
+  if(m_WorkingImage->GetBufferedRegion() != this->GetFixedImage()->GetBufferedRegion()
+     || m_WorkingImage->GetNumberOfComponentsPerPixel() != (unsigned int) ncomp)
     {
-    // Configure the working image
     m_WorkingImage->CopyInformation(this->GetFixedImage());
     m_WorkingImage->SetNumberOfComponentsPerPixel(ncomp);
     m_WorkingImage->SetRegions(this->GetFixedImage()->GetBufferedRegion());
     m_WorkingImage->Allocate();
-
-    // Graft the working image onto the filter's output
-    preFilter1->GraftOutput(m_WorkingImage);
     }
 
-  // Execute the filter
+  // First stage: local sums of the fixed and moving intensities
+  preFilter1->GraftOutput(m_WorkingImage);
   preFilter1->SetStage(PreFilterType::FIRST);
   preFilter1->Update();
+  AccumulateNeighborhoodSumsInPlace(preFilter1->GetOutput(), m_Radius, 0, 5 * nc_img);
 
-#ifdef DUMP_NCC
-  typename itk::ImageFileWriter<InputImageType>::Pointer pwriter = itk::ImageFileWriter<InputImageType>::New();
-  pwriter->SetInput(preFilter1->GetOutput());
-  pwriter->SetFileName("nccpre1.nii.gz");
-  pwriter->Update();
-#endif
-
-  // First round of accumulation
-  typedef OneDimensionalInPlaceAccumulateFilter<InputImageType> AccumFilterType;
-
-  // Create a chain of separable 1-D filters
-  typename itk::ImageSource<InputImageType>::Pointer pipeTail;
-  for(int dir = 0; dir < ImageDimension; dir++)
-    {
-    typename AccumFilterType::Pointer accum = AccumFilterType::New();
-    if(pipeTail.IsNull())
-      accum->SetInput(preFilter1->GetOutput());
-    else
-      accum->SetInput(pipeTail->GetOutput());
-    accum->SetComponentRange(0, 5);
-    accum->SetDimension(dir);
-    accum->SetRadius(m_Radius[dir]);
-    pipeTail = accum;
-
-    accum->Update();
-    }
-
-  // At this point, we want to pull out components 1-3 from the working image
-
-  // Perform the second round of accumulation
+  // Second stage: local sums of the products of mean-subtracted intensities
   typename PreFilterType::Pointer preFilter2 = PreFilterType::New();
-
-  // Configure the precompute filter
   preFilter2->SetParent(this);
   preFilter2->SetInput(this->GetFixedImage());
   preFilter2->GraftOutput(m_WorkingImage);
-
-  // Execute the filter
   preFilter2->SetStage(PreFilterType::SECOND);
   preFilter2->Update();
-
-#ifdef DUMP_NCC
-  typename itk::ImageFileWriter<InputImageType>::Pointer pwriter1 = itk::ImageFileWriter<InputImageType>::New();
-  pwriter1->SetInput(preFilter2->GetOutput());
-  pwriter1->SetFileName("nccpre2.nii.gz");
-  pwriter1->Update();
-#endif
-
-  // Create a chain of separable 1-D filters
-  pipeTail = NULL;
-  for(int dir = 0; dir < ImageDimension; dir++)
-    {
-    typename AccumFilterType::Pointer accum = AccumFilterType::New();
-    if(pipeTail.IsNull())
-      accum->SetInput(preFilter2->GetOutput());
-    else
-      accum->SetInput(pipeTail->GetOutput());
-    accum->SetComponentRange(3, 0);
-    accum->SetDimension(dir);
-    accum->SetRadius(m_Radius[dir]);
-    pipeTail = accum;
-
-    accum->Update();
-    }
-
-#ifdef DUMP_NCC
-  typename itk::ImageFileWriter<InputImageType>::Pointer pwriter2 = itk::ImageFileWriter<InputImageType>::New();
-  pwriter2->SetInput(pipeTail->GetOutput());
-  pwriter2->SetFileName("nccaccum.nii.gz");
-  pwriter2->Update();
-#endif
+  AccumulateNeighborhoodSumsInPlace(preFilter2->GetOutput(), m_Radius, 1 + 2 * nc_img, 0);
 }
 
-// TODO: this only needs to be computed once per resolution level
-#include <itkVectorImageCentralDifferenceImageFunction.h>
-
 template <class TMetricTraits>
 void
 MultiComponentApproximateNCCImageMetric<TMetricTraits>
 ::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
 {
+  int nc_img = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
   int nc = m_WorkingImage->GetNumberOfComponentsPerPixel();
   int line_len = outputRegionForThread.GetSize()[0];
 
   // Our thread data
   typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
 
+  // Where to store the accumulated metric (gets copied to td)
+  vnl_vector<InputComponentType> comp_metric(nc_img, 0.0);
+
   // Set up an iterator for the working image
   typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> InputIteratorTypeBase;
   typedef IteratorExtender<InputIteratorTypeBase> InputIteratorType;
   InputIteratorType it(m_WorkingImage, outputRegionForThread);
 
-  // TODO: this can be pre-computed!
-  /* BEGIN: fixed gradient comp */
-  // Set up the fixed gradient calculator
-
+  // Gradient of the fixed image, in voxel units, computed on the fly. The derivatives
+  // of all components along the first axis come first, i.e., [d * nc + k]
   typedef itk::VectorImageCentralDifferenceImageFunction<InputImageType, RealType> CDType;
   typename CDType::Pointer cdiff = CDType::New();
   cdiff->SetInputImage(this->GetFixedImage());
-  IndexType index;
-  int grad_fixed_length = ImageDimension * this->GetFixedImage()->GetNumberOfComponentsPerPixel();
-  RealType *grad_fixed = new RealType[grad_fixed_length];
-  itk::VariableLengthVector<RealType> grad_fixed_vec(grad_fixed, grad_fixed_length);
+  int grad_fixed_length = ImageDimension * nc_img;
+  std::vector<RealType> grad_fixed(grad_fixed_length);
+  itk::VariableLengthVector<RealType> grad_fixed_vec(grad_fixed.data(), grad_fixed_length);
+  const SpacingType &spacing = this->GetFixedImage()->GetSpacing();
 
   // Loop over the lines
   for (; !it.IsAtEnd(); it.NextLine())
@@ -428,69 +305,59 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
     long offset_in_pixels = it.GetPosition() - m_WorkingImage->GetBufferPointer();
 
     // Pointer to the input pixel data for this line
-    InputComponentType *p_input = m_WorkingImage->GetBufferPointer() + nc * offset_in_pixels;
+    const InputComponentType *p_input = m_WorkingImage->GetBufferPointer() + nc * offset_in_pixels;
 
     // Pointer to the metric data for this line
     MetricPixelType *p_metric = this->GetMetricOutput()->GetBufferPointer() + offset_in_pixels;
 
     // The gradient output is optional
-    GradientPixelType *p_grad_metric = (this->m_ComputeGradient && !this->m_ComputeAffine)
+    GradientPixelType *p_grad_metric = this->m_ComputeGradient
                                        ? this->GetDeformationGradientOutput()->GetBufferPointer() + offset_in_pixels
                                        : NULL;
 
-    // Index: for gradient computation (remove later)
-    index = it.GetIndex();
+    // Get the fixed mask line
+    typename MaskImageType::PixelType *fixed_mask_line =
+        this->GetFixedMaskImage()
+        ? this->GetFixedMaskImage()->GetBufferPointer() + offset_in_pixels
+        : NULL;
+
+    IndexType index = it.GetIndex();
 
-    // Case 1 - dense gradient field requested
-    if(!this->m_ComputeAffine)
+    for(int i = 0; i < line_len; ++i, ++p_metric, p_input += nc)
       {
-      if(this->m_ComputeGradient)
+      // Clear the metric and the gradient
+      *p_metric = itk::NumericTraits<MetricPixelType>::Zero;
+      if(p_grad_metric)
+        *p_grad_metric = itk::NumericTraits<GradientPixelType>::Zero;
+
+      if(!fixed_mask_line || fixed_mask_line[i] > 0.5)
         {
-        // Loop over the pixels in the line
-        for(int i = 0; i < line_len; ++i)
+        if(p_grad_metric)
           {
-          // Clear the metric and the gradient
-          *p_metric = itk::NumericTraits<MetricPixelType>::Zero;
-
-          // Gradient of the fixed image is passed in through the p_grad_metric!
-          *p_grad_metric = itk::NumericTraits<GradientPixelType>::Zero;
-
-          // Compute the gradient
-          index[0] = i;
+          index[0] = it.GetIndex()[0] + i;
           cdiff->EvaluateAtIndex(index, grad_fixed_vec);
-
-          bool debugff = (it.GetIndex()[1] == 33 && it.GetIndex()[2] == 22 && i == 44);
-          p_input = MultiImageApproximateNNCPostComputeFunction(p_input, p_input + nc, this->m_Weights.data_block(),
-                                                                p_metric, p_grad_metric++, ImageDimension, grad_fixed, debugff);
-          // Accumulate the total metric
-          td.metric += *p_metric;
-          td.mask += 1.0;
+          for(int k = 0; k < grad_fixed_length; k++)
+            grad_fixed[k] *= spacing[k / nc_img];
           }
-        }
-      else
-        {
-        // Loop over the pixels in the line
-        for(int i = 0; i < line_len; ++i)
-          {
-          // Clear the metric and the gradient
-          *p_metric = itk::NumericTraits<MetricPixelType>::Zero;
 
-          // Apply the post computation
-          p_input = MultiImageApproximateNNCPostComputeFunction(p_input, p_input + nc, this->m_Weights.data_block(),
-                                                                p_metric, (GradientPixelType *)(NULL), ImageDimension,
-                                                                (const RealType *) NULL, false);
+        MultiImageApproximateNNCPostComputeFunction(
+              p_input, nc_img, this->m_Weights.data_block(), p_metric,
+              comp_metric.data_block(), p_grad_metric, ImageDimension, grad_fixed.data());
 
-          // Accumulate the total metric
-          td.metric += *p_metric;
-          td.mask += 1.0;
-          }
+        // Accumulate the total metric
+        td.metric += *p_metric;
+        td.mask += 1.0;
         }
+
+      if(p_grad_metric)
+        ++p_grad_metric;
       }
     }
 
-  delete[] grad_fixed;
+  // Typecast the per-component metrics
+  for(int a = 0; a < nc_img; a++)
+    td.comp_metric[a] = comp_metric[a];
 }
 
 
 #endif // __MultiComponentApproximateNCCImageMetric_txx
-
@@ -34,6 +34,7 @@
 #include "itkVectorImage.h"
 #include "itkMatrixOffsetTransformBase.h"
 #include "lddmm_common.h"
+#include "FastLinearInterpolator.h"
 
 /**
  * Default traits for parameterizing the metric filters below
@@ -54,6 +55,29 @@ template <class TReal, unsigned int VDim> struct DefaultMultiComponentImageMetri
 };
 
 
+/**
+ * Runs the ThreadedGenerateDataWithComponents<VComp> implementation of a filter with VComp
+ * equal to the number of components for one to four components, and with VComp = 0 (any
+ * number of components) otherwise. The filters that use it declare it a friend.
+ */
+struct MultiComponentDispatch
+{
+  template <class TFilter, class TRegion>
+  static void ThreadedGenerateData(TFilter *filter, unsigned int ncomp,
+                                   const TRegion &region, itk::ThreadIdType threadId)
+  {
+    switch(ncomp)
+      {
+      case 1: filter->template ThreadedGenerateDataWithComponents<1>(region, threadId); break;
+      case 2: filter->template ThreadedGenerateDataWithComponents<2>(region, threadId); break;
+      case 3: filter->template ThreadedGenerateDataWithComponents<3>(region, threadId); break;
+      case 4: filter->template ThreadedGenerateDataWithComponents<4>(region, threadId); break;
+      default: filter->template ThreadedGenerateDataWithComponents<0>(region, threadId); break;
+      }
+  }
+};
+
+
 /**
  * \class MultiComponentImageMetricBase
  *
@@ -125,6 +149,9 @@ public:
   /** Weight vector */
   typedef vnl_vector<float>                           WeightVectorType;
 
+  /** Tiled copy of the moving image */
+  typedef FastLinearInterpolatorTiles<InputImageType> MovingImageTilesType;
+
   /** Set the fixed image(s) */
   itkNamedInputMacro(FixedImage, InputImageType, "Primary")
 
@@ -137,6 +164,23 @@ public:
   /** Set the optional moving mask input */
   itkNamedInputMacro(MovingMaskImage, MaskImageType, "moving_mask")
 
+  /**
+   * Set an optional tiled copy of the moving image, from which the moving image is
+   * interpolated. The caller owns the tiles and keeps them in sync with the moving image
+   */
+  void SetMovingImageTiles(const MovingImageTilesType *tiles) { m_MovingImageTiles = tiles; }
+  const MovingImageTilesType *GetMovingImageTiles() const { return m_MovingImageTiles; }
+
+  /**
+   * Set an optional copy of the moving image in which each pixel holds the values of the
+   * components followed by the index-space gradient of each component. When set, metrics
+   * that need the moving gradient interpolate the values and the gradient from it instead
+   * of differentiating the interpolant of the moving image (the tiles are then not used).
+   * The caller owns the image and keeps it in sync with the moving image
+   */
+  void SetMovingImageWithGradient(InputImageType *image) { m_MovingImageWithGradient = image; }
+  InputImageType *GetMovingImageWithGradient() const { return m_MovingImageWithGradient; }
+
   /** Set the optional jitter input - for affine images*/
   itkNamedInputMacro(JitterImage, DeformationFieldType, "jitter")
 
@@ -191,6 +235,15 @@ public:
     this->UpdateOutputs();
   }
 
+  /**
+   * Specify whether the per-voxel metric image should be allocated and filled. When off,
+   * the metric output only defines the domain over which the metric is computed, and only
+   * the summary values and affine gradient are produced. This is only honored by metrics
+   * that do not use the metric image internally (SSD and mutual information).
+   */
+  itkSetMacro(ComputeMetricImage, bool)
+  itkGetMacro(ComputeMetricImage, bool)
+
   /** Get the metric image output - this is the main output */
   itkNamedOutputMacro(MetricOutput, MetricImageType, "Primary")
 
@@ -239,6 +292,8 @@ protected:
   virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
   virtual void AfterThreadedGenerateData() ITK_OVERRIDE;
 
+  virtual void AllocateOutputs() ITK_OVERRIDE;
+
 
 
   // Weight vector
@@ -247,6 +302,13 @@ protected:
   bool m_ComputeMovingDomainMask;
   bool m_ComputeGradient;
   bool m_ComputeAffine;
+  bool m_ComputeMetricImage;
+
+  // Tiled copy of the moving image, not owned by the filter
+  const MovingImageTilesType *m_MovingImageTiles;
+
+  // Moving image with interleaved gradients, not owned by the filter
+  InputImageType *m_MovingImageWithGradient;
 
   // Data accumulated for each thread
   struct ThreadData {
@@ -40,6 +40,9 @@ MultiComponentImageMetricBase<TMetricTraits>
   this->m_ComputeGradient = false;
   this->m_ComputeMovingDomainMask = false;
   this->m_ComputeAffine = false;
+  this->m_ComputeMetricImage = true;
+  this->m_MovingImageTiles = NULL;
+  this->m_MovingImageWithGradient = NULL;
 }
 
 
@@ -100,6 +103,27 @@ MultiComponentImageMetricBase<TMetricTraits>
 }
 
 
+template <class TMetricTraits>
+void
+MultiComponentImageMetricBase<TMetricTraits>
+::AllocateOutputs()
+{
+  if(m_ComputeMetricImage)
+    {
+    Superclass::AllocateOutputs();
+    return;
+    }
+
+  // The metric image is not allocated, it just defines the region split among threads.
+  // The only other possible output is the deformation gradient
+  if(m_ComputeGradient && !m_ComputeAffine)
+    {
+    GradientImageType *grad = this->GetDeformationGradientOutput();
+    grad->SetBufferedRegion(grad->GetRequestedRegion());
+    grad->Allocate();
+    }
+}
+
 template <class TMetricTraits>
 void
 MultiComponentImageMetricBase<TMetricTraits>
@@ -187,6 +211,7 @@ MultiComponentImageMetricBase<TMetricTraits>
 #include "itkImageLinearIteratorWithIndex.h"
 #include "ImageRegionConstIteratorWithIndexOverride.h"
 #include "FastLinearInterpolator.h"
+#include "ImageBufferPlacement.h"
 
 
 // #define _FAKE_FUNC_
@@ -200,8 +225,13 @@ MultiComponentImageMetricBase<TMetricTraits>
  * linear traversal through the output region, like a ImageLinearIteratorWithIndex.
  *
  * It also supports interpolating the moving image at the current location.
+ *
+ * If VComp is non-zero, the fixed and moving images must have exactly VComp
+ * components, which lets the compiler unroll the loops over the components.
+ * Filters choose VComp from the number of components at run time, and fall back
+ * to VComp = 0 for more than four components.
  */
-template <class TMetricTraits, class TOutputImage>
+template <class TMetricTraits, class TOutputImage, unsigned int VComp = 0>
 class MultiComponentMetricWorker
 {
 public:
@@ -218,7 +248,7 @@ public:
   typedef MultiComponentImageMetricBase<TMetricTraits> MetricType;
   typedef typename MetricType::OutputImageRegionType RegionType;
 
-  typedef MultiComponentMetricWorker<TMetricTraits,TOutputImage> Self;
+  typedef MultiComponentMetricWorker<TMetricTraits,TOutputImage,VComp> Self;
 
   typedef itk::ImageLinearIteratorWithIndex<TOutputImage> IterBase;
   typedef IteratorExtender<IterBase> IterType;
@@ -226,7 +256,11 @@ public:
   /** Determine the image dimension. */
   itkStaticConstMacro(ImageDimension, unsigned int, InputImageType::ImageDimension );
 
-  typedef FastLinearInterpolator<InputImageType, RealType, ImageDimension, MaskImageType> InterpType;
+  typedef FastLinearInterpolator<InputImageType, RealType, ImageDimension, MaskImageType, VComp> InterpType;
+
+  // Interpolator for the moving image with interleaved gradients (1 + ImageDimension
+  // times the components of the moving image, so the component count is not fixed)
+  typedef FastLinearInterpolator<InputImageType, RealType, ImageDimension, MaskImageType> GradientInterpType;
 
   typedef typename InputImageType::IndexType IndexType;
   typedef itk::ContinuousIndex<double, ImageDimension>  ContIndexType;
@@ -242,6 +276,23 @@ public:
     : m_WrappedIter(image, region),
       m_Interpolator(metric->GetMovingImage(), metric->GetMovingMaskImage()),
       m_OutputImage(image)
+  {
+    this->Initialize(metric, image, region);
+  }
+
+  /**
+   * Construct a worker that only traverses the geometry of the image, e.g., the fixed
+   * image, without writing any per-voxel output. GetOutputLine() returns NULL.
+   */
+  MultiComponentMetricWorker(MetricType *metric, const TOutputImage * image, const RegionType &region)
+    : m_WrappedIter(image, region),
+      m_Interpolator(metric->GetMovingImage(), metric->GetMovingMaskImage()),
+      m_OutputImage(NULL)
+  {
+    this->Initialize(metric, image, region);
+  }
+
+  void Initialize(MetricType *metric, const TOutputImage *image, const RegionType &region)
   {
     m_Metric = metric;
     m_Affine = (m_Metric->GetDeformationField() == NULL);
@@ -249,11 +300,26 @@ public:
     m_LineLength = region.GetSize(0);
     m_FixedStep = m_Metric->GetFixedImage()->GetNumberOfComponentsPerPixel();
     m_OutputStep = image->GetNumberOfComponentsPerPixel();
-
-    m_MovingSample = new RealType[m_FixedStep];
+    m_Interpolator.SetTiles(m_Metric->GetMovingImageTiles());
+
+    // Run on the NUMA node where this slab of the image buffers was first touched. The
+    // slabs are cut from the fixed image region (the output may not be allocated)
+    m_Pin.Pin(region, m_Metric->GetFixedImage()->GetBufferedRegion());
+
+    // When the moving gradient is precomputed, the interpolated values and gradients are
+    // read from it in one pass
+    m_GradientInterpolator = (m_Gradient && m_Metric->GetMovingImageWithGradient())
+                             ? new GradientInterpType(m_Metric->GetMovingImageWithGradient(),
+                                                      m_Metric->GetMovingMaskImage())
+                             : NULL;
+
+    // The interpolated values and gradients of all components are kept in one contiguous
+    // block, in the same order as the pixels of the moving image with gradients
+    m_SampleBuffer = new RealType[m_FixedStep * (1 + ImageDimension)];
+    m_MovingSample = m_SampleBuffer;
     m_MovingSampleGradient = new RealType * [m_FixedStep];
     for(int i = 0; i < m_FixedStep; i++)
-      m_MovingSampleGradient[i] = new RealType[ImageDimension];
+      m_MovingSampleGradient[i] = m_SampleBuffer + m_FixedStep + i * ImageDimension;
     m_MaskGradient = new RealType[ImageDimension];
 
     m_SamplePos = vnl_vector<RealType>(ImageDimension, 0.0);
@@ -264,11 +330,10 @@ public:
 
   ~MultiComponentMetricWorker()
   {
-    for(int i = 0; i < m_FixedStep; i++)
-      delete m_MovingSampleGradient[i];
-    delete m_MovingSampleGradient;
-    delete m_MovingSample;
-    delete m_MaskGradient;
+    delete m_GradientInterpolator;
+    delete [] m_MovingSampleGradient;
+    delete [] m_SampleBuffer;
+    delete [] m_MaskGradient;
   }
 
   bool IsAtEnd()
@@ -288,11 +353,11 @@ public:
   void SetupLine()
   {
     // Get the offset of this line in pixels (not components)
-    m_OffsetInPixels = m_WrappedIter.GetPosition() - m_OutputImage->GetBufferPointer();
+    m_OffsetInPixels = m_WrappedIter.GetOffsetInPixels();
 
     // Set up the arrays for this line
     m_FixedLine = m_Metric->GetFixedImage()->GetBufferPointer()
-                  + m_OffsetInPixels * m_FixedStep;
+                  + m_OffsetInPixels * this->GetNumberOfComponents();
 
     // Mask line
     m_FixedMaskLine = (m_Metric->GetFixedMaskImage())
@@ -309,7 +374,9 @@ public:
                    : NULL;
 
     // Get the output line
-    m_OutputLine = m_OutputImage->GetBufferPointer() + m_OffsetInPixels * m_OutputStep;
+    m_OutputLine = m_OutputImage
+                   ? m_OutputImage->GetBufferPointer() + m_OffsetInPixels * m_OutputStep
+                   : NULL;
 
     // Set the current sample position
     m_Index = m_WrappedIter.GetIndex();
@@ -340,8 +407,9 @@ public:
     m_Index[0]++;
     if(m_Index[0] < m_LineLength)
       {
-      m_FixedLine += m_FixedStep;
-      m_OutputLine += m_OutputStep;
+      m_FixedLine += this->GetNumberOfComponents();
+      if(m_OutputLine)
+        m_OutputLine += m_OutputStep;
 
       if(m_FixedMaskLine)
         m_FixedMaskLine++;
@@ -386,7 +454,7 @@ public:
     typename InterpType::InOut status;
 
     // Clear the moving sample
-    for(int i = 0; i < m_FixedStep; i++)
+    for(int i = 0; i < this->GetNumberOfComponents(); i++)
       m_MovingSample[i] = 0.0;
 
 #ifdef _FAKE_FUNC_
@@ -406,7 +474,19 @@ public:
 #else
 
     // Interpolate the moving image
-    if(m_Gradient)
+    if(m_GradientInterpolator)
+      {
+      // The values and gradients are interpolated together from the precomputed image
+      status = (typename InterpType::InOut) m_GradientInterpolator->Interpolate(
+                 m_SamplePos.data_block(), m_SampleBuffer);
+
+      if(status == InterpType::BORDER)
+        {
+        // Compute the mask
+        m_Mask = m_GradientInterpolator->GetMaskAndGradient(m_MaskGradient);
+        }
+      }
+    else if(m_Gradient)
       {
       // Read out the status
       status = m_Interpolator.InterpolateWithGradient(
@@ -452,6 +532,9 @@ public:
 
   long GetOffsetInPixels() { return m_OffsetInPixels; }
 
+  /** Number of components in the fixed and moving images, a constant if VComp > 0 */
+  int GetNumberOfComponents() const { return VComp > 0 ? (int) VComp : m_FixedStep; }
+
   InputComponentType *GetFixedLine() { return m_FixedLine; }
 
   /**
@@ -507,8 +590,10 @@ protected:
   vnl_vector<RealType> m_SamplePos, m_SampleStep;
 
   InterpType m_Interpolator;
+  GradientInterpType *m_GradientInterpolator;
+  ImageBufferPlacement::ScopedPin m_Pin;
 
-  RealType *m_MovingSample, **m_MovingSampleGradient, *m_MaskGradient;
+  RealType *m_SampleBuffer, *m_MovingSample, **m_MovingSampleGradient, *m_MaskGradient;
   RealType m_Mask;
 
   bool m_Affine, m_Gradient;
@@ -0,0 +1,150 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __MultiComponentImageMomentsFilter_h
+#define __MultiComponentImageMomentsFilter_h
+
+#include "itkImageToImageFilter.h"
+#include <vnl/vnl_vector.h>
+#include <vnl/vnl_vector_fixed.h>
+#include <vnl/vnl_matrix_fixed.h>
+
+/**
+ * This filter computes the first and second moments of the physical (LPS)
+ * coordinates of a multi-component image, weighted by a linear combination
+ * of the components. The image is passed through as the output.
+ *
+ * The sums are accumulated per thread with compensated (Kahan) summation, and
+ * the physical coordinates are stepped along each image line rather than
+ * recomputed from the index. An optional downsampling factor restricts the
+ * computation to every k-th voxel along each dimension.
+ */
+template <class TInputImage>
+class ITK_EXPORT MultiComponentImageMomentsFilter :
+    public itk::ImageToImageFilter<TInputImage, TInputImage>
+{
+public:
+
+  /** Standard class typedefs. */
+  typedef MultiComponentImageMomentsFilter                       Self;
+  typedef itk::ImageToImageFilter<TInputImage,TInputImage>       Superclass;
+  typedef itk::SmartPointer<Self>                                Pointer;
+  typedef itk::SmartPointer<const Self>                          ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( MultiComponentImageMomentsFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TInputImage::ImageDimension );
+
+  typedef TInputImage                                 InputImageType;
+  typedef typename InputImageType::InternalPixelType  InputComponentType;
+  typedef typename InputImageType::IndexType          IndexType;
+  typedef typename InputImageType::IndexValueType     IndexValueType;
+  typedef typename InputImageType::RegionType         OutputImageRegionType;
+
+  typedef vnl_vector_fixed<double, ImageDimension>                 VectorType;
+  typedef vnl_matrix_fixed<double, ImageDimension, ImageDimension> MatrixType;
+
+  /** Weights of the image components */
+  itkSetMacro(Weights, vnl_vector<double>)
+  itkGetConstReferenceMacro(Weights, vnl_vector<double>)
+
+  /** Only every k-th voxel along each dimension is used (default 1) */
+  itkSetMacro(DownsampleFactor, unsigned int)
+  itkGetMacro(DownsampleFactor, unsigned int)
+
+  /** Sum of the weighted intensities */
+  itkGetMacro(TotalWeight, double)
+
+  /** Weighted mean of the physical coordinates */
+  itkGetConstReferenceMacro(Mean, VectorType)
+
+  /** Weighted covariance of the physical coordinates */
+  itkGetConstReferenceMacro(Covariance, MatrixType)
+
+protected:
+  MultiComponentImageMomentsFilter() : m_DownsampleFactor(1), m_TotalWeight(0.0) {}
+  ~MultiComponentImageMomentsFilter() {}
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                            itk::ThreadIdType threadId );
+
+  /** The whole input is needed */
+  virtual void GenerateInputRequestedRegion();
+
+  /** Override since input passed to output */
+  virtual void EnlargeOutputRequestedRegion(itk::DataObject *data);
+
+  virtual void BeforeThreadedGenerateData();
+
+  virtual void AfterThreadedGenerateData();
+
+  /** Allocate outputs - just pass through the input */
+  virtual void AllocateOutputs();
+
+private:
+  MultiComponentImageMomentsFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  // Running sum with Kahan compensation
+  struct CompensatedSum
+  {
+    double sum, c;
+    CompensatedSum() : sum(0.0), c(0.0) {}
+    void Add(double x)
+      {
+      double y = x - c, t = sum + y;
+      c = (t - sum) - y;
+      sum = t;
+      }
+  };
+
+  // Data accumulated for each thread: the total weight, the first moments and the
+  // upper triangle of the second moments
+  struct ThreadData {
+    std::vector<CompensatedSum> sums;
+    ThreadData() : sums(1 + ImageDimension + ImageDimension * (ImageDimension + 1) / 2) {}
+  };
+
+  std::vector<ThreadData>         m_ThreadData;
+
+  vnl_vector<double>              m_Weights;
+  unsigned int                    m_DownsampleFactor;
+
+  double                          m_TotalWeight;
+  VectorType                      m_Mean;
+  MatrixType                      m_Covariance;
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "MultiComponentImageMomentsFilter.txx"
+#endif
+
+#endif // __MultiComponentImageMomentsFilter_h
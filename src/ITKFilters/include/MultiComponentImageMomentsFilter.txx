@@ -0,0 +1,176 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __MultiComponentImageMomentsFilter_txx
+#define __MultiComponentImageMomentsFilter_txx
+#include "MultiComponentImageMomentsFilter.h"
+
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "itkPoint.h"
+#include <algorithm>
+
+template <class TInputImage>
+void
+MultiComponentImageMomentsFilter<TInputImage>
+::BeforeThreadedGenerateData()
+{
+  // Initialize the per thread data
+  m_ThreadData.clear();
+  m_ThreadData.resize(this->GetNumberOfThreads(), ThreadData());
+}
+
+template <class TInputImage>
+void
+MultiComponentImageMomentsFilter<TInputImage>
+::AfterThreadedGenerateData()
+{
+  // Add up all the thread data
+  unsigned int n_sums = ThreadData().sums.size();
+  vnl_vector<double> total(n_sums, 0.0);
+  for(unsigned int i = 0; i < m_ThreadData.size(); i++)
+    for(unsigned int q = 0; q < n_sums; q++)
+      total[q] += m_ThreadData[i].sums[q].sum - m_ThreadData[i].sums[q].c;
+
+  // Compute the mean and covariance from the sum of squares
+  unsigned int q = 0;
+  m_TotalWeight = total[q++];
+  for(unsigned int a = 0; a < ImageDimension; a++)
+    m_Mean[a] = total[q++] / m_TotalWeight;
+
+  for(unsigned int a = 0; a < ImageDimension; a++)
+    {
+    for(unsigned int b = a; b < ImageDimension; b++)
+      {
+      double cov = total[q++] / m_TotalWeight - m_Mean[a] * m_Mean[b];
+      m_Covariance(a, b) = cov;
+      m_Covariance(b, a) = cov;
+      }
+    }
+}
+
+template <class TInputImage>
+void
+MultiComponentImageMomentsFilter<TInputImage>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+  const_cast<InputImageType *>(this->GetInput())->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TInputImage>
+void
+MultiComponentImageMomentsFilter<TInputImage>
+::EnlargeOutputRequestedRegion(itk::DataObject *data)
+{
+  Superclass::EnlargeOutputRequestedRegion(data);
+  data->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TInputImage>
+void
+MultiComponentImageMomentsFilter<TInputImage>
+::AllocateOutputs()
+{
+  // Propagate input
+  this->GraftOutput(const_cast<InputImageType *>(this->GetInput()));
+}
+
+template <class TInputImage>
+void
+MultiComponentImageMomentsFilter<TInputImage>
+::ThreadedGenerateData(
+  const OutputImageRegionType& outputRegionForThread,
+  itk::ThreadIdType threadId )
+{
+  const InputImageType *image = this->GetInput();
+  const OutputImageRegionType &region = image->GetBufferedRegion();
+  int nc = image->GetNumberOfComponentsPerPixel();
+  IndexValueType ds = std::max(m_DownsampleFactor, 1u);
+
+  // The thread data to accumulate
+  ThreadData &td = m_ThreadData[threadId];
+
+  // Physical displacement between consecutive samples along a line
+  VectorType step;
+  for(unsigned int a = 0; a < ImageDimension; a++)
+    step[a] = image->GetDirection()(a, 0) * image->GetSpacing()[0] * ds;
+
+  IndexValueType line_end = outputRegionForThread.GetIndex(0) + outputRegionForThread.GetSize(0);
+  double x[ImageDimension];
+
+  typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> IterType;
+  IterType it(image, outputRegionForThread);
+  it.SetDirection(0);
+  for(; !it.IsAtEnd(); it.NextLine())
+    {
+    IndexType idx = it.GetIndex();
+
+    // Skip lines that are not on the downsampled grid
+    bool on_grid = true;
+    for(unsigned int d = 1; d < ImageDimension; d++)
+      if((idx[d] - region.GetIndex(d)) % ds)
+        on_grid = false;
+    if(!on_grid)
+      continue;
+
+    // Find the first sample on the line
+    IndexValueType rem = (idx[0] - region.GetIndex(0)) % ds;
+    if(rem)
+      idx[0] += ds - rem;
+    if(idx[0] >= line_end)
+      continue;
+
+    // Physical coordinates of the first sample
+    itk::Point<double, ImageDimension> p0;
+    image->TransformIndexToPhysicalPoint(idx, p0);
+
+    const InputComponentType *p = image->GetBufferPointer() + nc * image->ComputeOffset(idx);
+    int n_samples = (line_end - 1 - idx[0]) / ds + 1;
+    for(int j = 0; j < n_samples; j++, p += nc * ds)
+      {
+      // Just weight the components of intensity by weight vector
+      double val = 0.0;
+      for(int k = 0; k < nc; k++)
+        val += m_Weights[k] * p[k];
+
+      if(val == 0.0)
+        continue;
+
+      for(unsigned int a = 0; a < ImageDimension; a++)
+        x[a] = p0[a] + j * step[a];
+
+      unsigned int q = 0;
+      td.sums[q++].Add(val);
+      for(unsigned int a = 0; a < ImageDimension; a++)
+        td.sums[q++].Add(val * x[a]);
+      for(unsigned int a = 0; a < ImageDimension; a++)
+        for(unsigned int b = a; b < ImageDimension; b++)
+          td.sums[q++].Add(val * x[a] * x[b]);
+      }
+    }
+}
+
+#endif // __MultiComponentImageMomentsFilter_txx
@@ -29,6 +29,9 @@
 #define MULTICOMPONENTMUTUALINFOIMAGEMETRIC_H
 
 #include "MultiComponentImageMetricBase.h"
+#include "ThreadedQuantileSearch.h"
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
 #include "itkBarrier.h"
 #include <queue>
 #include <vector>
@@ -164,6 +167,13 @@ protected:
   virtual void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
                                     itk::ThreadIdType threadId ) ITK_OVERRIDE;
 
+  friend struct MultiComponentDispatch;
+
+  // Implementation for VComp components (0 means any number)
+  template <unsigned int VComp>
+  void ThreadedGenerateDataWithComponents(const OutputImageRegionType& outputRegionForThread,
+                                          itk::ThreadIdType threadId);
+
 protected:
   MultiComponentMutualInfoImageMetric()
     : m_Bins(32), m_ComputeNormalizedMutualInformation(false) { }
@@ -252,7 +262,8 @@ public:
 
   /**
    * Set the lower quantile (default 0), below which all values are treated as equal
-   * to the minimum value.
+   * to the minimum value. Quantiles are computed exactly with histograms, and the
+   * result does not depend on the number of threads.
    */
   itkSetMacro(LowerQuantile, double)
 
@@ -310,52 +321,35 @@ private:
   // The quantile to map to the upper and lower bins.
   double m_LowerQuantile, m_UpperQuantile;
 
-  // Heap data types
-  typedef std::priority_queue<
-    InputComponentType, std::vector<InputComponentType>, std::less<InputComponentType> > LowerHeap;
+  // Exact quantile search, shared with the ComponentExtractionFilter
+  ThreadedQuantileSearch m_QuantileSearch;
 
-  typedef std::priority_queue<
-    InputComponentType, std::vector<InputComponentType>, std::greater<InputComponentType> > UpperHeap;
-
-  void heap_lower_push(LowerHeap &heap, int max_size, const InputComponentType &v)
-  {
-    if(heap.size() < max_size)
-      {
-      heap.push(v);
-      }
-    else if(heap.top() > v)
-      {
-      heap.pop();
-      heap.push(v);
-      }
-  }
-
-  void heap_upper_push(UpperHeap &heap, int max_size, const InputComponentType &v)
+  // Passes the values of a component in a thread's region to the quantile search
+  struct ComponentScanner
   {
-    if(heap.size() < max_size)
-      {
-      heap.push(v);
-      }
-    else if(heap.top() < v)
-      {
-      heap.pop();
-      heap.push(v);
-      }
-  }
-
-  // Per thread data
-  struct ThreadData
-  {
-    // Heaps for minimum and maximum intensities
-    LowerHeap heap_lower;
-    UpperHeap heap_upper;
-    unsigned long number_of_nans;
+    const InputImageType *input;
+    OutputImageRegionType region;
+    int component, ncomp;
+
+    ComponentScanner(const InputImageType *in_input, const OutputImageRegionType &in_region,
+                     int in_component)
+      : input(in_input), region(in_region), component(in_component),
+        ncomp(in_input->GetNumberOfComponentsPerPixel()) {}
+
+    template <class TFunctor> void operator()(TFunctor &f) const
+    {
+      typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> IterBase;
+      typedef IteratorExtender<IterBase> Iterator;
+      long line_length = region.GetSize(0);
+      for(Iterator it(input, region); !it.IsAtEnd(); it.NextLine())
+        {
+        const InputComponentType *line = it.GetPixelPointer(input) + component;
+        for(long p = 0; p < line_length; p++, line += ncomp)
+          f((double) *line);
+        }
+    }
   };
 
-  std::vector<ThreadData> m_ThreadData;
-
-  typename itk::Barrier::Pointer m_Barrier;
-
   std::vector<InputComponentType> m_LowerQuantileValues, m_UpperQuantileValues;
   std::vector<unsigned int> m_NumberOfNaNs;
 
@@ -220,12 +220,26 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
     const OutputImageRegionType &outputRegionForThread,
     itk::ThreadIdType threadId)
 {
-  // Get the number of components
-  int ncomp = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
+  // Use a worker with a fixed number of components for the common cases
+  MultiComponentDispatch::ThreadedGenerateData(
+      this, this->GetFixedImage()->GetNumberOfComponentsPerPixel(), outputRegionForThread, threadId);
+}
 
-  // Create an iterator specialized for going through metrics
-  typedef MultiComponentMetricWorker<TMetricTraits, MetricImageType> InterpType;
-  InterpType iter(this, this->GetMetricOutput(), outputRegionForThread);
+template <class TMetricTraits>
+template <unsigned int VComp>
+void
+MultiComponentMutualInfoImageMetric<TMetricTraits>
+::ThreadedGenerateDataWithComponents(
+    const OutputImageRegionType &outputRegionForThread,
+    itk::ThreadIdType threadId)
+{
+  // Create an iterator specialized for going through metrics. The metric image is never
+  // written by this metric, so the worker only traverses the fixed image
+  typedef MultiComponentMetricWorker<TMetricTraits, InputImageType, VComp> InterpType;
+  InterpType iter(this, this->GetFixedImage(), outputRegionForThread);
+
+  // Get the number of components
+  const int ncomp = iter.GetNumberOfComponents();
 
   // Initially, I am implementing this as a two-pass filter. On the first pass, the joint
   // histogram is computed without the gradient. On the second pass, the gradient is computed.
@@ -367,7 +381,7 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
     GradientPixelType *grad_buffer = this->GetDeformationGradientOutput()->GetBufferPointer();
 
     // Iterate one more time through the voxels
-    InterpType iter_g(this, this->GetMetricOutput(), outputRegionForThread);
+    InterpType iter_g(this, this->GetFixedImage(), outputRegionForThread);
     for(; !iter_g.IsAtEnd(); iter_g.NextLine())
       {
       // Get the output gradient pointer at the beginning of this line
@@ -391,12 +405,15 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
   else if(this->m_ComputeGradient && this->m_ComputeAffine)
     {
     GradientPixelType grad_x;
-    typename Superclass::ThreadData &tds = this->m_ThreadData[threadId];
 
-    int nvox = this->GetInput()->GetBufferedRegion().GetNumberOfPixels();
+    // Accumulate the affine gradient locally before adding it to the thread data
+    const unsigned int n_aff = ImageDimension * (ImageDimension + 1);
+    double acc_gradient[n_aff];
+    for(unsigned int q = 0; q < n_aff; q++)
+      acc_gradient[q] = 0.0;
 
     // Iterate one more time through the voxels
-    InterpType iter_g(this, this->GetMetricOutput(), outputRegionForThread);
+    InterpType iter_g(this, this->GetFixedImage(), outputRegionForThread);
     for(; !iter_g.IsAtEnd(); iter_g.NextLine())
       {
       // Iterate over the pixels in the line
@@ -412,13 +429,17 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
             {
             // double v = grad_x[i] / nvox;
             double v = grad_x[i];
-            tds.gradient[q++] += v;
+            acc_gradient[q++] += v;
             for(int j = 0; j < ImageDimension; j++)
-              tds.gradient[q++] += v * iter_g.GetIndex()[j];
+              acc_gradient[q++] += v * iter_g.GetIndex()[j];
             }
           }
         }
       }
+
+    typename Superclass::ThreadData &tds = this->m_ThreadData[threadId];
+    for(unsigned int q = 0; q < n_aff; q++)
+      tds.gradient[q] += acc_gradient[q];
     }
 }
 
@@ -463,9 +484,6 @@ void
 MutualInformationPreprocessingFilter<TInputImage, TOutputImage>
 ::BeforeThreadedGenerateData()
 {
-  m_ThreadData.clear();
-  m_ThreadData.resize(this->GetNumberOfThreads());
-
   // Code to determine the actual number of threads used below
   itk::ThreadIdType nbOfThreads = this->GetNumberOfThreads();
   if ( itk::MultiThreader::GetGlobalMaximumNumberOfThreads() != 0 )
@@ -478,8 +496,7 @@ MutualInformationPreprocessingFilter<TInputImage, TOutputImage>
   nbOfThreads = this->SplitRequestedRegion(0, nbOfThreads, splitRegion);
 
 
-  m_Barrier = itk::Barrier::New();
-  m_Barrier->Initialize(nbOfThreads);
+  m_QuantileSearch.Initialize(this->GetNumberOfThreads(), nbOfThreads, m_LowerQuantile, m_UpperQuantile);
 
   unsigned int ncomp = this->GetInput()->GetNumberOfComponentsPerPixel();
   m_LowerQuantileValues.resize(ncomp);
@@ -492,15 +509,9 @@ void
 MutualInformationPreprocessingFilter<TInputImage, TOutputImage>
 ::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
 {
-  // Determine the size of the heap
   long total_pixels = this->GetInput()->GetBufferedRegion().GetNumberOfPixels();
-  long heap_size_upper = 1 + (int)((1.0 - m_UpperQuantile) * total_pixels);
-  long heap_size_lower = 1 + (int)(m_LowerQuantile * total_pixels);
   long line_length = outputRegionForThread.GetSize(0);
 
-  // Thread data for this thread
-  ThreadData &td = m_ThreadData[threadId];
-
   typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> IterBase;
   typedef IteratorExtender<IterBase> Iterator;
 
@@ -508,83 +519,28 @@ MutualInformationPreprocessingFilter<TInputImage, TOutputImage>
   int ncomp = this->GetInput()->GetNumberOfComponentsPerPixel();
   for(int k = 0; k < ncomp; k++)
     {
-    // Initialize the two heaps
-    td.heap_lower = LowerHeap();
-    td.heap_upper = UpperHeap();
-    td.number_of_nans = 0l;
-
-    // Build up the heaps
+    // Pass 1: intensity range and number of NaNs
+    m_QuantileSearch.ResetThread(threadId);
     for(Iterator it(this->GetInput(), outputRegionForThread); !it.IsAtEnd(); it.NextLine())
       {
-      // Get a pointer to the start of the line
       const InputComponentType *line = it.GetPixelPointer(this->GetInput()) + k;
-
-      // Iterate over the line
       for(int p = 0; p < line_length; p++, line+=ncomp)
-        {
-        InputComponentType v = *line;
-        if(!std::isnan(v))
-          {
-          heap_lower_push(td.heap_lower, heap_size_lower, v);
-          heap_upper_push(td.heap_upper, heap_size_upper, v);
-          }
-        else
-          {
-          td.number_of_nans++;
-          }
-        }
+        m_QuantileSearch.AddToRange(threadId, *line);
       }
 
-    // Wait for the threads to synchronize
-    m_Barrier->Wait();
+    // Passes 2 and 3 find the quantiles. The values are the same in all threads
+    ComponentScanner scanner(this->GetInput(), outputRegionForThread, k);
+    m_QuantileSearch.FindQuantiles(threadId, total_pixels, scanner);
+    InputComponentType q_lower = (InputComponentType) m_QuantileSearch.GetQuantileValue(0);
+    InputComponentType q_upper = (InputComponentType) m_QuantileSearch.GetQuantileValue(1);
 
-    // The main thread combines all the priority queues
-    // TODO: when computing quantiles, account for presence of NaNs, which affects
-    // the size of the heap
     if(threadId == 0)
       {
-      // Combine the priority queues
-      for(unsigned q = 1; q < this->GetNumberOfThreads(); q++)
-        {
-        ThreadData &tdq = m_ThreadData[q];
-        while(!tdq.heap_lower.empty())
-          {
-          InputComponentType v = tdq.heap_lower.top();
-          heap_lower_push(td.heap_lower, heap_size_lower, v);
-          tdq.heap_lower.pop();
-          }
-
-        while(!tdq.heap_upper.empty())
-          {
-          InputComponentType v = tdq.heap_upper.top();
-          heap_upper_push(td.heap_upper, heap_size_upper, v);
-          tdq.heap_upper.pop();
-          }
-        
-        td.number_of_nans += tdq.number_of_nans;
-        }
-      
-      // Update the heap size based on the number of nans
-      long nonnan_pixels = total_pixels - td.number_of_nans;
-      long heap_size_upper_upd = 1 + (int)((1.0 - m_UpperQuantile) * nonnan_pixels);
-      long heap_size_lower_upd = 1 + (int)(m_LowerQuantile * nonnan_pixels);
-      
-      // Pop until the heap is the right size
-      while(td.heap_upper.size() > heap_size_upper_upd)
-        td.heap_upper.pop();
-
-      while(td.heap_lower.size() > heap_size_lower_upd)
-        td.heap_lower.pop();
-
-      // Get the quantile values
-      m_UpperQuantileValues[k] = td.heap_upper.top();
-      m_LowerQuantileValues[k] = td.heap_lower.top();
-      m_NumberOfNaNs[k] = td.number_of_nans;
+      m_LowerQuantileValues[k] = q_lower;
+      m_UpperQuantileValues[k] = q_upper;
+      m_NumberOfNaNs[k] = total_pixels - m_QuantileSearch.GetNumberOfValues();
       }
 
-    // Wait for all threads to catch up
-    m_Barrier->Wait();
-
     // Continue if no remapping requested
     if(m_NoRemapping)
       continue;
@@ -593,8 +549,8 @@ MutualInformationPreprocessingFilter<TInputImage, TOutputImage>
     unsigned start_bin = m_StartAtBinOne ? 1 : 0;
 
     // Compute the scale and shift
-    double scale = (m_Bins - start_bin) * 1.0 / (m_UpperQuantileValues[k] - m_LowerQuantileValues[k]);
-    double shift = m_LowerQuantileValues[k] * scale - start_bin;
+    double scale = (m_Bins - start_bin) * 1.0 / (q_upper - q_lower);
+    double shift = q_lower * scale - start_bin;
 
     // Now each thread remaps the intensities into the quantile range
     for(Iterator it(this->GetInput(), outputRegionForThread); !it.IsAtEnd(); it.NextLine())
@@ -232,6 +232,13 @@ protected:
   virtual void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
                             itk::ThreadIdType threadId ) ITK_OVERRIDE;
 
+  friend struct MultiComponentDispatch;
+
+  /** Implementation for VComp components (0 means any number) */
+  template <unsigned int VComp>
+  void ThreadedGenerateDataWithComponents(const OutputImageRegionType& outputRegionForThread,
+                                          itk::ThreadIdType threadId);
+
   /** Set up the output information */
   virtual void GenerateOutputInformation() ITK_OVERRIDE;
 
@@ -93,11 +93,26 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
   const OutputImageRegionType& outputRegionForThread,
   itk::ThreadIdType threadId )
 {
-  typedef FastLinearInterpolator<InputImageType, RealType, ImageDimension,
-      typename TMetricTraits::MaskImageType> FastInterpolator;
+  // Use a worker with a fixed number of components for the common cases
+  MultiComponentDispatch::ThreadedGenerateData(
+      this, m_Parent->GetFixedImage()->GetNumberOfComponentsPerPixel(), outputRegionForThread, threadId);
+}
+
+template <class TMetricTraits, class TOutputImage>
+template <unsigned int VComp>
+void
+MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
+::ThreadedGenerateDataWithComponents(
+  const OutputImageRegionType& outputRegionForThread,
+  itk::ThreadIdType threadId )
+{
+  // Create an iterator specialized for going through metrics
+  typedef MultiComponentMetricWorker<TMetricTraits, TOutputImage, VComp> InterpType;
+  typedef typename InterpType::InterpType FastInterpolator;
+  InterpType iter(m_Parent, this->GetOutput(), outputRegionForThread);
 
   // Get the number of input and output components
-  int ncomp_in = m_Parent->GetFixedImage()->GetNumberOfComponentsPerPixel();
+  const int ncomp_in = iter.GetNumberOfComponents();
   int ncomp_out = this->GetNumberOfOutputComponents();
 
   // Number of output components per input component
@@ -109,13 +124,6 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
                                            : 3 * ImageDimension)
                                        : 0);
 
-  // Get the pointer to the output image
-  OutputImageType *out = this->GetOutput();
-
-  // Create an iterator specialized for going through metrics
-  typedef MultiComponentMetricWorker<TMetricTraits, TOutputImage> InterpType;
-  InterpType iter(m_Parent, this->GetOutput(), outputRegionForThread);
-
   // Iterate over the lines
   for(; !iter.IsAtEnd(); iter.NextLine())
     {
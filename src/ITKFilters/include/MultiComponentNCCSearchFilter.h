@@ -0,0 +1,327 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef MULTICOMPONENTNCCSEARCHFILTER_H
+#define MULTICOMPONENTNCCSEARCHFILTER_H
+
+#include "MultiComponentImageMetricBase.h"
+#include "itkOffset.h"
+
+/**
+ * Direct evaluation of the patch-wise NCC between the fixed image at a voxel and the
+ * moving image at an integer offset from that voxel. This is used when only a handful
+ * of offsets are needed per voxel, so that computing box sums over the whole image
+ * would be wasteful. The metric is identical to the one computed by the box sums in
+ * MultiComponentNCCImageMetric. Each thread should use its own instance.
+ */
+template <class TMetricTraits>
+class NCCPatchEvaluator
+{
+public:
+  typedef typename TMetricTraits::InputImageType        InputImageType;
+  typedef typename TMetricTraits::MaskImageType         MaskImageType;
+  typedef typename TMetricTraits::MetricImageType       MetricImageType;
+  typedef typename TMetricTraits::DeformationFieldType  DeformationFieldType;
+  typedef typename InputImageType::InternalPixelType    InputComponentType;
+  typedef typename MetricImageType::PixelType           MetricPixelType;
+  typedef typename DeformationFieldType::PixelType      DeformationVectorType;
+  typedef typename InputImageType::IndexType            IndexType;
+  typedef typename InputImageType::SizeType             SizeType;
+  typedef itk::Offset<InputImageType::ImageDimension>   OffsetType;
+
+  NCCPatchEvaluator(InputImageType *fixed, InputImageType *moving,
+                    MaskImageType *fixed_mask, MaskImageType *moving_mask,
+                    const vnl_vector<float> &weights, const SizeType &radius);
+
+  /** Compute the metric, returns false if there are no valid samples in the patch */
+  bool Evaluate(const IndexType &idx, const OffsetType &offset, MetricPixelType &metric);
+
+protected:
+  InputImageType *m_Fixed, *m_Moving;
+  MaskImageType *m_FixedMask, *m_MovingMask;
+  vnl_vector<float> m_ScaledWeights;
+  std::vector<OffsetType> m_PatchOffsets;
+  std::vector<InputComponentType> m_Work;
+  vnl_vector<MetricPixelType> m_CompMetric;
+};
+
+/**
+ * Exhaustive search for the integer displacement that maximizes the patch-wise
+ * normalized cross-correlation between a fixed and a moving multi-component image.
+ *
+ * For an integer offset the moving image does not need to be interpolated, so each
+ * offset reduces to filling the NCC working image (I, J, I^2, J^2, IJ) by reading the
+ * moving buffer at a fixed shift, running the separable box sums and folding the
+ * resulting NCC into the running maximum. All three passes are threaded. After the
+ * search, the best offset at each voxel can be refined to sub-voxel precision by
+ * fitting a parabola along each axis through the NCC at the best offset and its two
+ * neighbors, which are evaluated directly.
+ *
+ * The fixed and moving images are assumed to share the voxel grid (as in the
+ * deformable metrics, displacements are in voxel units). The primary output is the
+ * best metric value and the "offset" output is the best displacement.
+ */
+template <class TMetricTraits>
+class ITK_EXPORT MultiComponentNCCSearchFilter :
+    public itk::ImageToImageFilter<typename TMetricTraits::InputImageType,
+                                   typename TMetricTraits::MetricImageType>
+{
+public:
+  /** Type definitions from the traits class */
+  typedef typename TMetricTraits::InputImageType        InputImageType;
+  typedef typename TMetricTraits::MaskImageType         MaskImageType;
+  typedef typename TMetricTraits::DeformationFieldType  DeformationFieldType;
+  typedef typename TMetricTraits::MetricImageType       MetricImageType;
+  typedef typename TMetricTraits::RealType              RealType;
+
+  /** Standard class typedefs. */
+  typedef MultiComponentNCCSearchFilter                            Self;
+  typedef itk::ImageToImageFilter<InputImageType,MetricImageType>  Superclass;
+  typedef itk::SmartPointer<Self>                                  Pointer;
+  typedef itk::SmartPointer<const Self>                            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( MultiComponentNCCSearchFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, MetricImageType::ImageDimension );
+
+  /** Typedef to describe the output image region type. */
+  typedef typename InputImageType::RegionType         OutputImageRegionType;
+
+  /** Inherit some types from the superclass. */
+  typedef typename InputImageType::InternalPixelType  InputComponentType;
+  typedef typename MetricImageType::PixelType         MetricPixelType;
+  typedef typename DeformationFieldType::PixelType    DeformationVectorType;
+  typedef typename MetricImageType::SizeType          SizeType;
+  typedef itk::Offset<ImageDimension>                 OffsetType;
+  typedef typename Superclass::DataObjectIdentifierType DataObjectIdentifierType;
+
+  /** Weight vector */
+  typedef vnl_vector<float>                           WeightVectorType;
+
+  /** Set the fixed image */
+  itkNamedInputMacro(FixedImage, InputImageType, "Primary")
+
+  /** Set the moving image */
+  itkNamedInputMacro(MovingImage, InputImageType, "moving")
+
+  /** Set the optional mask input (same semantics as in the NCC metric) */
+  itkNamedInputMacro(FixedMaskImage, MaskImageType, "fixed_mask")
+
+  /** Set the optional moving mask input */
+  itkNamedInputMacro(MovingMaskImage, MaskImageType, "moving_mask")
+
+  /** Get the best metric value at each voxel - this is the main output */
+  itkNamedOutputMacro(MetricOutput, MetricImageType, "Primary")
+
+  /** Get the best displacement (in voxel units) at each voxel */
+  itkNamedOutputMacro(OffsetOutput, DeformationFieldType, "offset")
+
+  /** Set the weight vector - for different components in the input image */
+  itkSetMacro(Weights, WeightVectorType)
+  itkGetConstMacro(Weights, WeightVectorType)
+
+  /** Radius of the cross-correlation patch */
+  itkSetMacro(Radius, SizeType)
+  itkGetMacro(Radius, SizeType)
+
+  /** Radius of the search neighborhood */
+  itkSetMacro(SearchRadius, SizeType)
+  itkGetMacro(SearchRadius, SizeType)
+
+  /** Whether the best offset is refined to sub-voxel precision (on by default) */
+  itkSetMacro(SubvoxelRefinement, bool)
+  itkGetMacro(SubvoxelRefinement, bool)
+  itkBooleanMacro(SubvoxelRefinement)
+
+  /**
+   * Set the working memory image for this filter, as in MultiComponentNCCImageMetric.
+   * This allows the caller to share the allocation with the NCC metric.
+   */
+  itkSetObjectMacro(WorkingImage, InputImageType)
+
+  /** Number of voxels whose best offset changed during the last search */
+  itkGetConstMacro(NumberOfUpdates, unsigned long)
+
+protected:
+  MultiComponentNCCSearchFilter();
+  ~MultiComponentNCCSearchFilter() {}
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  virtual typename itk::DataObject::Pointer MakeOutput(const DataObjectIdentifierType &) ITK_OVERRIDE;
+
+  /** The search is a sequence of threaded passes, driven from here */
+  virtual void GenerateData() ITK_OVERRIDE;
+
+  virtual void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                                    itk::ThreadIdType threadId) ITK_OVERRIDE;
+
+  // The passes performed by ThreadedGenerateData
+  enum Stage { PRECOMPUTE, UPDATE, REFINE };
+
+  // Run one of the passes over the output region on all threads
+  void ExecuteStage(Stage stage);
+
+  // Individual passes
+  void ThreadedPrecompute(const OutputImageRegionType &region);
+  void ThreadedUpdate(const OutputImageRegionType &region, itk::ThreadIdType threadId);
+  void ThreadedRefine(const OutputImageRegionType &region);
+
+  WeightVectorType m_Weights;
+  SizeType m_Radius, m_SearchRadius;
+  bool m_SubvoxelRefinement;
+
+  typename InputImageType::Pointer m_WorkingImage;
+
+  // State shared by the threaded passes
+  Stage m_Stage;
+  OffsetType m_CurrentOffset;
+  std::vector<unsigned long> m_ThreadUpdates;
+  unsigned long m_NumberOfUpdates;
+
+private:
+  MultiComponentNCCSearchFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+};
+
+
+/**
+ * Block matching with the patch NCC metric, meant to be run coarse-to-fine over a
+ * pyramid. The fixed image is divided into non-overlapping blocks of size 2r+1, where
+ * r is the NCC radius, and each block is matched using the patch centered on it.
+ *
+ * The output is an image on the block grid (one pixel per block, centered on the block)
+ * holding the best K candidates for each block, as K tuples (metric, offset), sorted by
+ * decreasing metric. Offsets are stored in voxel units multiplied by the voxel spacing,
+ * i.e., in physical units along the image axes, so that they carry over between levels.
+ * Unused candidates have the metric set to NonpositiveMin.
+ *
+ * Without the "candidates" input, all offsets within the search radius are tested. With
+ * it (the output of this filter at the coarser level), only the neighborhoods of radius
+ * SearchRadius around the candidates of the enclosing coarse block are tested, which is
+ * what makes large displacements affordable.
+ */
+template <class TMetricTraits>
+class ITK_EXPORT MultiComponentNCCBlockMatchFilter :
+    public itk::ImageToImageFilter<typename TMetricTraits::InputImageType,
+                                   typename TMetricTraits::InputImageType>
+{
+public:
+  /** Type definitions from the traits class */
+  typedef typename TMetricTraits::InputImageType        InputImageType;
+  typedef typename TMetricTraits::MaskImageType         MaskImageType;
+  typedef typename TMetricTraits::MetricImageType       MetricImageType;
+
+  /** Standard class typedefs. */
+  typedef MultiComponentNCCBlockMatchFilter                        Self;
+  typedef itk::ImageToImageFilter<InputImageType,InputImageType>   Superclass;
+  typedef itk::SmartPointer<Self>                                  Pointer;
+  typedef itk::SmartPointer<const Self>                            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( MultiComponentNCCBlockMatchFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, InputImageType::ImageDimension );
+
+  typedef typename InputImageType::RegionType         OutputImageRegionType;
+  typedef typename InputImageType::InternalPixelType  InputComponentType;
+  typedef typename MetricImageType::PixelType         MetricPixelType;
+  typedef typename InputImageType::SizeType           SizeType;
+  typedef typename InputImageType::IndexType          IndexType;
+  typedef itk::Offset<ImageDimension>                 OffsetType;
+  typedef vnl_vector<float>                           WeightVectorType;
+
+  /** Set the fixed image */
+  itkNamedInputMacro(FixedImage, InputImageType, "Primary")
+
+  /** Set the moving image */
+  itkNamedInputMacro(MovingImage, InputImageType, "moving")
+
+  /** Set the optional mask input */
+  itkNamedInputMacro(FixedMaskImage, MaskImageType, "fixed_mask")
+
+  /** Set the optional moving mask input */
+  itkNamedInputMacro(MovingMaskImage, MaskImageType, "moving_mask")
+
+  /** Set the candidates from the previous (coarser) level */
+  itkNamedInputMacro(Candidates, InputImageType, "candidates")
+
+  /** Set the weight vector - for different components in the input image */
+  itkSetMacro(Weights, WeightVectorType)
+
+  /** Radius of the cross-correlation patch, also determines the block size */
+  itkSetMacro(Radius, SizeType)
+  itkGetMacro(Radius, SizeType)
+
+  /** Radius of the search (around zero, or around each candidate) */
+  itkSetMacro(SearchRadius, SizeType)
+  itkGetMacro(SearchRadius, SizeType)
+
+  /** Number of candidates kept per block */
+  itkSetMacro(NumberOfCandidates, unsigned int)
+  itkGetMacro(NumberOfCandidates, unsigned int)
+
+protected:
+  MultiComponentNCCBlockMatchFilter();
+  ~MultiComponentNCCBlockMatchFilter() {}
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  /** The output is on the block grid */
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  virtual void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                                    itk::ThreadIdType threadId) ITK_OVERRIDE;
+
+  WeightVectorType m_Weights;
+  SizeType m_Radius, m_SearchRadius;
+  unsigned int m_NumberOfCandidates;
+
+private:
+  MultiComponentNCCBlockMatchFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+};
+
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "MultiComponentNCCSearchFilter.txx"
+#endif
+
+
+#endif // MULTICOMPONENTNCCSEARCHFILTER_H
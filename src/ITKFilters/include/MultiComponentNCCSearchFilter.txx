@@ -0,0 +1,643 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __MultiComponentNCCSearchFilter_txx
+#define __MultiComponentNCCSearchFilter_txx
+
+#include "MultiComponentNCCSearchFilter.h"
+#include "MultiComponentNCCImageMetric.h"
+#include "OneDimensionalInPlaceAccumulateFilter.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "itkNeighborhood.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include <algorithm>
+#include <functional>
+
+template <class TMetricTraits>
+NCCPatchEvaluator<TMetricTraits>
+::NCCPatchEvaluator(InputImageType *fixed, InputImageType *moving,
+                    MaskImageType *fixed_mask, MaskImageType *moving_mask,
+                    const vnl_vector<float> &weights, const SizeType &radius)
+  : m_Fixed(fixed), m_Moving(moving), m_FixedMask(fixed_mask), m_MovingMask(moving_mask)
+{
+  // Same weight scaling as in MultiComponentNCCImageMetric
+  m_ScaledWeights = weights;
+  for(unsigned int i = 0; i < InputImageType::ImageDimension; i++)
+    m_ScaledWeights /= (1 + 2.0 * radius[i]);
+
+  itk::Neighborhood<char, InputImageType::ImageDimension> patch;
+  patch.SetRadius(radius);
+  for(unsigned int p = 0; p < patch.Size(); p++)
+    m_PatchOffsets.push_back(patch.GetOffset(p));
+
+  int nc_img = fixed->GetNumberOfComponentsPerPixel();
+  m_Work.resize(6 * nc_img);
+  m_CompMetric.set_size(nc_img);
+}
+
+template <class TMetricTraits>
+bool
+NCCPatchEvaluator<TMetricTraits>
+::Evaluate(const IndexType &idx, const OffsetType &offset, MetricPixelType &metric)
+{
+  int nc_img = m_Fixed->GetNumberOfComponentsPerPixel();
+  InputComponentType *work = &m_Work[0];
+  for(int q = 0; q < 6 * nc_img; q++)
+    work[q] = 0.0;
+
+  // Accumulate the same sums as the NCC precompute filter, over the patch around idx
+  bool any_valid = false;
+  for(unsigned int p = 0; p < m_PatchOffsets.size(); p++)
+    {
+    IndexType y = idx + m_PatchOffsets[p];
+    if(!m_Fixed->GetBufferedRegion().IsInside(y))
+      continue;
+
+    long off_fix = m_Fixed->ComputeOffset(y);
+    if(m_FixedMask && m_FixedMask->GetBufferPointer()[off_fix] <= 0.0)
+      continue;
+
+    IndexType z = y + offset;
+    if(!m_Moving->GetBufferedRegion().IsInside(z))
+      continue;
+
+    long off_mov = m_Moving->ComputeOffset(z);
+    if(m_MovingMask && m_MovingMask->GetBufferPointer()[off_mov] != 1.0)
+      continue;
+
+    const InputComponentType *p_fix = m_Fixed->GetBufferPointer() + nc_img * off_fix;
+    const InputComponentType *p_mov = m_Moving->GetBufferPointer() + nc_img * off_mov;
+    InputComponentType *out = work;
+    for(int k = 0; k < nc_img; k++, out += 6)
+      {
+      InputComponentType x_fix = p_fix[k], x_mov = p_mov[k];
+      if(std::isnan(x_fix) || std::isnan(x_mov))
+        continue;
+
+      out[0] += 1.0;
+      out[1] += x_fix;
+      out[2] += x_mov;
+      out[3] += x_fix * x_fix;
+      out[4] += x_mov * x_mov;
+      out[5] += x_fix * x_mov;
+      any_valid = true;
+      }
+    }
+
+  if(!any_valid)
+    return false;
+
+  MultiImageNNCPostComputeFunction(work, work + 6 * nc_img, nc_img, m_ScaledWeights.data_block(),
+                                   &metric, m_CompMetric.data_block(),
+                                   (DeformationVectorType *)(NULL), InputImageType::ImageDimension);
+  return true;
+}
+
+template <class TMetricTraits>
+MultiComponentNCCSearchFilter<TMetricTraits>
+::MultiComponentNCCSearchFilter()
+{
+  this->SetPrimaryOutput(this->MakeOutput("Primary"));
+  this->SetOutput("offset", this->MakeOutput("offset"));
+  m_Radius.Fill(1);
+  m_SearchRadius.Fill(1);
+  m_SubvoxelRefinement = true;
+  m_Stage = PRECOMPUTE;
+  m_NumberOfUpdates = 0;
+}
+
+template <class TMetricTraits>
+typename itk::DataObject::Pointer
+MultiComponentNCCSearchFilter<TMetricTraits>
+::MakeOutput(const DataObjectIdentifierType &key)
+{
+  if(key == "Primary")
+    return (MetricImageType::New()).GetPointer();
+  else if(key == "offset")
+    return (DeformationFieldType::New()).GetPointer();
+  else
+    return NULL;
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  // The patches and the search neighborhood extend past the output region, so
+  // just request everything
+  this->GetFixedImage()->SetRequestedRegionToLargestPossibleRegion();
+  this->GetMovingImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetFixedMaskImage())
+    this->GetFixedMaskImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetMovingMaskImage())
+    this->GetMovingMaskImage()->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::ExecuteStage(Stage stage)
+{
+  // This mirrors what ImageSource::GenerateData does, but lets us run several
+  // threaded passes per call to Update()
+  m_Stage = stage;
+  typename Superclass::ThreadStruct str;
+  str.Filter = this;
+  this->GetMultiThreader()->SetNumberOfThreads(this->GetNumberOfThreads());
+  this->GetMultiThreader()->SetSingleMethod(this->ThreaderCallback, &str);
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::GenerateData()
+{
+  this->AllocateOutputs();
+
+  // Start with the worst possible metric and zero displacement
+  this->GetMetricOutput()->FillBuffer(itk::NumericTraits<MetricPixelType>::NonpositiveMin());
+  this->GetOffsetOutput()->FillBuffer(itk::NumericTraits<DeformationVectorType>::ZeroValue());
+
+  // Configure the working image, reusing the caller's memory if possible
+  const InputImageType *fixed = this->GetFixedImage();
+  unsigned int ncomp = fixed->GetNumberOfComponentsPerPixel() * 6;
+  if(m_WorkingImage.IsNull())
+    m_WorkingImage = InputImageType::New();
+
+  if(m_WorkingImage->GetBufferedRegion() != fixed->GetBufferedRegion()
+     || m_WorkingImage->GetNumberOfComponentsPerPixel() < ncomp)
+    {
+    m_WorkingImage->CopyInformation(fixed);
+    m_WorkingImage->SetNumberOfComponentsPerPixel(ncomp);
+    m_WorkingImage->SetRegions(fixed->GetBufferedRegion());
+    m_WorkingImage->Allocate();
+    }
+
+  int n_overalloc_comp = m_WorkingImage->GetNumberOfComponentsPerPixel() - ncomp;
+
+  // Per-thread update counters
+  m_ThreadUpdates.assign(this->GetNumberOfThreads(), 0);
+
+  // Iterate over all the offsets in the search neighborhood
+  itk::Neighborhood<char, ImageDimension> search_nbr;
+  search_nbr.SetRadius(m_SearchRadius);
+  for(unsigned int k = 0; k < search_nbr.Size(); k++)
+    {
+    m_CurrentOffset = search_nbr.GetOffset(k);
+
+    // Fill the working image with I, J, I^2, J^2, IJ for this shift
+    this->ExecuteStage(PRECOMPUTE);
+
+    // Compute the box sums in place
+    AccumulateNeighborhoodSumsInPlace(m_WorkingImage.GetPointer(), m_Radius, 0, n_overalloc_comp);
+
+    // Compute the NCC and keep the maximum
+    this->ExecuteStage(UPDATE);
+    }
+
+  // Refine the offsets
+  if(m_SubvoxelRefinement)
+    this->ExecuteStage(REFINE);
+
+  m_NumberOfUpdates = 0;
+  for(unsigned int i = 0; i < m_ThreadUpdates.size(); i++)
+    m_NumberOfUpdates += m_ThreadUpdates[i];
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
+{
+  switch(m_Stage)
+    {
+    case PRECOMPUTE:
+      this->ThreadedPrecompute(outputRegionForThread);
+      break;
+    case UPDATE:
+      this->ThreadedUpdate(outputRegionForThread, threadId);
+      break;
+    case REFINE:
+      this->ThreadedRefine(outputRegionForThread);
+      break;
+    }
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::ThreadedPrecompute(const OutputImageRegionType &region)
+{
+  const InputImageType *fixed = this->GetFixedImage();
+  const InputImageType *moving = this->GetMovingImage();
+  const MaskImageType *fixed_mask = this->GetFixedMaskImage();
+  const MaskImageType *moving_mask = this->GetMovingMaskImage();
+
+  int nc_img = fixed->GetNumberOfComponentsPerPixel();
+  int nc_work = m_WorkingImage->GetNumberOfComponentsPerPixel();
+  int line_len = region.GetSize()[0];
+  const OutputImageRegionType &mov_region = moving->GetBufferedRegion();
+
+  typedef itk::ImageLinearConstIteratorWithIndex<MetricImageType> IterType;
+  for(IterType it(this->GetMetricOutput(), region); !it.IsAtEnd(); it.NextLine())
+    {
+    typename InputImageType::IndexType idx = it.GetIndex();
+    long offset_in_pixels = fixed->ComputeOffset(idx);
+
+    const InputComponentType *p_fix = fixed->GetBufferPointer() + nc_img * offset_in_pixels;
+    InputComponentType *p_work = m_WorkingImage->GetBufferPointer() + nc_work * offset_in_pixels;
+    const typename MaskImageType::PixelType *p_fix_mask =
+        fixed_mask ? fixed_mask->GetBufferPointer() + offset_in_pixels : NULL;
+
+    // Figure out the range of the line that maps inside of the moving image
+    typename InputImageType::IndexType midx = idx + m_CurrentOffset;
+    bool line_inside = true;
+    for(unsigned int d = 1; d < ImageDimension; d++)
+      if(midx[d] < mov_region.GetIndex()[d]
+         || midx[d] >= mov_region.GetIndex()[d] + (long) mov_region.GetSize()[d])
+        line_inside = false;
+
+    long j0 = std::max(0L, (long) (mov_region.GetIndex()[0] - midx[0]));
+    long j1 = std::min((long) line_len,
+                       (long) (mov_region.GetIndex()[0] + mov_region.GetSize()[0] - midx[0]));
+    if(!line_inside || j1 <= j0)
+      j0 = j1 = line_len;
+
+    const InputComponentType *p_mov = NULL;
+    const typename MaskImageType::PixelType *p_mov_mask = NULL;
+    if(j0 < j1)
+      {
+      midx[0] += j0;
+      long mov_offset = moving->ComputeOffset(midx);
+      p_mov = moving->GetBufferPointer() + nc_img * mov_offset;
+      p_mov_mask = moving_mask ? moving_mask->GetBufferPointer() + mov_offset : NULL;
+      }
+
+    for(long j = 0; j < line_len; j++, p_fix += nc_img, p_work += nc_work)
+      {
+      bool valid = j >= j0 && j < j1 && (!p_fix_mask || p_fix_mask[j] > 0.0);
+      if(valid && p_mov_mask)
+        valid = p_mov_mask[j - j0] == 1.0;
+
+      if(!valid)
+        {
+        for(int q = 0; q < 6 * nc_img; q++)
+          p_work[q] = 0.0;
+        continue;
+        }
+
+      const InputComponentType *p_mov_j = p_mov + nc_img * (j - j0);
+      InputComponentType *out = p_work;
+      for(int k = 0; k < nc_img; k++)
+        {
+        InputComponentType x_fix = p_fix[k];
+        InputComponentType x_mov = p_mov_j[k];
+
+        // NaNs do not contribute to the metric
+        if(std::isnan(x_fix) || std::isnan(x_mov))
+          {
+          for(int q = 0; q < 6; q++)
+            *out++ = 0.0;
+          continue;
+          }
+
+        *out++ = 1.0;
+        *out++ = x_fix;
+        *out++ = x_mov;
+        *out++ = x_fix * x_fix;
+        *out++ = x_mov * x_mov;
+        *out++ = x_fix * x_mov;
+        }
+      }
+    }
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::ThreadedUpdate(const OutputImageRegionType &region, itk::ThreadIdType threadId)
+{
+  int nc_img = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
+  int nc_work = m_WorkingImage->GetNumberOfComponentsPerPixel();
+  int line_len = region.GetSize()[0];
+  const MaskImageType *fixed_mask = this->GetFixedMaskImage();
+
+  // Same weight scaling as in MultiComponentNCCImageMetric
+  WeightVectorType wgt_scaled = m_Weights;
+  for(unsigned int i = 0; i < ImageDimension; i++)
+    wgt_scaled /= (1 + 2.0 * m_Radius[i]);
+
+  vnl_vector<MetricPixelType> comp_metric(nc_img, 0.0);
+  DeformationVectorType vec_offset;
+  for(unsigned int d = 0; d < ImageDimension; d++)
+    vec_offset[d] = m_CurrentOffset[d];
+
+  unsigned long n_updates = 0;
+
+  typedef itk::ImageLinearConstIteratorWithIndex<MetricImageType> IterType;
+  for(IterType it(this->GetMetricOutput(), region); !it.IsAtEnd(); it.NextLine())
+    {
+    long offset_in_pixels = it.GetPosition() - this->GetMetricOutput()->GetBufferPointer();
+    InputComponentType *p_work = m_WorkingImage->GetBufferPointer() + nc_work * offset_in_pixels;
+    MetricPixelType *p_best = this->GetMetricOutput()->GetBufferPointer() + offset_in_pixels;
+    DeformationVectorType *p_off = this->GetOffsetOutput()->GetBufferPointer() + offset_in_pixels;
+    const typename MaskImageType::PixelType *p_mask =
+        fixed_mask ? fixed_mask->GetBufferPointer() + offset_in_pixels : NULL;
+
+    for(int i = 0; i < line_len; i++, p_work += nc_work)
+      {
+      // Voxels outside of the mask are not matched
+      if(p_mask && p_mask[i] <= 0.5)
+        {
+        p_best[i] = 0.0;
+        continue;
+        }
+
+      MetricPixelType metric;
+      MultiImageNNCPostComputeFunction(p_work, p_work + 6 * nc_img, nc_img, wgt_scaled.data_block(),
+                                       &metric, comp_metric.data_block(),
+                                       (DeformationVectorType *)(NULL), ImageDimension);
+      if(metric > p_best[i])
+        {
+        p_best[i] = metric;
+        p_off[i] = vec_offset;
+        ++n_updates;
+        }
+      }
+    }
+
+  m_ThreadUpdates[threadId] += n_updates;
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCSearchFilter<TMetricTraits>
+::ThreadedRefine(const OutputImageRegionType &region)
+{
+  const MaskImageType *fixed_mask = this->GetFixedMaskImage();
+
+  NCCPatchEvaluator<TMetricTraits> evaluator(
+        this->GetFixedImage(), this->GetMovingImage(),
+        this->GetFixedMaskImage(), this->GetMovingMaskImage(), m_Weights, m_Radius);
+
+  typedef itk::ImageLinearConstIteratorWithIndex<MetricImageType> IterType;
+  for(IterType it(this->GetMetricOutput(), region); !it.IsAtEnd(); it.NextLine())
+    {
+    typename InputImageType::IndexType idx = it.GetIndex();
+    long offset_in_pixels = it.GetPosition() - this->GetMetricOutput()->GetBufferPointer();
+    const MetricPixelType *p_best = this->GetMetricOutput()->GetBufferPointer() + offset_in_pixels;
+    DeformationVectorType *p_off = this->GetOffsetOutput()->GetBufferPointer() + offset_in_pixels;
+    const typename MaskImageType::PixelType *p_mask =
+        fixed_mask ? fixed_mask->GetBufferPointer() + offset_in_pixels : NULL;
+
+    for(unsigned int i = 0; i < region.GetSize()[0]; i++, idx[0]++)
+      {
+      if(p_mask && p_mask[i] <= 0.5)
+        continue;
+
+      // The best offset is still integer at this point
+      OffsetType best;
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        best[d] = (long) p_off[i][d];
+
+      // Fit a parabola along each axis through the best offset and its neighbors
+      DeformationVectorType refined = p_off[i];
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        {
+        OffsetType o_minus = best, o_plus = best;
+        o_minus[d]--; o_plus[d]++;
+
+        MetricPixelType m_minus, m_plus;
+        if(!evaluator.Evaluate(idx, o_minus, m_minus) || !evaluator.Evaluate(idx, o_plus, m_plus))
+          continue;
+
+        double denom = m_minus - 2.0 * p_best[i] + m_plus;
+        if(denom < 0.0)
+          {
+          double delta = 0.5 * (m_minus - m_plus) / denom;
+          refined[d] += std::max(-0.5, std::min(0.5, delta));
+          }
+        }
+
+      p_off[i] = refined;
+      }
+    }
+}
+
+
+
+template <class TMetricTraits>
+MultiComponentNCCBlockMatchFilter<TMetricTraits>
+::MultiComponentNCCBlockMatchFilter()
+{
+  m_Radius.Fill(1);
+  m_SearchRadius.Fill(1);
+  m_NumberOfCandidates = 4;
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCBlockMatchFilter<TMetricTraits>
+::GenerateOutputInformation()
+{
+  const InputImageType *fixed = this->GetFixedImage();
+  InputImageType *out = this->GetOutput();
+
+  // One pixel per block, placed at the center voxel of the first block
+  IndexType idx_first;
+  SizeType sz_out;
+  typename InputImageType::SpacingType spc_out = fixed->GetSpacing();
+  for(unsigned int d = 0; d < ImageDimension; d++)
+    {
+    unsigned int block = 2 * m_Radius[d] + 1;
+    sz_out[d] = (fixed->GetLargestPossibleRegion().GetSize()[d] + block - 1) / block;
+    idx_first[d] = fixed->GetLargestPossibleRegion().GetIndex()[d] + m_Radius[d];
+    spc_out[d] *= block;
+    }
+
+  typename InputImageType::PointType org_out;
+  fixed->TransformIndexToPhysicalPoint(idx_first, org_out);
+
+  OutputImageRegionType rgn_out;
+  rgn_out.SetSize(sz_out);
+  out->SetLargestPossibleRegion(rgn_out);
+  out->SetOrigin(org_out);
+  out->SetSpacing(spc_out);
+  out->SetDirection(fixed->GetDirection());
+  out->SetNumberOfComponentsPerPixel(m_NumberOfCandidates * (1 + ImageDimension));
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCBlockMatchFilter<TMetricTraits>
+::GenerateInputRequestedRegion()
+{
+  // The output is on a different grid, so request everything
+  this->GetFixedImage()->SetRequestedRegionToLargestPossibleRegion();
+  this->GetMovingImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetFixedMaskImage())
+    this->GetFixedMaskImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetMovingMaskImage())
+    this->GetMovingMaskImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetCandidates())
+    this->GetCandidates()->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCBlockMatchFilter<TMetricTraits>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
+{
+  InputImageType *fixed = this->GetFixedImage();
+  InputImageType *cand = this->GetCandidates();
+  MaskImageType *fixed_mask = this->GetFixedMaskImage();
+  InputImageType *out = this->GetOutput();
+
+  const OutputImageRegionType &fix_region = fixed->GetBufferedRegion();
+  unsigned int K = m_NumberOfCandidates;
+  unsigned int nc_out = K * (1 + ImageDimension);
+  unsigned int nc_cand = cand ? cand->GetNumberOfComponentsPerPixel() / (1 + ImageDimension) : 0;
+
+  NCCPatchEvaluator<TMetricTraits> evaluator(
+        fixed, this->GetMovingImage(), fixed_mask, this->GetMovingMaskImage(), m_Weights, m_Radius);
+
+  // The search neighborhood around each candidate
+  std::vector<OffsetType> search_offsets;
+  itk::Neighborhood<char, ImageDimension> search_nbr;
+  search_nbr.SetRadius(m_SearchRadius);
+  for(unsigned int q = 0; q < search_nbr.Size(); q++)
+    search_offsets.push_back(search_nbr.GetOffset(q));
+
+  // Candidate offsets are stored scaled by the voxel spacing, so that they can be
+  // carried between pyramid levels
+  const typename InputImageType::SpacingType &spacing = fixed->GetSpacing();
+
+  // Sort order for offsets, used to remove duplicate candidates
+  struct OffsetLess
+  {
+    bool operator() (const OffsetType &a, const OffsetType &b) const
+    {
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        if(a[d] != b[d])
+          return a[d] < b[d];
+      return false;
+    }
+  };
+
+  std::vector<OffsetType> centers, tests;
+  std::vector<std::pair<MetricPixelType, unsigned int> > scores;
+
+  typedef itk::ImageRegionIteratorWithIndex<InputImageType> IterType;
+  for(IterType it(out, outputRegionForThread); !it.IsAtEnd(); ++it)
+    {
+    InputComponentType *p_out = out->GetBufferPointer() + nc_out * out->ComputeOffset(it.GetIndex());
+    for(unsigned int j = 0; j < K; j++)
+      {
+      p_out[j * (1 + ImageDimension)] = itk::NumericTraits<MetricPixelType>::NonpositiveMin();
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        p_out[j * (1 + ImageDimension) + 1 + d] = 0.0;
+      }
+
+    // Center voxel of the block (the last block may be truncated)
+    IndexType ctr;
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      ctr[d] = std::min(fix_region.GetIndex()[d] + (long) (it.GetIndex()[d] * (2 * m_Radius[d] + 1) + m_Radius[d]),
+                        fix_region.GetIndex()[d] + (long) fix_region.GetSize()[d] - 1);
+
+    if(fixed_mask && fixed_mask->GetPixel(ctr) <= 0.5)
+      continue;
+
+    // Collect the centers of the search neighborhoods
+    centers.clear();
+    if(cand)
+      {
+      typename InputImageType::PointType p;
+      IndexType ci;
+      fixed->TransformIndexToPhysicalPoint(ctr, p);
+      cand->TransformPhysicalPointToIndex(p, ci);
+      const OutputImageRegionType &cand_region = cand->GetBufferedRegion();
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        ci[d] = std::max(cand_region.GetIndex()[d],
+                         std::min(ci[d], cand_region.GetIndex()[d] + (long) cand_region.GetSize()[d] - 1));
+
+      const InputComponentType *p_cand =
+          cand->GetBufferPointer() + cand->GetNumberOfComponentsPerPixel() * cand->ComputeOffset(ci);
+      for(unsigned int j = 0; j < nc_cand; j++, p_cand += 1 + ImageDimension)
+        {
+        if(p_cand[0] == itk::NumericTraits<MetricPixelType>::NonpositiveMin())
+          continue;
+
+        OffsetType o;
+        for(unsigned int d = 0; d < ImageDimension; d++)
+          o[d] = (long) std::floor(p_cand[1 + d] / spacing[d] + 0.5);
+        centers.push_back(o);
+        }
+      }
+
+    // Without usable candidates, search around zero
+    if(centers.size() == 0)
+      {
+      OffsetType zero;
+      zero.Fill(0);
+      centers.push_back(zero);
+      }
+
+    // Enumerate the unique offsets to test
+    tests.clear();
+    for(unsigned int c = 0; c < centers.size(); c++)
+      for(unsigned int q = 0; q < search_offsets.size(); q++)
+        tests.push_back(centers[c] + search_offsets[q]);
+    std::sort(tests.begin(), tests.end(), OffsetLess());
+    tests.erase(std::unique(tests.begin(), tests.end()), tests.end());
+
+    // Evaluate the metric for every offset
+    scores.clear();
+    for(unsigned int t = 0; t < tests.size(); t++)
+      {
+      MetricPixelType metric;
+      if(evaluator.Evaluate(ctr, tests[t], metric))
+        scores.push_back(std::make_pair(metric, t));
+      }
+
+    // Keep the top K, highest metric first
+    unsigned int n_keep = std::min((unsigned int) scores.size(), K);
+    std::partial_sort(scores.begin(), scores.begin() + n_keep, scores.end(),
+                      std::greater<std::pair<MetricPixelType, unsigned int> >());
+    for(unsigned int j = 0; j < n_keep; j++)
+      {
+      p_out[j * (1 + ImageDimension)] = scores[j].first;
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        p_out[j * (1 + ImageDimension) + 1 + d] = tests[scores[j].second][d] * spacing[d];
+      }
+    }
+}
+
+
+#endif // __MultiComponentNCCSearchFilter_txx
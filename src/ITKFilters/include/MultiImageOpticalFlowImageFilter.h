@@ -141,6 +141,17 @@ protected:
   void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
                             itk::ThreadIdType threadId ) ITK_OVERRIDE;
 
+  friend struct MultiComponentDispatch;
+
+  // Run the metric with a worker for VComp components (0 means any number)
+  template <unsigned int VComp>
+  void ThreadedGenerateDataWithComponents(const OutputImageRegionType& outputRegionForThread,
+                                          itk::ThreadIdType threadId);
+
+  // Accumulate the metric over the region traversed by the worker
+  template <class TWorker>
+  void ThreadedAccumulate(TWorker &iter, itk::ThreadIdType threadId);
+
 private:
   MultiImageOpticalFlowImageFilter(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
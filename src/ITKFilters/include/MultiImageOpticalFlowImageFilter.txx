@@ -49,15 +49,53 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
   const OutputImageRegionType& outputRegionForThread,
   itk::ThreadIdType threadId )
 {
-  // Get the number of components
-  int ncomp = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
+  // Use a worker with a fixed number of components for the common cases
+  MultiComponentDispatch::ThreadedGenerateData(
+      this, this->GetFixedImage()->GetNumberOfComponentsPerPixel(), outputRegionForThread, threadId);
+}
 
-  // Create an iterator specialized for going through metrics
-  typedef MultiComponentMetricWorker<TMetricTraits, MetricImageType> InterpType;
-  InterpType iter(this, this->GetMetricOutput(), outputRegionForThread);
+template <class TMetricTraits>
+template <unsigned int VComp>
+void
+MultiImageOpticalFlowImageFilter<TMetricTraits>
+::ThreadedGenerateDataWithComponents(
+  const OutputImageRegionType& outputRegionForThread,
+  itk::ThreadIdType threadId )
+{
+  if(this->m_ComputeMetricImage)
+    {
+    typedef MultiComponentMetricWorker<TMetricTraits, MetricImageType, VComp> WorkerType;
+    WorkerType iter(this, this->GetMetricOutput(), outputRegionForThread);
+    this->ThreadedAccumulate(iter, threadId);
+    }
+  else
+    {
+    // Only traverse the fixed image, nothing is written per voxel
+    typedef MultiComponentMetricWorker<TMetricTraits, InputImageType, VComp> WorkerType;
+    WorkerType iter(this, this->GetFixedImage(), outputRegionForThread);
+    this->ThreadedAccumulate(iter, threadId);
+    }
+}
 
-  // Get the per-component metric array
-  typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
+template <class TMetricTraits>
+template <class TWorker>
+void
+MultiImageOpticalFlowImageFilter<TMetricTraits>
+::ThreadedAccumulate(TWorker &iter, itk::ThreadIdType threadId)
+{
+  // Get the number of components (a constant for the fixed-size workers)
+  const int ncomp = iter.GetNumberOfComponents();
+
+  // Number of affine parameters
+  const unsigned int n_aff = ImageDimension * (ImageDimension + 1);
+
+  // The metric, mask and affine gradient are accumulated in local variables and only
+  // added to the per-thread data at the end, so threads do not write to shared memory
+  double acc_metric = 0.0, acc_mask = 0.0;
+  double acc_gradient[n_aff], acc_grad_mask[n_aff];
+  for(unsigned int q = 0; q < n_aff; q++)
+    acc_gradient[q] = acc_grad_mask[q] = 0.0;
+  vnl_vector<double> acc_comp_metric(ncomp, 0.0);
 
   // Iterate over the lines
   for(; !iter.IsAtEnd(); iter.NextLine())
@@ -86,7 +124,7 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
         {
         // Interpolate the moving image at the current position. The worker knows
         // whether to interpolate the gradient or not
-        typedef typename InterpType::InterpType FastInterpolator;
+        typedef typename TWorker::InterpType FastInterpolator;
         typename FastInterpolator::InOut status = iter.Interpolate();
 
         // Outside interpolations are ignored
@@ -104,7 +142,7 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
             metric += del2w;
 
             // Add the value to each component
-            td.comp_metric[k] += del2w;
+            acc_comp_metric[k] += del2w;
 
             // This is currently computing negative half of the gradient
             if(this->m_ComputeGradient)
@@ -140,15 +178,15 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
               grad_metric[i] = grad_metric[i] * mask - 0.5 * iter.GetMaskGradient()[i] * metric;
             metric = metric * mask;
 
-            td.mask += mask;
+            acc_mask += mask;
             }
           else
             {
-            td.mask += 1.0;
+            acc_mask += 1.0;
             }
 
           // Accumulate the metric
-          td.metric += metric;
+          acc_metric += metric;
 
           // Do the gradient computation
           if(this->m_ComputeGradient)
@@ -158,18 +196,18 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
               {
               for(int i = 0, q = 0; i < ImageDimension; i++)
                 {
-                td.gradient[q++] += grad_metric[i];
+                acc_gradient[q++] += grad_metric[i];
                 for(int j = 0; j < ImageDimension; j++)
-                  td.gradient[q++] += grad_metric[i] * iter.GetIndex()[j];
+                  acc_gradient[q++] += grad_metric[i] * iter.GetIndex()[j];
                 }
 
               if(status == FastInterpolator::BORDER)
                 {
                 for(int i = 0, q = 0; i < ImageDimension; i++)
                   {
-                  td.grad_mask[q++] += iter.GetMaskGradient()[i];
+                  acc_grad_mask[q++] += iter.GetMaskGradient()[i];
                   for(int j = 0; j < ImageDimension; j++)
-                    td.grad_mask[q++] += iter.GetMaskGradient()[i] * iter.GetIndex()[j];
+                    acc_grad_mask[q++] += iter.GetMaskGradient()[i] * iter.GetIndex()[j];
                   }
                 }
               }
@@ -178,11 +216,23 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
         } // check fixed mask
 
       // Last thing - update the output voxels
-      *iter.GetOutputLine() = metric;
+      if(iter.GetOutputLine())
+        *iter.GetOutputLine() = metric;
       if(grad_line)
         grad_line[iter.GetLinePos()] = grad_metric;
       }
     }
+
+  // Store the accumulated values in the per-thread data
+  typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
+  td.metric += acc_metric;
+  td.mask += acc_mask;
+  td.comp_metric += acc_comp_metric;
+  for(unsigned int q = 0; q < n_aff; q++)
+    {
+    td.gradient[q] += acc_gradient[q];
+    td.grad_mask[q] += acc_grad_mask[q];
+    }
 }
 
 
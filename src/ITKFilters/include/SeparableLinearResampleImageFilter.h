@@ -0,0 +1,120 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef SEPARABLELINEARRESAMPLEIMAGEFILTER_H
+#define SEPARABLELINEARRESAMPLEIMAGEFILTER_H
+
+#include <itkImageToImageFilter.h>
+#include <vector>
+
+/**
+ * Linear resampling of an image onto a reference grid that has the same
+ * orientation as the input grid, e.g., between levels of a multi-resolution
+ * pyramid. In this case the continuous index in the input image is a separable
+ * function of the output index, so per-axis lookup tables of neighbor offsets
+ * and weights replace the physical space mapping of itk::ResampleImageFilter.
+ * The output is identical to itk::ResampleImageFilter with an identity transform,
+ * linear interpolation and a default pixel value of zero.
+ *
+ * Use CanResample() to check if the grids are compatible.
+ */
+template <class TImage>
+class SeparableLinearResampleImageFilter
+        : public itk::ImageToImageFilter<TImage, TImage>
+{
+public:
+
+  typedef SeparableLinearResampleImageFilter<TImage>               Self;
+  typedef itk::ImageToImageFilter<TImage, TImage>                  Superclass;
+  typedef itk::SmartPointer<Self>                                  Pointer;
+  typedef itk::SmartPointer<const Self>                            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( SeparableLinearResampleImageFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TImage::ImageDimension );
+
+  typedef TImage                                      ImageType;
+  typedef typename ImageType::RegionType              OutputImageRegionType;
+  typedef typename ImageType::PixelType               PixelType;
+  typedef typename ImageType::IndexType               IndexType;
+  typedef typename ImageType::IndexValueType          IndexValueType;
+  typedef typename ImageType::OffsetValueType         OffsetValueType;
+
+  typedef itk::ImageBase<ImageDimension>              ImageBaseType;
+
+  /** Set the reference space (grid onto which the input is resampled) */
+  void SetReferenceSpace(const ImageBaseType *ref) { m_ReferenceSpace = ref; this->Modified(); }
+
+  /** Check whether the input can be resampled to the reference with this filter */
+  static bool CanResample(const ImageBaseType *src, const ImageBaseType *ref);
+
+protected:
+
+  SeparableLinearResampleImageFilter() : m_ReferenceSpace(NULL) {}
+  ~SeparableLinearResampleImageFilter() {}
+
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                            itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  const ImageBaseType *m_ReferenceSpace;
+
+  // For each axis and each output index along that axis: offsets of the two
+  // neighbors in the input buffer, the weight of the upper neighbor, and whether
+  // the sample is inside the input image
+  struct AxisSample
+  {
+    OffsetValueType off_lo, off_hi;
+    double w_hi;
+    bool inside;
+  };
+
+  std::vector<AxisSample> m_AxisTable[ImageDimension];
+
+private:
+
+  SeparableLinearResampleImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "SeparableLinearResampleImageFilter.txx"
+#endif
+
+#endif // SEPARABLELINEARRESAMPLEIMAGEFILTER_H
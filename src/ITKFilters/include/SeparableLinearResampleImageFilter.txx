@@ -0,0 +1,189 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef SEPARABLELINEARRESAMPLEIMAGEFILTER_TXX
+#define SEPARABLELINEARRESAMPLEIMAGEFILTER_TXX
+
+#include "SeparableLinearResampleImageFilter.h"
+#include "itkImageLinearIteratorWithIndex.h"
+#include <algorithm>
+#include <cmath>
+
+template <class TImage>
+bool
+SeparableLinearResampleImageFilter<TImage>
+::CanResample(const ImageBaseType *src, const ImageBaseType *ref)
+{
+  // The grids must have the same orientation, so that each output axis maps to
+  // the same input axis
+  for(unsigned int a = 0; a < ImageDimension; a++)
+    for(unsigned int b = 0; b < ImageDimension; b++)
+      if(std::fabs(src->GetDirection()(a, b) - ref->GetDirection()(a, b)) > 1.0e-6)
+        return false;
+
+  return true;
+}
+
+template <class TImage>
+void
+SeparableLinearResampleImageFilter<TImage>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  // Like the generic resampler, only the size of the reference region is used
+  ImageType *out = this->GetOutput();
+  OutputImageRegionType region;
+  region.SetSize(m_ReferenceSpace->GetBufferedRegion().GetSize());
+  out->SetLargestPossibleRegion(region);
+  out->SetSpacing(m_ReferenceSpace->GetSpacing());
+  out->SetOrigin(m_ReferenceSpace->GetOrigin());
+  out->SetDirection(m_ReferenceSpace->GetDirection());
+}
+
+template <class TImage>
+void
+SeparableLinearResampleImageFilter<TImage>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+  ImageType *input = const_cast<ImageType *>(this->GetInput());
+  input->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TImage>
+void
+SeparableLinearResampleImageFilter<TImage>
+::BeforeThreadedGenerateData()
+{
+  const ImageType *input = this->GetInput();
+  const ImageType *out = this->GetOutput();
+  const OutputImageRegionType &rgn_in = input->GetBufferedRegion();
+  const OutputImageRegionType &rgn_out = out->GetRequestedRegion();
+
+  // Map the first output voxel into the input image. Because the orientations match,
+  // moving one voxel along axis d in the output moves by the ratio of the spacings
+  // along axis d in the input
+  typename ImageType::PointType p0;
+  itk::ContinuousIndex<double, ImageDimension> c0;
+  out->TransformIndexToPhysicalPoint(rgn_out.GetIndex(), p0);
+  input->TransformPhysicalPointToContinuousIndex(p0, c0);
+
+  for(unsigned int d = 0; d < ImageDimension; d++)
+    {
+    double step = out->GetSpacing()[d] / input->GetSpacing()[d];
+    IndexValueType i_first = rgn_in.GetIndex(d);
+    IndexValueType i_last = i_first + rgn_in.GetSize(d) - 1;
+    OffsetValueType stride = input->GetOffsetTable()[d];
+
+    m_AxisTable[d].resize(rgn_out.GetSize(d));
+    for(unsigned int j = 0; j < rgn_out.GetSize(d); j++)
+      {
+      AxisSample &s = m_AxisTable[d][j];
+      double c = c0[d] + j * step;
+
+      // Same inside test as itk::InterpolateImageFunction::IsInsideBuffer
+      s.inside = (c >= i_first - 0.5) && (c < i_last + 0.5);
+
+      // Neighbors are clamped to the buffer, as in itk::LinearInterpolateImageFunction
+      IndexValueType i_lo = (IndexValueType) std::floor(c);
+      s.w_hi = c - i_lo;
+      IndexValueType i_hi = std::min(std::max(i_lo + 1, i_first), i_last);
+      i_lo = std::min(std::max(i_lo, i_first), i_last);
+      s.off_lo = (i_lo - i_first) * stride;
+      s.off_hi = (i_hi - i_first) * stride;
+      }
+    }
+}
+
+template <class TImage>
+void
+SeparableLinearResampleImageFilter<TImage>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  const ImageType *input = this->GetInput();
+  ImageType *out = this->GetOutput();
+  const PixelType *p_in = input->GetBufferPointer();
+  const IndexType &idx_rr = out->GetRequestedRegion().GetIndex();
+
+  PixelType zero = itk::NumericTraits<PixelType>::ZeroValue();
+
+  // The corners of the interpolation cell in the dimensions other than the first
+  const unsigned int n_corners = 1 << (ImageDimension - 1);
+  std::vector<OffsetValueType> corner_off(n_corners);
+  std::vector<double> corner_wgt(n_corners);
+
+  typedef itk::ImageLinearIteratorWithIndex<ImageType> IterType;
+  IterType it(out, outputRegionForThread);
+  it.SetDirection(0);
+  int line_len = outputRegionForThread.GetSize(0);
+
+  for(; !it.IsAtEnd(); it.NextLine())
+    {
+    IndexType idx = it.GetIndex();
+    PixelType *p_out = out->GetBufferPointer() + out->ComputeOffset(idx);
+
+    // Work out the offsets and weights of the corners for this line
+    bool inside = true;
+    for(unsigned int c = 0; c < n_corners; c++)
+      {
+      corner_off[c] = 0;
+      corner_wgt[c] = 1.0;
+      for(unsigned int d = 1; d < ImageDimension; d++)
+        {
+        const AxisSample &s = m_AxisTable[d][idx[d] - idx_rr[d]];
+        inside = inside && s.inside;
+        bool hi = (c >> (d - 1)) & 1;
+        corner_off[c] += hi ? s.off_hi : s.off_lo;
+        corner_wgt[c] *= hi ? s.w_hi : 1.0 - s.w_hi;
+        }
+      }
+
+    // Interpolate along the line
+    const AxisSample *s0 = &m_AxisTable[0][idx[0] - idx_rr[0]];
+    for(int i = 0; i < line_len; i++, p_out++, s0++)
+      {
+      if(!inside || !s0->inside)
+        {
+        *p_out = zero;
+        continue;
+        }
+
+      PixelType val = zero;
+      for(unsigned int c = 0; c < n_corners; c++)
+        {
+        if(corner_wgt[c] == 0.0)
+          continue;
+        const PixelType *p = p_in + corner_off[c];
+        val += (p[s0->off_lo] * (1.0 - s0->w_hi) + p[s0->off_hi] * s0->w_hi) * corner_wgt[c];
+        }
+      *p_out = val;
+      }
+    }
+}
+
+#endif // SEPARABLELINEARRESAMPLEIMAGEFILTER_TXX
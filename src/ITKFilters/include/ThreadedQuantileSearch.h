@@ -0,0 +1,297 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __ThreadedQuantileSearch_h_
+#define __ThreadedQuantileSearch_h_
+
+#include <itkBarrier.h>
+#include <itkNumericTraits.h>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/**
+ * Exact lower and upper quantiles of a set of values that is split between the threads
+ * of a filter, independent of the number of threads. A coarse integer histogram over the
+ * range of the values locates the bin that holds each quantile, and a fine histogram
+ * within that bin, which also records the smallest value in each fine bin, locates the
+ * quantile value itself. This is exact unless a fine bin holds several distinct values.
+ *
+ * All threads call the search from ThreadedGenerateData. Each thread first adds its
+ * values to the range with AddToRange, then calls FindQuantiles with a scanner, which
+ * is an object with a method template <class F> void operator()(F &f) const that calls
+ * f(v) for each of the thread's values (NaNs included, they are skipped). The scanner is
+ * called twice more by FindQuantiles, and the threads synchronize in between.
+ */
+class ThreadedQuantileSearch
+{
+public:
+  enum { CoarseBins = 4096, FineBins = 4096 };
+
+  /**
+   * Prepare the search for a run of the filter: the number of thread data slots, the
+   * number of threads that take part (for the barrier) and the quantiles to find
+   */
+  void Initialize(unsigned int n_slots, unsigned int n_threads, double lower_q, double upper_q)
+  {
+    m_ThreadData.clear();
+    m_ThreadData.resize(n_slots);
+    m_Barrier = itk::Barrier::New();
+    m_Barrier->Initialize(n_threads);
+    m_Quantile[0] = lower_q;
+    m_Quantile[1] = upper_q;
+    m_QuantileValues[0] = m_QuantileValues[1] = 0.0;
+    m_NumberOfValues = 0;
+  }
+
+  /** Clear the range and NaN count of a thread, to search another set of values */
+  void ResetThread(unsigned int thread)
+  {
+    m_ThreadData[thread] = ThreadData();
+  }
+
+  /** Add a value to the range of the values of a thread, or count it if it is NaN */
+  void AddToRange(unsigned int thread, double v)
+  {
+    ThreadData &td = m_ThreadData[thread];
+    if(std::isnan(v))
+      {
+      td.number_of_nans++;
+      }
+    else
+      {
+      td.vmin = std::min(td.vmin, v);
+      td.vmax = std::max(td.vmax, v);
+      }
+  }
+
+  /** Number of NaN values counted by all threads with AddToRange */
+  unsigned long GetNumberOfNaNs() const
+  {
+    unsigned long n_nans = 0;
+    for(unsigned int q = 0; q < m_ThreadData.size(); q++)
+      n_nans += m_ThreadData[q].number_of_nans;
+    return n_nans;
+  }
+
+  /**
+   * Find the quantiles of the values of all threads, total_values being the number of
+   * values including NaNs. Returns once every thread can read the quantile values. If
+   * there are no values other than NaNs, the quantiles are zero
+   */
+  template <class TScanner>
+  void FindQuantiles(unsigned int thread, unsigned long total_values, const TScanner &scanner)
+  {
+    ThreadData &td = m_ThreadData[thread];
+
+    m_Barrier->Wait();
+
+    if(thread == 0)
+      {
+      m_RangeMin = itk::NumericTraits<double>::max();
+      m_RangeMax = -itk::NumericTraits<double>::max();
+      for(unsigned int q = 0; q < m_ThreadData.size(); q++)
+        {
+        m_RangeMin = std::min(m_RangeMin, m_ThreadData[q].vmin);
+        m_RangeMax = std::max(m_RangeMax, m_ThreadData[q].vmax);
+        }
+
+      // Zero-based ranks of the lower and upper quantiles among the non-NaN values
+      m_NumberOfValues = total_values - GetNumberOfNaNs();
+      if(m_NumberOfValues > 0)
+        {
+        unsigned long n = m_NumberOfValues;
+        m_TargetRank[0] = std::min(n - 1, (unsigned long) (m_Quantile[0] * n));
+        unsigned long from_top = std::min(n - 1, (unsigned long) ((1.0 - m_Quantile[1]) * n));
+        m_TargetRank[1] = n - 1 - from_top;
+        }
+      m_QuantileValues[0] = m_QuantileValues[1] = (m_NumberOfValues > 0) ? m_RangeMin : 0.0;
+      }
+
+    m_Barrier->Wait();
+
+    // Nothing to search if the values are all the same
+    if(m_NumberOfValues == 0 || !(m_RangeMax > m_RangeMin))
+      return;
+
+    // Pass 2: coarse histogram over the range
+    td.hist.assign(CoarseBins, 0ul);
+    CoarseCounter coarse(this, td);
+    scanner(coarse);
+
+    m_Barrier->Wait();
+
+    if(thread == 0)
+      {
+      std::vector<unsigned long> hist(CoarseBins, 0ul);
+      for(unsigned int q = 0; q < m_ThreadData.size(); q++)
+        for(unsigned int j = 0; j < m_ThreadData[q].hist.size(); j++)
+          hist[j] += m_ThreadData[q].hist[j];
+
+      for(unsigned int t = 0; t < 2; t++)
+        m_TargetBin[t] = FindRankInHistogram(hist, m_TargetRank[t], m_TargetRank[t]);
+      }
+
+    m_Barrier->Wait();
+
+    // Pass 3: fine histograms within the bins that hold the quantiles
+    for(unsigned int t = 0; t < 2; t++)
+      {
+      td.fine_hist[t].assign(FineBins, 0ul);
+      td.fine_min[t].assign(FineBins, itk::NumericTraits<double>::max());
+      }
+    FineCounter fine(this, td);
+    scanner(fine);
+
+    m_Barrier->Wait();
+
+    if(thread == 0)
+      {
+      for(unsigned int t = 0; t < 2; t++)
+        {
+        std::vector<unsigned long> hist(FineBins, 0ul);
+        std::vector<double> hmin(FineBins, itk::NumericTraits<double>::max());
+        for(unsigned int q = 0; q < m_ThreadData.size(); q++)
+          {
+          for(unsigned int j = 0; j < m_ThreadData[q].fine_hist[t].size(); j++)
+            {
+            hist[j] += m_ThreadData[q].fine_hist[t][j];
+            hmin[j] = std::min(hmin[j], m_ThreadData[q].fine_min[t][j]);
+            }
+          }
+
+        unsigned long rank_in_bin;
+        int fbin = FindRankInHistogram(hist, m_TargetRank[t], rank_in_bin);
+        m_QuantileValues[t] = hmin[fbin];
+        }
+      }
+
+    m_Barrier->Wait();
+  }
+
+  /** The lower (0) or upper (1) quantile value, after FindQuantiles */
+  double GetQuantileValue(unsigned int which) const { return m_QuantileValues[which]; }
+
+  /** Number of non-NaN values, after FindQuantiles */
+  unsigned long GetNumberOfValues() const { return m_NumberOfValues; }
+
+  /** Find the bin of a histogram that holds the value of given rank, and the rank within it */
+  static int FindRankInHistogram(const std::vector<unsigned long> &hist,
+                                 unsigned long rank, unsigned long &rank_in_bin)
+  {
+    unsigned long cum = 0;
+    for(unsigned int j = 0; j < hist.size(); j++)
+      {
+      if(rank < cum + hist[j])
+        {
+        rank_in_bin = rank - cum;
+        return j;
+        }
+      cum += hist[j];
+      }
+
+    // Not reached for valid ranks
+    rank_in_bin = 0;
+    return hist.size() - 1;
+  }
+
+protected:
+
+  // Per thread data. Threads that are not used by the filter leave these values unchanged
+  struct ThreadData
+  {
+    double vmin, vmax;
+    unsigned long number_of_nans;
+    std::vector<unsigned long> hist;
+    std::vector<unsigned long> fine_hist[2];
+    std::vector<double> fine_min[2];
+
+    ThreadData() : vmin(itk::NumericTraits<double>::max()),
+      vmax(-itk::NumericTraits<double>::max()), number_of_nans(0) {}
+  };
+
+  int CoarseBin(double v) const
+  {
+    int bin = (int) ((v - m_RangeMin) * CoarseBins / (m_RangeMax - m_RangeMin));
+    return bin < 0 ? 0 : (bin >= CoarseBins ? CoarseBins - 1 : bin);
+  }
+
+  int FineBin(double v, int coarse_bin) const
+  {
+    double w = (m_RangeMax - m_RangeMin) / CoarseBins;
+    int bin = (int) ((v - m_RangeMin - coarse_bin * w) * FineBins / w);
+    return bin < 0 ? 0 : (bin >= FineBins ? FineBins - 1 : bin);
+  }
+
+  // Functors passed to the scanner in the second and third pass
+  struct CoarseCounter
+  {
+    const ThreadedQuantileSearch *search;
+    ThreadData &td;
+    CoarseCounter(const ThreadedQuantileSearch *s, ThreadData &t) : search(s), td(t) {}
+    void operator()(double v)
+    {
+      if(!std::isnan(v))
+        td.hist[search->CoarseBin(v)]++;
+    }
+  };
+
+  struct FineCounter
+  {
+    const ThreadedQuantileSearch *search;
+    ThreadData &td;
+    FineCounter(const ThreadedQuantileSearch *s, ThreadData &t) : search(s), td(t) {}
+    void operator()(double v)
+    {
+      if(std::isnan(v))
+        return;
+
+      int bin = search->CoarseBin(v);
+      for(unsigned int t = 0; t < 2; t++)
+        {
+        if(bin == search->m_TargetBin[t])
+          {
+          int fbin = search->FineBin(v, bin);
+          td.fine_hist[t][fbin]++;
+          td.fine_min[t][fbin] = std::min(td.fine_min[t][fbin], v);
+          }
+        }
+    }
+  };
+
+  std::vector<ThreadData> m_ThreadData;
+  itk::Barrier::Pointer m_Barrier;
+
+  // Shared state: the quantiles, the range of the values, and for the lower and upper
+  // quantile, the coarse bin and the rank within it
+  double m_Quantile[2], m_QuantileValues[2];
+  double m_RangeMin, m_RangeMax;
+  unsigned long m_NumberOfValues;
+  int m_TargetBin[2];
+  unsigned long m_TargetRank[2];
+};
+
+#endif // __ThreadedQuantileSearch_h_
@@ -31,11 +31,14 @@
 #include "itkNumericTraits.h"
 #include "itkContinuousIndex.h"
 #include "vnl/vnl_math.h"
+#include <algorithm>
 #include "lddmm_data.h"
 #include "MultiImageOpticalFlowImageFilter.h"
 #include "MultiComponentNCCImageMetric.h"
+#include "MultiComponentNCCSearchFilter.h"
 #include "MultiComponentApproximateNCCImageMetric.h"
 #include "MultiComponentMutualInfoImageMetric.h"
+#include "ComponentExtractionFilter.h"
 #include "MahalanobisDistanceToTargetWarpMetric.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
 #include "OneDimensionalInPlaceAccumulateFilter.h"
@@ -61,6 +64,59 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   m_PyramidFactors = factors;
 }
 
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputePyramidAxisFactors()
+{
+  m_PyramidAxisFactors.resize(m_PyramidFactors.size());
+
+  // The Mahalanobis metric scales the fixed image by a single factor per level, so
+  // anisotropic factors are not used with it
+  bool aniso = m_AnisotropicPyramid && !m_ScaleFixedImageWithVoxelSize && m_Fixed.size();
+
+  // Each axis is downsampled until its spacing approaches that of the finest axis
+  // downsampled by the nominal factor of the level
+  Vec spc_ratio;
+  spc_ratio.Fill(1.0);
+  if(aniso)
+    {
+    typename ImageBaseType::SpacingType spacing = m_Fixed[0]->GetSpacing();
+    double spc_min = spacing[0];
+    for(unsigned int d = 1; d < VDim; d++)
+      spc_min = std::min(spc_min, spacing[d]);
+    for(unsigned int d = 0; d < VDim; d++)
+      spc_ratio[d] = spc_min / spacing[d];
+    }
+
+  for(unsigned int i = 0; i < m_PyramidFactors.size(); i++)
+    for(unsigned int d = 0; d < VDim; d++)
+      m_PyramidAxisFactors[i][d] = std::max(1.0, floor(m_PyramidFactors[i] * spc_ratio[d] + 1e-6));
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::ImageBaseType::Pointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetPyramidLevelSpace(int level)
+{
+  typedef LDDMMData<TFloat, VDim> LDDMMType;
+  if(m_Fixed.size() == 0)
+    throw GreedyException("Pyramid level space requested before images were added");
+
+  this->ComputePyramidAxisFactors();
+  return LDDMMType::img_downsample_space(m_Fixed[0], m_PyramidAxisFactors[level]);
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::SetMovingPyramid(unsigned int j, const std::vector<MultiComponentImagePointer> &levels)
+{
+  if(m_MovingPyramids.size() <= j)
+    m_MovingPyramids.resize(j + 1);
+  m_MovingPyramids[j] = levels;
+}
+
 template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -147,6 +203,15 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 {
   typedef LDDMMData<TFloat, VDim> LDDMMType;
 
+  // Reuse the dilated masks if they have already been computed for these fixed images
+  std::vector<FloatImagePointer> &cached = m_FixedStatistics->ncc_gradient_masks;
+  if(cached.size() == m_PyramidFactors.size() && m_FixedStatistics->ncc_radius == radius)
+    {
+    for(int level = 0; level < m_PyramidFactors.size(); level++)
+      m_GradientMaskComposite[level] = cached[level];
+    return;
+    }
+
   for(int level = 0; level < m_PyramidFactors.size(); level++)
     {
     if(m_GradientMaskComposite[level])
@@ -167,8 +232,64 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
       // Add the two images - the result has 1 for the initial mask, 0.5 for the 'outer' mask
       LDDMMType::img_add_in_place(m_GradientMaskComposite[level], mask_accum);
+
+      // At full resolution this is the gradient mask passed in, which is identified by its
+      // modification time in the statistics cache
+      m_GradientMaskComposite[level]->Modified();
       }
     }
+
+  cached = m_GradientMaskComposite;
+  m_FixedStatistics->ncc_radius = radius;
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::FloatImagePointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ExtractComponent(MultiComponentImageType *src, unsigned int k, bool share_buffer)
+{
+  // The pixel containers of single-component vector images and scalar images are the same type
+  if(share_buffer && src->GetNumberOfComponentsPerPixel() == 1)
+    {
+    FloatImagePointer img = FloatImageType::New();
+    img->CopyInformation(src);
+    img->SetRegions(src->GetBufferedRegion());
+    img->SetPixelContainer(src->GetPixelContainer());
+    return img;
+    }
+
+  typedef itk::VectorIndexSelectionCastImageFilter<MultiComponentImageType, FloatImageType> ExtractType;
+  typename ExtractType::Pointer fltExtract = ExtractType::New();
+  fltExtract->SetInput(src);
+  fltExtract->SetIndex(k);
+  fltExtract->Update();
+  return fltExtract->GetOutput();
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::FloatImagePointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ExtractComponent(MultiComponentImageType *src, unsigned int k, bool share_buffer,
+                   FloatImageType *nan_mask, unsigned long &n_nans, double *quantile_range)
+{
+  typedef ComponentExtractionFilter<MultiComponentImageType, FloatImageType> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+  filter->SetInput(src);
+  filter->SetComponent(k);
+  if(nan_mask)
+    filter->SetNaNMaskImage(nan_mask);
+  filter->SetComputeQuantiles(quantile_range != NULL);
+
+  // A shared single-component image is only scanned
+  bool share = share_buffer && !nan_mask && src->GetNumberOfComponentsPerPixel() == 1;
+  filter->SetScanOnly(share);
+  filter->Update();
+
+  n_nans = filter->GetNumberOfNaNs();
+  if(quantile_range)
+    *quantile_range = filter->GetUpperQuantileValue() - filter->GetLowerQuantileValue();
+
+  return share ? ExtractComponent(src, k, true) : FloatImagePointer(filter->GetOutput());
 }
 
 template <class TFloat, unsigned int VDim>
@@ -181,13 +302,27 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   // Offsets into the composite images
   int off_fixed = 0, off_moving = 0;
 
+  // In memory-lean mode, a single single-component pair can share its buffers with the
+  // full resolution level, as long as nothing modifies the intensities in place
+  bool single_pair = m_Fixed.size() == 1 && m_Fixed[0]->GetNumberOfComponentsPerPixel() == 1;
+  bool share_fixed = m_MemoryLean && single_pair && noise_sigma_relative <= 0.0 && !m_FixedMaskImage;
+  bool share_moving = m_MemoryLean && single_pair && noise_sigma_relative <= 0.0;
+
+  // Determine the downsampling factors of each axis
+  this->ComputePyramidAxisFactors();
+  m_MemoryLeanMB[0] = m_MemoryLeanMB[1] = m_MemoryLeanMB[2] = 0.0;
+
   // Set up the composite images
   m_FixedComposite.resize(m_PyramidFactors.size());
   m_MovingComposite.resize(m_PyramidFactors.size());
 
-  // The fixed mask is binarized
+  // The fixed mask is binarized. Writing through GraftOutput does not change the modification
+  // time, which identifies the mask in the statistics cache, so it is marked modified
   if(m_FixedMaskImage)
+    {
     LDDMMType::img_threshold_in_place(m_FixedMaskImage, 0.5, 1e100, 0.0, 1.0);
+    m_FixedMaskImage->Modified();
+    }
 
   // Repeat for each of the input images
   for(int j = 0; j < m_Fixed.size(); j++)
@@ -195,85 +330,64 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     // Repeat for each component
     for(unsigned k = 0; k < m_Fixed[j]->GetNumberOfComponentsPerPixel(); k++)
       {
-      // Extract the k-th image component from fixed and moving images
-      typedef itk::VectorIndexSelectionCastImageFilter<MultiComponentImageType, FloatImageType> ExtractType;
-      typename ExtractType::Pointer fltExtractFixed, fltExtractMoving;
-
-      fltExtractFixed = ExtractType::New();
-      fltExtractFixed->SetInput(m_Fixed[j]);
-      fltExtractFixed->SetIndex(k);
-      fltExtractFixed->Update();
-
-      fltExtractMoving = ExtractType::New();
-      fltExtractMoving->SetInput(m_Moving[j]);
-      fltExtractMoving->SetIndex(k);
-      fltExtractMoving->Update();
-
       // Deal with additive noise
       double noise_sigma_fixed = 0.0, noise_sigma_moving = 0.0;
-
-      // Do the fixed and moving images have NaNs?
-      bool nans_fixed, nans_moving;
-
-      // If the fixed mask is present, we use it to set nans in the fixed image
-      if(m_FixedMaskImage)
-        {
-        LDDMMType::img_reconstitute_nans_in_place(fltExtractFixed->GetOutput(), m_FixedMaskImage);
-        LDDMMType::img_write(fltExtractFixed->GetOutput(), "/tmp/testnan.mha");
-        }
+      double range_fixed, range_moving;
+      double *p_range_fixed = noise_sigma_relative > 0.0 ? &range_fixed : NULL;
+      double *p_range_moving = noise_sigma_relative > 0.0 ? &range_moving : NULL;
+
+      // Extract the k-th image component from fixed and moving images. The same pass
+      // applies the fixed mask as NaNs, counts the NaNs and computes the quantiles
+      unsigned long nans_fixed, nans_moving;
+      FloatImagePointer imgFixed = ExtractComponent(
+            m_Fixed[j], k, share_fixed, m_FixedMaskImage, nans_fixed, p_range_fixed);
+      FloatImagePointer imgMoving = ExtractComponent(
+            m_Moving[j], k, share_moving, NULL, nans_moving, p_range_moving);
 
       if(noise_sigma_relative > 0.0)
         {
-        // Figure out the quartiles of the fixed image
-        typedef MutualInformationPreprocessingFilter<FloatImageType, FloatImageType> QuantileFilter;
-        typename QuantileFilter::Pointer fltQuantileFixed = QuantileFilter::New();
-        fltQuantileFixed->SetLowerQuantile(0.01);
-        fltQuantileFixed->SetUpperQuantile(0.99);
-        fltQuantileFixed->SetInput(fltExtractFixed->GetOutput());
-        fltQuantileFixed->Update();
-        double range_fixed = fltQuantileFixed->GetUpperQuantileValue(0) - fltQuantileFixed->GetLowerQuantileValue(0);
         noise_sigma_fixed = noise_sigma_relative * range_fixed;
-
-        // Figure out the quartiles of the moving image
-        typename QuantileFilter::Pointer fltQuantileMoving = QuantileFilter::New();
-        fltQuantileMoving->SetLowerQuantile(0.01);
-        fltQuantileMoving->SetUpperQuantile(0.99);
-        fltQuantileMoving->SetInput(fltExtractMoving->GetOutput());
-        fltQuantileMoving->Update();
-        double range_moving = fltQuantileMoving->GetUpperQuantileValue(0) - fltQuantileMoving->GetLowerQuantileValue(0);
         noise_sigma_moving = noise_sigma_relative * range_moving;
 
         // Report noise levels
         printf("Noise on image %d component %d: fixed = %g, moving = %g\n", j, k, noise_sigma_fixed, noise_sigma_moving);
+        }
 
-        // Record the number of NaNs
-        nans_fixed = fltQuantileFixed->GetNumberOfNaNs(0);
-        nans_moving = fltQuantileMoving->GetNumberOfNaNs(0);
+      // Report number of NaNs in fixed and moving images
+      if(j==0 && k==0)
+        {
+        printf("Number of NaNs: fixed: %lu, moving %lu\n", nans_fixed, nans_moving);
         }
-      else
+
+      // Images with NaNs are modified below, so they can not share the input buffer
+      if(nans_fixed && share_fixed)
         {
-        nans_fixed = std::isnan(LDDMMType::img_voxel_sum(fltExtractFixed->GetOutput()));
-        nans_moving = std::isnan(LDDMMType::img_voxel_sum(fltExtractMoving->GetOutput()));
+        FloatImagePointer copy = LDDMMType::new_img(imgFixed);
+        LDDMMType::img_copy(imgFixed, copy);
+        imgFixed = copy;
+        share_fixed = false;
         }
 
-      // Report number of NaNs in fixed and moving images
-      if(j==0 && k==0)
+      if(nans_moving && share_moving)
         {
-        printf("Number of NaNs: fixed: %d, moving %d\n", nans_fixed, nans_moving);
+        FloatImagePointer copy = LDDMMType::new_img(imgMoving);
+        LDDMMType::img_copy(imgMoving, copy);
+        imgMoving = copy;
+        share_moving = false;
         }
-      
+
       // Split the extracted images into a NaN mask and a non-NaN component
       FloatImagePointer nanMaskFixed, nanMaskMoving;
       if(nans_fixed)
         {
-        nanMaskFixed = LDDMMType::new_img(fltExtractFixed->GetOutput());
-        LDDMMType::img_filter_nans_in_place(fltExtractFixed->GetOutput(), nanMaskFixed);
+        nanMaskFixed = LDDMMType::new_img(imgFixed);
+        LDDMMType::img_filter_nans_in_place(imgFixed, nanMaskFixed);
         }
       
       if(nans_moving)
         {
-        nanMaskMoving = LDDMMType::new_img(fltExtractMoving->GetOutput());
-        LDDMMType::img_filter_nans_in_place(fltExtractMoving->GetOutput(), nanMaskMoving);
+        nanMaskMoving = LDDMMType::new_img(imgMoving);
+        LDDMMType::img_filter_nans_in_place(imgMoving, nanMaskMoving);
         }
 
       // Compute the pyramid for this component
@@ -283,27 +397,34 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
         typename FloatImageType::Pointer lFixed, lMoving;
         if (m_PyramidFactors[i] == 1)
           {
-          lFixed = fltExtractFixed->GetOutput();
+          lFixed = imgFixed;
           if(nans_fixed)
             LDDMMType::img_reconstitute_nans_in_place(lFixed, nanMaskFixed);
 
-          lMoving = fltExtractMoving->GetOutput();
+          lMoving = imgMoving;
           if(nans_moving)
             LDDMMType::img_reconstitute_nans_in_place(lMoving, nanMaskMoving);
           }
         else
           {
-          // Downsample the images
+          // Downsample the images, unless the moving level was supplied by the caller
           lFixed = FloatImageType::New();
-          lMoving = FloatImageType::New();
-          LDDMMType::img_downsample(fltExtractFixed->GetOutput(), lFixed, m_PyramidFactors[i]);
-          LDDMMType::img_downsample(fltExtractMoving->GetOutput(), lMoving, m_PyramidFactors[i]);
+          LDDMMType::img_downsample(imgFixed, lFixed, m_PyramidAxisFactors[i]);
+          if(j < m_MovingPyramids.size() && m_MovingPyramids[j].size() > i && m_MovingPyramids[j][i])
+            {
+            lMoving = ExtractComponent(m_MovingPyramids[j][i], k, false);
+            }
+          else
+            {
+            lMoving = FloatImageType::New();
+            LDDMMType::img_downsample(imgMoving, lMoving, m_PyramidAxisFactors[i]);
+            }
 
           // Downsample the nan-masks
           if(nans_fixed)
             {
             FloatImagePointer mask_ds = FloatImageType::New();
-            LDDMMType::img_downsample(nanMaskFixed, mask_ds, m_PyramidFactors[i]);
+            LDDMMType::img_downsample(nanMaskFixed, mask_ds, m_PyramidAxisFactors[i]);
             LDDMMType::img_threshold_in_place(mask_ds, 0.5, 100.0, 1, 0);
             LDDMMType::img_reconstitute_nans_in_place(lFixed, mask_ds);
             }
@@ -311,7 +432,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
           if(nans_moving)
             {
             FloatImagePointer mask_ds = FloatImageType::New();
-            LDDMMType::img_downsample(nanMaskMoving, mask_ds, m_PyramidFactors[i]);
+            LDDMMType::img_downsample(nanMaskMoving, mask_ds, m_PyramidAxisFactors[i]);
             LDDMMType::img_threshold_in_place(mask_ds, 0.5, 100.0, 1, 0);
             LDDMMType::img_reconstitute_nans_in_place(lMoving, mask_ds);
             }
@@ -336,15 +457,25 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
         //typename VectorImageType::Pointer gradMoving = LDDMMType::new_vimg(lMoving);
         //LDDMMType::image_gradient(lMoving, gradMoving);
 
+        // At full resolution, shared inputs are used as the composite images directly
+        bool full_res = m_PyramidFactors[i] == 1;
+        if(full_res && share_fixed)
+          m_FixedComposite[i] = m_Fixed[j];
+        if(full_res && share_moving)
+          m_MovingComposite[i] = m_Moving[j];
+
         // Allocate the composite images if they have not been allocated
-        if(j == 0 && k == 0)
+        if(j == 0 && k == 0 && !(full_res && share_fixed))
           {
           m_FixedComposite[i] = MultiComponentImageType::New();
           m_FixedComposite[i]->CopyInformation(lFixed);
           m_FixedComposite[i]->SetNumberOfComponentsPerPixel(m_Weights.size());
           m_FixedComposite[i]->SetRegions(lFixed->GetBufferedRegion());
           m_FixedComposite[i]->Allocate();
+          }
 
+        if(j == 0 && k == 0 && !(full_res && share_moving))
+          {
           m_MovingComposite[i] = MultiComponentImageType::New();
           m_MovingComposite[i]->CopyInformation(lMoving);
           m_MovingComposite[i]->SetNumberOfComponentsPerPixel(m_Weights.size());
@@ -353,16 +484,54 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
           }
 
         // Pack the data into the fixed and moving composite images
-        this->PlaceIntoComposite(lFixed, m_FixedComposite[i], off_fixed);
-        this->PlaceIntoComposite(lMoving, m_MovingComposite[i], off_moving);
+        if(!(full_res && share_fixed))
+          this->PlaceIntoComposite(lFixed, m_FixedComposite[i], off_fixed);
+        if(!(full_res && share_moving))
+          this->PlaceIntoComposite(lMoving, m_MovingComposite[i], off_moving);
         }
 
       // Update the offsets
       off_fixed++;
       off_moving++;
       }
+
+    // In memory-lean mode, release the input pair as soon as it has been packed, so that
+    // it is not held while the remaining pairs and the mask pyramids are built
+    if(m_MemoryLean)
+      {
+      for(int pass = 0; pass < 2; pass++)
+        {
+        typename MultiComponentImageType::Pointer &input = (pass == 0) ? m_Fixed[j] : m_Moving[j];
+        MultiCompImageSet &composite = (pass == 0) ? m_FixedComposite : m_MovingComposite;
+        double mb = input->GetPixelContainer()->Size() * sizeof(TFloat) / (1024.0 * 1024.0);
+        if(std::find(composite.begin(), composite.end(), input) != composite.end())
+          m_MemoryLeanMB[1] += mb;
+        else if(input->GetReferenceCount() == 1)
+          m_MemoryLeanMB[0] += mb;
+        else
+          m_MemoryLeanMB[2] += mb;
+        input = NULL;
+        }
+      if(j < m_MovingPyramids.size())
+        m_MovingPyramids[j].clear();
+      }
     }
 
+  // The supplied moving levels have been packed into the composites
+  m_MovingPyramids.clear();
+  if(m_MemoryLean)
+    {
+    m_Fixed.clear();
+    m_Moving.clear();
+    }
+
+  // Precompute the moving gradients at the selected levels
+  m_MovingGradientComposite.clear();
+  m_MovingGradientComposite.resize(m_PyramidFactors.size());
+  for(int i = 0; i < m_PyramidFactors.size(); i++)
+    if(i < m_PrecomputedMovingGradientLevels.size() && m_PrecomputedMovingGradientLevels[i])
+      this->BuildMovingGradientComposite(i);
+
   // Set up the mask pyramid
   m_GradientMaskComposite.resize(m_PyramidFactors.size(), NULL);
   if(m_GradientMaskImage)
@@ -379,7 +548,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
         m_GradientMaskComposite[i] = FloatImageType::New();
 
         // Downsampling the mask involves smoothing, so the mask will no longer be binary
-        LDDMMType::img_downsample(m_GradientMaskImage, m_GradientMaskComposite[i], m_PyramidFactors[i]);
+        LDDMMType::img_downsample(m_GradientMaskImage, m_GradientMaskComposite[i], m_PyramidAxisFactors[i]);
         LDDMMType::img_threshold_in_place(m_GradientMaskComposite[i], 0.5, 1e100, 1.0, 0.0);
         }      
       }
@@ -431,7 +600,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
         m_MovingMaskComposite[i] = FloatImageType::New();
 
         // Downsampling the mask involves smoothing, so the mask will no longer be binary
-        LDDMMType::img_downsample(m_MovingMaskImage, m_MovingMaskComposite[i], m_PyramidFactors[i]);
+        LDDMMType::img_downsample(m_MovingMaskImage, m_MovingMaskComposite[i], m_PyramidAxisFactors[i]);
 
         // We might not need the moving mask to be binary, we can leave it be floating point
         // but for now we binarize it
@@ -468,6 +637,35 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     }
 }
 
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::BuildMovingGradientComposite(int level)
+{
+  typedef LDDMMData<TFloat, VDim> LDDMMType;
+
+  // Each pixel holds the nc values followed by the VDim gradient components of each value
+  MultiComponentImageType *moving = m_MovingComposite[level];
+  int nc = moving->GetNumberOfComponentsPerPixel();
+  MultiComponentImagePointer target = MultiComponentImageType::New();
+  target->CopyInformation(moving);
+  target->SetNumberOfComponentsPerPixel(nc * (1 + VDim));
+  target->SetRegions(moving->GetBufferedRegion());
+  target->Allocate();
+
+  // The gradient is in voxel units, like the gradient of the interpolant
+  VectorImagePointer grad = LDDMMType::new_vimg(moving);
+  for(int k = 0; k < nc; k++)
+    {
+    FloatImagePointer comp = this->ExtractComponent(moving, k, true);
+    LDDMMType::image_gradient(comp, grad, false);
+    this->PlaceIntoComposite(comp, target, k);
+    this->PlaceIntoComposite(grad, target, nc + k * VDim);
+    }
+
+  m_MovingGradientComposite[level] = target;
+}
+
 template <class TFloat, unsigned int VDim>
 typename MultiImageOpticalFlowHelper<TFloat, VDim>::ImageBaseType *
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -492,7 +690,9 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   Vec sigmas;
   if(in_physical_units)
     {
-    sigmas.Fill(sigma * m_PyramidFactors[level]);
+    // With an anisotropic pyramid, the sigma along each axis follows that axis' factor
+    for(int k = 0; k < VDim; k++)
+      sigmas[k] = sigma * m_PyramidAxisFactors[level][k];
     }
   else
     {
@@ -502,6 +702,93 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   return sigmas;
 }
 
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::SetMovingTilesLevel(int level)
+{
+  if(m_MovingTiles.size() != m_PyramidFactors.size())
+    m_MovingTiles.resize(m_PyramidFactors.size());
+
+  if(level != m_MovingTilesLevel)
+    {
+    for(unsigned int j = 0; j < m_MovingTiles.size(); j++)
+      if((int) j != level)
+        m_MovingTiles[j].Release();
+    m_MovingTilesLevel = level;
+    m_MovingTilesCalls = 0;
+    }
+}
+
+template <class TFloat, unsigned int VDim>
+const typename MultiImageOpticalFlowHelper<TFloat, VDim>::MovingTilesType *
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetMovingTiles(int level)
+{
+  SetMovingTilesLevel(level);
+  if(!m_MovingTiles[level].IsBuiltFrom(m_MovingComposite[level]))
+    m_MovingTiles[level].Build(m_MovingComposite[level]);
+
+  return &m_MovingTiles[level];
+}
+
+template <class TFloat, unsigned int VDim>
+const typename MultiImageOpticalFlowHelper<TFloat, VDim>::MovingTilesType *
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetMovingTilesIfNeeded(int level, LinearTransformType *tran)
+{
+  if(m_TiledMovingRotation < 0)
+    return NULL;
+
+  SetMovingTilesLevel(level);
+
+  // The transform maps fixed voxels to moving voxels, so its columns are the steps taken
+  // in the moving image along the fixed image axes. Find the largest angle between a step
+  // and the corresponding moving image axis
+  double max_angle = 0.0;
+  for(unsigned int d = 0; d < VDim; d++)
+    {
+    double norm = 0.0;
+    for(unsigned int r = 0; r < VDim; r++)
+      norm += tran->GetMatrix()(r, d) * tran->GetMatrix()(r, d);
+    if(norm > 0.0)
+      {
+      double cos_angle = std::min(1.0, std::fabs(tran->GetMatrix()(d, d)) / sqrt(norm));
+      max_angle = std::max(max_angle, acos(cos_angle) * 180.0 / vnl_math::pi);
+      }
+    }
+
+  return max_angle > m_TiledMovingRotation ? GetMovingTiles(level) : NULL;
+}
+
+template <class TFloat, unsigned int VDim>
+const typename MultiImageOpticalFlowHelper<TFloat, VDim>::MovingTilesType *
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetMovingTilesIfNeeded(int level, VectorImageType *def)
+{
+  if(m_TiledMovingDisplacement < 0)
+    return NULL;
+
+  // Deformations rarely shrink over the iterations at a level, so once the tiles have been
+  // built, they are used for the rest of the level without checking the displacements
+  SetMovingTilesLevel(level);
+  if(m_MovingTiles[level].IsBuiltFrom(m_MovingComposite[level]))
+    return &m_MovingTiles[level];
+
+  // Deformations also grow slowly, so the serial scan of the field is not done every call
+  if(m_MovingTilesCalls++ % TiledMovingCheckPeriod != 0)
+    return NULL;
+
+  double thresh_sq = m_TiledMovingDisplacement * m_TiledMovingDisplacement;
+  const typename VectorImageType::PixelType *p = def->GetBufferPointer();
+  unsigned long n = def->GetPixelContainer()->Size();
+  for(unsigned long i = 0; i < n; i++)
+    if(p[i].GetSquaredNorm() > thresh_sq)
+      return GetMovingTiles(level);
+
+  return NULL;
+}
+
 template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -510,7 +797,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
                           FloatImageType *out_metric_image,
                           MultiComponentMetricReport &out_metric_report,
                           VectorImageType *out_gradient,
-                          double result_scaling)
+                          double result_scaling,
+                          FloatImageType *active_mask)
 {
   typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
   typedef MultiImageOpticalFlowImageFilter<TraitsType> FilterType;
@@ -530,9 +818,13 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   // Run the filter
   filter->SetFixedImage(m_FixedComposite[level]);
   filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetMovingImageTiles(GetMovingTilesIfNeeded(level, def));
+  filter->SetMovingImageWithGradient(m_MovingGradientComposite[level]);
   filter->SetDeformationField(def);
   filter->SetWeights(wscaled);
   filter->SetComputeGradient(true);
+  if(active_mask)
+    filter->SetFixedMaskImage(active_mask);
   filter->GetMetricOutput()->Graft(out_metric_image);
   filter->GetDeformationGradientOutput()->Graft(out_gradient);
   filter->Update();
@@ -548,8 +840,14 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 ::ComputeHistogramsIfNeeded(int level)
 {
   typedef MutualInformationPreprocessingFilter<MultiComponentImageType, BinnedImageType> BinnerType;
-  if(m_FixedBinnedImage.IsNull()
-     || m_FixedBinnedImage->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion())
+
+  // The fixed images are binned once per level and may be shared with other helpers
+  std::vector<typename BinnedImageType::Pointer> &binned_fixed = m_FixedStatistics->binned_fixed;
+  if(binned_fixed.size() != m_PyramidFactors.size())
+    binned_fixed.resize(m_PyramidFactors.size(), NULL);
+
+  if(binned_fixed[level].IsNull()
+     || binned_fixed[level]->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion())
     {
     typename BinnerType::Pointer fixed_binner = BinnerType::New();
     fixed_binner->SetInput(m_FixedComposite[level]);
@@ -558,17 +856,23 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     fixed_binner->SetUpperQuantile(0.99);
     fixed_binner->SetStartAtBinOne(true);
     fixed_binner->Update();
-    m_FixedBinnedImage = fixed_binner->GetOutput();
+    binned_fixed[level] = fixed_binner->GetOutput();
+    }
+
+  if(m_MovingBinnedImages.size() != m_PyramidFactors.size())
+    m_MovingBinnedImages.resize(m_PyramidFactors.size(), NULL);
 
+  if(m_MovingBinnedImages[level].IsNull()
+     || m_MovingBinnedImages[level]->GetBufferedRegion() != m_MovingComposite[level]->GetBufferedRegion())
+    {
     typename BinnerType::Pointer moving_binner = BinnerType::New();
-    moving_binner = BinnerType::New();
     moving_binner->SetInput(m_MovingComposite[level]);
     moving_binner->SetBins(128);
     moving_binner->SetLowerQuantile(0.01);
     moving_binner->SetUpperQuantile(0.99);
     moving_binner->SetStartAtBinOne(true);
     moving_binner->Update();
-    m_MovingBinnedImage = moving_binner->GetOutput();
+    m_MovingBinnedImages[level] = moving_binner->GetOutput();
     }
 }
 
@@ -601,8 +905,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   typename MetricType::Pointer metric = MetricType::New();
 
   metric->SetComputeNormalizedMutualInformation(normalized_mutual_information);
-  metric->SetFixedImage(m_FixedBinnedImage);
-  metric->SetMovingImage(m_MovingBinnedImage);
+  metric->SetFixedImage(m_FixedStatistics->binned_fixed[level]);
+  metric->SetMovingImage(m_MovingBinnedImages[level]);
   metric->SetDeformationField(def);
   metric->SetWeights(wscaled);
   metric->SetComputeGradient(true);
@@ -653,19 +957,49 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
                         FloatImageType *out_metric_image,
                         MultiComponentMetricReport &out_metric_report,
                         VectorImageType *out_gradient,
-                        double result_scaling)
+                        double result_scaling,
+                        bool approximate)
 {
   typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
-  typedef MultiComponentNCCImageMetric<TraitsType> FilterType;
-  // typedef MultiComponentApproximateNCCImageMetric<TraitsType> FilterType;
-
-  typename FilterType::Pointer filter = FilterType::New();
 
   // Scale the weights by epsilon
   vnl_vector<float> wscaled(m_Weights.size());
   for (unsigned i = 0; i < wscaled.size(); i++)
     wscaled[i] = m_Weights[i] * result_scaling;
 
+  // The approximate metric has its own working image, since its layout is not
+  // compatible with the fixed components reused by the exact metric
+  if(approximate)
+    {
+    typedef MultiComponentApproximateNCCImageMetric<TraitsType> FilterType;
+    typename FilterType::Pointer filter = FilterType::New();
+
+    if(m_ApproxNCCWorkingImage.IsNull())
+      m_ApproxNCCWorkingImage = MultiComponentImageType::New();
+
+    bool first_run =
+        m_ApproxNCCWorkingImage->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion();
+
+    filter->SetFixedImage(m_FixedComposite[level]);
+    filter->SetMovingImage(m_MovingComposite[level]);
+    filter->SetDeformationField(def);
+    filter->SetWeights(wscaled);
+    filter->SetComputeGradient(true);
+    filter->GetMetricOutput()->Graft(out_metric_image);
+    filter->GetDeformationGradientOutput()->Graft(out_gradient);
+    filter->SetRadius(AdjustNCCRadius(level, radius, first_run));
+    filter->SetWorkingImage(m_ApproxNCCWorkingImage);
+    filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
+    filter->Update();
+
+    out_metric_report.ComponentMetrics = filter->GetAllMetricValues();
+    out_metric_report.TotalMetric = filter->GetMetricValue();
+    return;
+    }
+
+  typedef MultiComponentNCCImageMetric<TraitsType> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+
   // Allocate a working image
   if(m_NCCWorkingImage.IsNull())
     m_NCCWorkingImage = MultiComponentImageType::New();
@@ -680,6 +1014,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   // Run the filter
   filter->SetFixedImage(m_FixedComposite[level]);
   filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetMovingImageTiles(GetMovingTilesIfNeeded(level, def));
+  filter->SetMovingImageWithGradient(m_MovingGradientComposite[level]);
   filter->SetDeformationField(def);
   filter->SetWeights(wscaled);
   filter->SetComputeGradient(true);
@@ -701,6 +1037,72 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   out_metric_report.TotalMetric = filter->GetMetricValue();
 }
 
+template <class TFloat, unsigned int VDim>
+unsigned long
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputeNCCBruteForceSearch(int level, const SizeType &radius, const SizeType &search_radius,
+                             bool subvoxel, FloatImageType *out_metric_image,
+                             VectorImageType *out_offset)
+{
+  typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
+  typedef MultiComponentNCCSearchFilter<TraitsType> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+
+  vnl_vector<float> weights(m_Weights.size());
+  for (unsigned i = 0; i < weights.size(); i++)
+    weights[i] = m_Weights[i];
+
+  // Share the working image with the NCC metric
+  if(m_NCCWorkingImage.IsNull())
+    m_NCCWorkingImage = MultiComponentImageType::New();
+
+  SizeType radius_fix = AdjustNCCRadius(level, radius, true);
+
+  filter->SetFixedImage(m_FixedComposite[level]);
+  filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetWeights(weights);
+  filter->SetRadius(radius_fix);
+  filter->SetSearchRadius(search_radius);
+  filter->SetSubvoxelRefinement(subvoxel);
+  filter->SetWorkingImage(m_NCCWorkingImage);
+  filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  filter->SetMovingMaskImage(m_MovingMaskComposite[level]);
+  filter->GetMetricOutput()->Graft(out_metric_image);
+  filter->GetOffsetOutput()->Graft(out_offset);
+  filter->Update();
+
+  return filter->GetNumberOfUpdates();
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::MultiComponentImagePointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputeNCCBlockMatch(int level, const SizeType &radius, const SizeType &search_radius,
+                       unsigned int n_candidates, MultiComponentImageType *candidates)
+{
+  typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
+  typedef MultiComponentNCCBlockMatchFilter<TraitsType> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+
+  vnl_vector<float> weights(m_Weights.size());
+  for (unsigned i = 0; i < weights.size(); i++)
+    weights[i] = m_Weights[i];
+
+  filter->SetFixedImage(m_FixedComposite[level]);
+  filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetWeights(weights);
+  filter->SetRadius(AdjustNCCRadius(level, radius, true));
+  filter->SetSearchRadius(search_radius);
+  filter->SetNumberOfCandidates(n_candidates);
+  filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  filter->SetMovingMaskImage(m_MovingMaskComposite[level]);
+  if(candidates)
+    filter->SetCandidates(candidates);
+  filter->Update();
+
+  return filter->GetOutput();
+}
+
 template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -733,11 +1135,6 @@ void
 MultiImageOpticalFlowHelper<TFloat, VDim>
 ::ComputeAffineMSDMatchAndGradient(int level,
     LinearTransformType *tran,
-    FloatImageType *wrkMetric,
-    FloatImageType *wrkMask,
-    VectorImageType *wrkGradMetric,
-    VectorImageType *wrkGradMask,
-    VectorImageType *wrkPhi,
     MultiComponentMetricReport &out_metric,
     LinearTransformType *grad)
 {
@@ -753,27 +1150,18 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
   metric->SetFixedImage(m_FixedComposite[level]);
   metric->SetMovingImage(m_MovingComposite[level]);
+  metric->SetMovingImageTiles(GetMovingTilesIfNeeded(level, tran));
+  metric->SetMovingImageWithGradient(m_MovingGradientComposite[level]);
   metric->SetWeights(wscaled);
   metric->SetAffineTransform(tran);
   metric->SetComputeMovingDomainMask(true);
-  metric->GetMetricOutput()->Graft(wrkMetric);
+  metric->SetComputeMetricImage(false);
   metric->SetComputeGradient(grad != NULL);
   metric->SetFixedMaskImage(m_GradientMaskComposite[level]);
   metric->SetMovingMaskImage(m_MovingMaskComposite[level]);
   metric->SetJitterImage(m_JitterComposite[level]);
   metric->Update();
 
-  // TODO: erase this
-  /*
-  std::cout << "SAVING METRIC, TRAN = " << tran->GetMatrix() << std::endl;
-  static int iter = 0;
-  std::ostringstream oss; oss << "metric_" << iter << ".nii.gz";
-  LDDMMData<TFloat, VDim>::img_write(wrkMetric, oss.str().c_str());
-  std::stringstream oss2; oss2 << "metric_mask_" << iter << ".nii.gz";
-  LDDMMData<TFloat, VDim>::img_write(wrkMask, oss2.str().c_str());
-  ++iter;
-  */
-
   // Process the results
   if(grad)
     {
@@ -793,11 +1181,6 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 ::ComputeAffineMIMatchAndGradient(int level,
                                   bool normalized_mutual_info,
                                   LinearTransformType *tran,
-                                  FloatImageType *wrkMetric,
-                                  FloatImageType *wrkMask,
-                                  VectorImageType *wrkGradMetric,
-                                  VectorImageType *wrkGradMask,
-                                  VectorImageType *wrkPhi,
                                   MultiComponentMetricReport &out_metric,
                                   LinearTransformType *grad)
 {
@@ -819,12 +1202,12 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   typename MetricType::Pointer metric = MetricType::New();
 
   metric->SetComputeNormalizedMutualInformation(normalized_mutual_info);
-  metric->SetFixedImage(m_FixedBinnedImage);
-  metric->SetMovingImage(m_MovingBinnedImage);
+  metric->SetFixedImage(m_FixedStatistics->binned_fixed[level]);
+  metric->SetMovingImage(m_MovingBinnedImages[level]);
   metric->SetWeights(wscaled);
   metric->SetAffineTransform(tran);
   metric->SetComputeMovingDomainMask(true);
-  metric->GetMetricOutput()->Graft(wrkMetric);
+  metric->SetComputeMetricImage(false);
   metric->SetComputeGradient(grad != NULL);
   metric->SetFixedMaskImage(m_GradientMaskComposite[level]);
   metric->SetMovingMaskImage(m_MovingMaskComposite[level]);
@@ -853,10 +1236,6 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
                                    LinearTransformType *tran,
                                    const SizeType &radius,
                                    FloatImageType *wrkMetric,
-                                   FloatImageType *wrkMask,
-                                   VectorImageType *wrkGradMetric,
-                                   VectorImageType *wrkGradMask,
-                                   VectorImageType *wrkPhi,
                                    MultiComponentMetricReport &out_metric,
                                    LinearTransformType *grad)
 {
@@ -883,6 +1262,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
   metric->SetFixedImage(m_FixedComposite[level]);
   metric->SetMovingImage(m_MovingComposite[level]);
+  metric->SetMovingImageTiles(GetMovingTilesIfNeeded(level, tran));
+  metric->SetMovingImageWithGradient(m_MovingGradientComposite[level]);
   metric->SetWeights(wscaled);
   metric->SetAffineTransform(tran);
   metric->SetComputeMovingDomainMask(false);
@@ -1077,8 +1458,11 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     // Resample the warp - no smoothing
     LDDMMType::vimg_resample_identity(srcWarp, this->GetReferenceSpace(trgLevel), trgWarp);
 
-    // Scale by the factor
-    LDDMMType::vimg_scale_in_place(trgWarp, src_factor / trg_factor);
+    // Scale each component by the factor of its axis
+    Vec scale;
+    for(unsigned int d = 0; d < VDim; d++)
+      scale[d] = m_PyramidAxisFactors[srcLevel][d] / m_PyramidAxisFactors[trgLevel][d];
+    LDDMMType::vimg_scale_in_place(trgWarp, scale);
     }
   else if(src_factor == trg_factor)
     {
@@ -32,10 +32,51 @@
 #include "itkVectorImage.h"
 #include "itkMatrixOffsetTransformBase.h"
 
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
 #include "MultiComponentMetricReport.h"
+#include "FastLinearInterpolator.h"
 
 template <class MultiComponentImageType, class BinnedImageType> class MutualInformationPreprocessingFilter;
 
+/**
+ * Per-level data derived from the fixed images alone, which does not depend on the moving
+ * images or on the transformation. A MultiImageOpticalFlowHelper fills this in as it is
+ * needed. The same object can be passed to other helpers built on the same fixed images
+ * (e.g., the affine, deformable and metric runs in a session), which then reuse it.
+ *
+ * The NCC sums of the fixed image are not included, because the NCC metric only sums
+ * over voxels that map inside the moving image.
+ */
+template <class TFloat, unsigned int VDim>
+class MultiImageFixedStatistics : public itk::Object
+{
+public:
+  typedef MultiImageFixedStatistics<TFloat, VDim> Self;
+  typedef itk::Object                             Superclass;
+  typedef itk::SmartPointer<Self>                 Pointer;
+  typedef itk::SmartPointer<const Self>           ConstPointer;
+
+  itkNewMacro(Self)
+  itkTypeMacro(MultiImageFixedStatistics, itk::Object)
+
+  typedef itk::VectorImage<unsigned char, VDim> BinnedImageType;
+  typedef itk::Image<TFloat, VDim> FloatImageType;
+  typedef itk::Size<VDim> SizeType;
+
+  // Fixed composites mapped into histogram bins for the MI metrics, per level
+  std::vector<typename BinnedImageType::Pointer> binned_fixed;
+
+  // Gradient masks dilated for the NCC metric, per level, and the radius of the dilation
+  std::vector<typename FloatImageType::Pointer> ncc_gradient_masks;
+  SizeType ncc_radius;
+
+protected:
+  MultiImageFixedStatistics() { ncc_radius.Fill(0); }
+  ~MultiImageFixedStatistics() {}
+};
+
 /**
  * This class is used to perform mean square intensity difference type
  * registration with multiple images. The filter is designed for speed
@@ -62,6 +103,17 @@ public:
 
   typedef itk::MatrixOffsetTransformBase<TFloat, VDim, VDim> LinearTransformType;
 
+  typedef MultiImageFixedStatistics<TFloat, VDim> FixedStatisticsType;
+  typedef typename FixedStatisticsType::Pointer FixedStatisticsPointer;
+
+  /**
+   * Share the statistics of the fixed images with other helpers. The object must have been
+   * filled in by a helper with the same fixed images, masks and pyramid, or be empty. By
+   * default, each helper has its own statistics.
+   */
+  void SetFixedStatistics(FixedStatisticsType *stats) { m_FixedStatistics = stats; }
+  FixedStatisticsType *GetFixedStatistics() { return m_FixedStatistics; }
+
   /** Set default (power of two) pyramid factors */
   void SetDefaultPyramidFactors(int n_levels);
 
@@ -75,6 +127,69 @@ public:
    */
   void SetScaleFixedImageWithVoxelSize(bool onoff) { m_ScaleFixedImageWithVoxelSize = onoff; }
 
+  /**
+   * Set memory-lean mode. In this mode, each input image pair is released once it has
+   * been packed into the composite pyramid, and for a single single-component image pair,
+   * the full resolution level of the pyramid shares the buffer of the input images
+   * instead of copying it (unless the images are modified by noise, masks or NaNs)
+   */
+  void SetMemoryLean(bool onoff) { m_MemoryLean = onoff; }
+
+  /**
+   * After the composite images are built in memory-lean mode, get the size in MB of the
+   * input images that were released, shared with the pyramid, and still held elsewhere
+   * (the caller should drop its own references before BuildCompositeImages)
+   */
+  void GetMemoryLeanReport(double &mb_released, double &mb_shared, double &mb_pinned) const
+    { mb_released = m_MemoryLeanMB[0]; mb_shared = m_MemoryLeanMB[1]; mb_pinned = m_MemoryLeanMB[2]; }
+
+  /**
+   * Set anisotropy-aware pyramid mode. In this mode, each axis is downsampled by
+   * its own integer factor, chosen from the voxel spacing of the fixed image so
+   * that the coarse levels approach isotropic spacing. Axes that are already coarse
+   * (e.g., the slice axis of a thick-slice scan) are decimated less or not at all.
+   */
+  void SetAnisotropicPyramid(bool onoff) { m_AnisotropicPyramid = onoff; }
+
+  /**
+   * Interpolate the moving composite from a tiled copy (see FastLinearInterpolatorTiles)
+   * in the SSD and NCC metrics once the affine transform rotates the sampling grid by more
+   * than rotation_deg degrees, or the deformation displaces it by more than displacement_vox
+   * voxels. Negative values (the default) turn the tiled copy off
+   */
+  void SetTiledMovingThresholds(double rotation_deg, double displacement_vox)
+    { m_TiledMovingRotation = rotation_deg; m_TiledMovingDisplacement = displacement_vox; }
+
+  /**
+   * Select the pyramid levels (non-zero entries) at which BuildCompositeImages also stores
+   * the moving composite with the gradient of each component interleaved after the values.
+   * The SSD and exact NCC metrics then interpolate the value and gradient together instead
+   * of differentiating the interpolant. Off at all levels by default
+   */
+  void SetPrecomputedMovingGradientLevels(const std::vector<int> &levels)
+    { m_PrecomputedMovingGradientLevels = levels; }
+
+  /** Get the number of pyramid levels and the nominal factor of a level */
+  int GetNumberOfLevels() const { return m_PyramidFactors.size(); }
+  int GetPyramidFactor(int level) const { return m_PyramidFactors[level]; }
+
+  /** Get the per-axis downsampling factors of a pyramid level */
+  const Vec &GetPyramidAxisFactors(int level) const { return m_PyramidAxisFactors[level]; }
+
+  /**
+   * Get the grid of a pyramid level, as it will be created by BuildCompositeImages.
+   * This can be called once the image pairs have been added.
+   */
+  typename ImageBaseType::Pointer GetPyramidLevelSpace(int level);
+
+  /**
+   * Supply the moving image of the j-th pair at the downsampled pyramid levels, already
+   * sampled on the grid returned by GetPyramidLevelSpace (e.g., by resampling the
+   * original moving image through a transform chain). Entries for full resolution
+   * levels are ignored, and the moving image passed to AddImagePair is used there.
+   */
+  void SetMovingPyramid(unsigned int j, const std::vector<MultiComponentImagePointer> &levels);
+
   /** Add a pair of multi-component images to the class - same weight for each component */
   void AddImagePair(MultiComponentImageType *fixed, MultiComponentImageType *moving, double weight);
 
@@ -129,17 +244,24 @@ public:
   /** Get the moving image at a pyramid level */
   MultiComponentImageType *GetMovingComposite(int level) { return m_MovingComposite[level]; }
 
+  /** Get the moving image with interleaved gradients at a pyramid level, or NULL */
+  MultiComponentImageType *GetMovingGradientComposite(int level) { return m_MovingGradientComposite[level]; }
+
   /** Get the smoothing factor for given level based on parameters */
   Vec GetSmoothingSigmasInPhysicalUnits(int level, double sigma, bool in_physical_units);
 
   /** Get the component weights in the composite */
   const std::vector<double> &GetWeights() const { return m_Weights; }
 
-  /** Perform interpolation - compute [(I - J(Tx)) GradJ(Tx)] */
+  /**
+   * Perform interpolation - compute [(I - J(Tx)) GradJ(Tx)]. Voxels where the optional
+   * active mask is zero are skipped, and the metric is reported over the remaining voxels
+   */
   void ComputeOpticalFlowField(
       int level, VectorImageType *def, FloatImageType *out_metric_image,
       MultiComponentMetricReport &out_metric_report,
-      VectorImageType *out_gradient, double result_scaling = 1.0);
+      VectorImageType *out_gradient, double result_scaling = 1.0,
+      FloatImageType *active_mask = NULL);
 
   /** Perform interpolation - compute mutual information metric */
   void ComputeMIFlowField(
@@ -148,44 +270,58 @@ public:
       MultiComponentMetricReport &out_metric_report,
       VectorImageType *out_gradient, double result_scaling = 1.0);
 
-  /** Compute the NCC metric without gradient */
+  /**
+   * Compute the NCC metric and its gradient. When approximate is set, the cheaper
+   * ANTS-style gradient along the fixed image gradient is used instead (see
+   * MultiComponentApproximateNCCImageMetric); this does not support moving masks
+   */
   void ComputeNCCMetricImage(int level, VectorImageType *def, const SizeType &radius,
                              FloatImageType *out_metric_image, MultiComponentMetricReport &out_metric_report,
-                             VectorImageType *out_gradient = NULL, double result_scaling = 1.0);
+                             VectorImageType *out_gradient = NULL, double result_scaling = 1.0,
+                             bool approximate = false);
+
+  /**
+   * Exhaustive NCC search over all integer displacements within search_radius of each voxel.
+   * The best displacement (voxel units, optionally refined to sub-voxel precision) is placed
+   * in out_offset and the corresponding metric value in out_metric_image. Returns the number
+   * of voxels for which the best displacement was updated during the search.
+   */
+  unsigned long ComputeNCCBruteForceSearch(int level, const SizeType &radius, const SizeType &search_radius,
+                                           bool subvoxel, FloatImageType *out_metric_image,
+                                           VectorImageType *out_offset);
+
+  /**
+   * Block matching with the NCC metric at a pyramid level. Returns an image on the block grid
+   * holding the best n_candidates (metric, offset) tuples per block, see
+   * MultiComponentNCCBlockMatchFilter. If candidates from a coarser level are given, the search
+   * is restricted to search_radius around them.
+   */
+  MultiComponentImagePointer ComputeNCCBlockMatch(int level, const SizeType &radius, const SizeType &search_radius,
+                                                  unsigned int n_candidates,
+                                                  MultiComponentImageType *candidates = NULL);
 
   /** Compute the Mahalanobis metric with gradient */
   void ComputeMahalanobisMetricImage(int level, VectorImageType *def,
                                      FloatImageType *out_metric_image, MultiComponentMetricReport &out_metric_report,
                                      VectorImageType *out_gradient = NULL);
 
-  /** Compute affine similarity and gradient */
+  /**
+   * Compute affine similarity and gradient. The SSD and MI metrics are accumulated per
+   * thread without any per-voxel images; NCC requires a working metric image
+   */
   void ComputeAffineMSDMatchAndGradient(int level, LinearTransformType *tran,
-                                        FloatImageType *wrkMetric,
-                                        FloatImageType *wrkMask,
-                                        VectorImageType *wrkGradMetric,
-                                        VectorImageType *wrkGradMask,
-                                        VectorImageType *wrkPhi,
                                         MultiComponentMetricReport &metrics,
                                         LinearTransformType *grad = NULL);
 
 
   void ComputeAffineMIMatchAndGradient(int level, bool normalized_mutual_info,
                                        LinearTransformType *tran,
-                                       FloatImageType *wrkMetric,
-                                       FloatImageType *wrkMask,
-                                       VectorImageType *wrkGradMetric,
-                                       VectorImageType *wrkGradMask,
-                                       VectorImageType *wrkPhi,
                                        MultiComponentMetricReport &metrics,
                                        LinearTransformType *grad = NULL);
 
   void ComputeAffineNCCMatchAndGradient(int level, LinearTransformType *tran,
                                         const SizeType &radius,
                                         FloatImageType *wrkMetric,
-                                        FloatImageType *wrkMask,
-                                        VectorImageType *wrkGradMetric,
-                                        VectorImageType *wrkGradMask,
-                                        VectorImageType *wrkPhi,
                                         MultiComponentMetricReport &metrics,
                                         LinearTransformType *grad = NULL);
 
@@ -235,13 +371,24 @@ public:
     FloatImageType *error_norm = NULL, double tol = 0.0, int max_iter = 20);
 
   MultiImageOpticalFlowHelper() : 
-    m_JitterSigma(0.0), m_ScaleFixedImageWithVoxelSize(false) {}
+    m_JitterSigma(0.0), m_ScaleFixedImageWithVoxelSize(false), m_MemoryLean(false),
+    m_AnisotropicPyramid(false), m_TiledMovingRotation(-1.0), m_TiledMovingDisplacement(-1.0),
+    m_MovingTilesLevel(-1), m_MovingTilesCalls(0)
+    {
+    m_FixedStatistics = FixedStatisticsType::New();
+    m_MemoryLeanMB[0] = m_MemoryLeanMB[1] = m_MemoryLeanMB[2] = 0.0;
+    }
 
 protected:
 
   // Pyramid factors
   PyramidFactorsType m_PyramidFactors;
 
+  // Per-axis pyramid factors, computed when the composite images are built
+  std::vector<Vec> m_PyramidAxisFactors;
+
+  void ComputePyramidAxisFactors();
+
   // Weights
   std::vector<double> m_Weights;
 
@@ -253,12 +400,25 @@ protected:
   // Fixed and moving images
   MultiCompImageSet m_Fixed, m_Moving;
 
+  // Moving images supplied per pyramid level, for each image pair
+  std::vector<MultiCompImageSet> m_MovingPyramids;
+
   // Composite image at each resolution level
   MultiCompImageSet m_FixedComposite, m_MovingComposite;
 
+  // Moving composite with interleaved gradients at the selected levels (NULL elsewhere)
+  std::vector<int> m_PrecomputedMovingGradientLevels;
+  MultiCompImageSet m_MovingGradientComposite;
+
+  // Build the moving composite with interleaved gradients for a level
+  void BuildMovingGradientComposite(int level);
+
   // Working memory image for NCC computation
   typename MultiComponentImageType::Pointer m_NCCWorkingImage;
 
+  // Working memory for the approximate NCC metric
+  typename MultiComponentImageType::Pointer m_ApproxNCCWorkingImage;
+
   // Gradient mask image - used to multiply the gradient
   typename FloatImageType::Pointer m_GradientMaskImage;
 
@@ -283,20 +443,65 @@ protected:
   void PlaceIntoComposite(FloatImageType *src, MultiComponentImageType *target, int offset);
   void PlaceIntoComposite(VectorImageType *src, MultiComponentImageType *target, int offset);
 
+  // Extract a component of a multi-component image. With share_buffer, a single-component
+  // image is wrapped as a scalar image without copying
+  FloatImagePointer ExtractComponent(MultiComponentImageType *src, unsigned int k, bool share_buffer);
+
+  // Extract a component in a single threaded pass that also sets voxels where nan_mask
+  // is positive to NaN and counts the NaNs. If quantile_range is not NULL, the distance
+  // between the 1% and 99% quantiles is computed as well
+  FloatImagePointer ExtractComponent(MultiComponentImageType *src, unsigned int k, bool share_buffer,
+                                     FloatImageType *nan_mask, unsigned long &n_nans,
+                                     double *quantile_range = NULL);
+
   // Adjust NCC radius to be smaller than half image size
   SizeType AdjustNCCRadius(int level, const SizeType &radius, bool report_on_adjust);
 
   // Precompute histograms for MI/NMI
   void ComputeHistogramsIfNeeded(int level);
 
-  // Fixed and moving images intensity mapped into histogram binned
+  // Fixed and moving images intensity mapped into histogram bins. The moving images are
+  // stored per level, the fixed images are stored in the fixed statistics
   typedef itk::VectorImage<unsigned char, VDim> BinnedImageType;
-  typename BinnedImageType::Pointer m_FixedBinnedImage, m_MovingBinnedImage;
+  std::vector<typename BinnedImageType::Pointer> m_MovingBinnedImages;
+
+  // Statistics of the fixed images, possibly shared with other helpers
+  FixedStatisticsPointer m_FixedStatistics;
+
+  // Tiled copies of the moving composite, built at each level when first needed. Only
+  // the tiles of the level in use are kept
+  typedef FastLinearInterpolatorTiles<MultiComponentImageType> MovingTilesType;
+  std::vector<MovingTilesType> m_MovingTiles;
+  int m_MovingTilesLevel;
+
+  // Before the tiles are built at a level, the displacement field is checked against the
+  // threshold on the first call and then every TiledMovingCheckPeriod calls
+  enum { TiledMovingCheckPeriod = 5 };
+  unsigned int m_MovingTilesCalls;
+
+  // Switch the tiles to a level, releasing the tiles of the other levels
+  void SetMovingTilesLevel(int level);
+
+  // Get the tiled copy of the moving composite if the transform is past the thresholds
+  // for using it, or NULL otherwise
+  const MovingTilesType *GetMovingTilesIfNeeded(int level, LinearTransformType *tran);
+  const MovingTilesType *GetMovingTilesIfNeeded(int level, VectorImageType *def);
+  const MovingTilesType *GetMovingTiles(int level);
 
   // Whether the fixed images should be scaled down by the pyramid factors
   // when subsampling. This is needed for the Mahalanobis distance metric, but not for
   // any of the metrics that use image intensities
   bool m_ScaleFixedImageWithVoxelSize;
+
+  // Memory-lean mode, and the memory released, shared and pinned by it
+  bool m_MemoryLean;
+  double m_MemoryLeanMB[3];
+
+  // Whether the pyramid factors are chosen per axis
+  bool m_AnisotropicPyramid;
+
+  // Rotation (degrees) and displacement (voxels) past which the tiled moving copy is used
+  double m_TiledMovingRotation, m_TiledMovingDisplacement;
 };
 
 #endif
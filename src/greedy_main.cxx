@@ -67,6 +67,7 @@ int usage()
   printf("Mode specification: \n");
   printf("  -a                     : Perform affine registration and save to output (-o)\n");
   printf("  -brute radius          : Perform a brute force search around each voxel \n");
+  printf("  -bm radius             : Perform coarse-to-fine block matching with the NCC metric\n");
   printf("  -moments <1|2>         : Perform moments of inertia rigid alignment of given order.\n");
   printf("                               order 1 matches center of mass only\n");
   printf("                               order 2 matches second-order moments of inertia tensors\n");
@@ -75,6 +76,8 @@ int usage()
   printf("  -iw inwarp outwarp     : Invert previously computed warp\n");
   printf("  -root inwarp outwarp N : Convert 2^N-th root of a warp \n");
   printf("  -jac inwarp outjac     : Compute the Jacobian determinant of the warp \n");
+  printf("                               computed via the 2^N-th root of the warp (N set by -exp);\n");
+  printf("                               with -exp 0, computed directly from the warp (faster)\n");
   printf("  -metric                : Compute metric between images\n");
   printf("Options in deformable / affine mode: \n");
   printf("  -w weight              : weight of the next -i pair\n");
@@ -87,7 +90,24 @@ int usage()
   printf("  -e epsilon             : step size (default = 1.0), \n");
   printf("                               may also be specified per level (e.g. 0.3x0.1)\n");
   printf("  -n NxNxN               : number of iterations per level of multi-res (100x100) \n");
+  printf("  -pyr-aniso             : choose the multi-res downsampling factor of each axis from the voxel\n");
+  printf("                           spacing, so that coarse levels of anisotropic (e.g. thick-slice)\n");
+  printf("                           images approach isotropic spacing. NCC radius stays in level voxels,\n");
+  printf("                           and smoothing sigmas given in mm are scaled by each axis' factor\n");
   printf("  -threads N             : set the number of allowed concurrent threads\n");
+  printf("  -threads-auto          : in deformable and affine mode, use fewer threads for the metric,\n");
+  printf("                           smoothing and composition at levels with too little work to\n");
+  printf("                           make up for the cost of starting and synchronizing threads\n");
+  printf("  -threads-stage S NxNxN : number of threads for stage S (metric, smooth or compose), for all\n");
+  printf("                           levels or per level (one entry per level, as in -n). 0 means automatic\n");
+  printf("                           (with -threads-auto) or all threads. These options change the\n");
+  printf("                           process-wide ITK default thread count while a stage runs\n");
+  printf("  -numa [pin] [thp]      : zero new image buffers in parallel, so that each thread's part lands\n");
+  printf("                           on its own NUMA node. With 'pin', pin the metric threads to CPUs on\n");
+  printf("                           the node holding their part of the image. Only the metric (and the\n");
+  printf("                           zeroing) threads are pinned: smoothing and composition run on unpinned\n");
+  printf("                           threads that may not be on the node of their part. With 'thp', request\n");
+  printf("                           transparent huge pages for large buffers (Linux only)\n");
   printf("  -gm mask.nii           : mask for gradient computation\n");
   printf("  -gm-trim <radius>      : generate mask for gradient computation by trimming the extent\n");
   printf("                           of the fixed image by given radius. This is useful during affine\n");
@@ -95,9 +115,42 @@ int usage()
   printf("                           is non-zero. The radius should match that of the NCC metric.");
   printf("  -fm mask.nii           : metric calculation exclusion mask for the fixed image\n");
   printf("  -mm mask.nii           : metric calculation exclusion mask for the moving image\n");
+  printf("  -crop-fg pad [thresh]  : crop the registration domain to the bounding box of the foreground,\n");
+  printf("                           padded by pad voxels. Foreground is the gradient mask if given, else\n");
+  printf("                           fixed (and moving) voxels above thresh (def: 0, may be negative).\n");
+  printf("                           Deformable and affine modes only; output warps are pasted back into\n");
+  printf("                           the full fixed space\n");
   printf("  -it filenames          : sequence of transforms to apply to the moving image first \n");
+  printf("  -it-levels             : sample the coarse levels of the moving images through the -it transforms\n");
+  printf("                           directly, rather than downsampling the pre-warped image. The pyramid\n");
+  printf("                           smoothing is mapped through the linear part of the transforms; images\n");
+  printf("                           for which it is not aligned with their axes are pre-warped as usual\n");
   printf("Specific to deformable mode: \n");
   printf("  -tscale MODE           : time step behavior mode: CONST, SCALE [def], SCALEDOWN\n");
+  printf("  -ncc-approx [N]        : with -m NCC, use a faster approximate NCC gradient (taken along the\n");
+  printf("                           fixed image gradient, as in ANTS) at all but the N finest levels,\n");
+  printf("                           where exact NCC is used (def: N=1). Coarse-level metric values are\n");
+  printf("                           not comparable to exact NCC values\n");
+  printf("  -lattice F [N]         : at the N finest levels (def: 1), represent the deformation on a control\n");
+  printf("                           lattice subsampled by factor F, reducing smoothing and composition cost.\n");
+  printf("                           The metric is still computed at full resolution. F should not exceed\n");
+  printf("                           the smoothing sigmas (in voxels)\n");
+  printf("  -active-set T [P] [B]  : with -m SSD, split each level into blocks of B voxels (def: 8) and freeze\n");
+  printf("                           blocks whose update was below T voxels, except for a halo around active\n");
+  printf("                           blocks: their update is dropped and the metric and composition skip\n");
+  printf("                           them (smoothing stays dense). All blocks are revisited every P iterations\n");
+  printf("                           (def: 10) and at the last iteration. Other iterations report the metric\n");
+  printf("                           over the active blocks only\n");
+  printf("  -tile-moving R D       : with -m SSD or NCC, interpolate the moving images from a tiled copy\n");
+  printf("                           (about 1.4x the memory in 3D) that keeps the samples of strongly\n");
+  printf("                           rotated or deformed grids in cache. Used once the affine rotation\n");
+  printf("                           exceeds R degrees (R < 90) or the displacement exceeds D voxels;\n");
+  printf("                           negative values turn either case off (def: -1 -1)\n");
+  printf("  -moving-grad NxNx...   : with -m SSD or NCC, precompute the moving image gradient at the levels\n");
+  printf("                           where the entry is 1 and interpolate it with the values, instead of\n");
+  printf("                           differentiating the interpolant (one entry per level, as in -n; def: 0).\n");
+  printf("                           Uses (1 + dim) times the moving image memory at those levels, and is\n");
+  printf("                           usually slower, since the analytic gradient reads no extra voxels\n");
   printf("  -s sigma1 sigma2       : smoothing for the greedy update step. Must specify units,\n");
   printf("                           either `vox` or `mm`. Default: 1.732vox, 0.7071vox\n");
   printf("  -oinv image.nii        : compute and write the inverse of the warp field into image.nii\n");
@@ -133,17 +186,33 @@ int usage()
   printf("                           'rot' may be the standard deviation of the random rotation angle (degrees) or \n");
   printf("                           keyword 'any' (any rotation) or 'flip' (any rotation or flip). \n");
   printf("                           'tran' is the standard deviation of the random offset, in physical units. \n");
+  printf("Specific to brute force search mode (-brute):\n");
+  printf("  -brute-metric out.nii  : write the best NCC value found at each voxel to out.nii\n");
+  printf("  -brute-int             : report integer offsets (no sub-voxel parabolic refinement)\n");
+  printf("Specific to block matching mode (-bm):\n");
+  printf("  -bm-levels N           : number of pyramid levels (def: 3). The -bm radius is searched\n");
+  printf("                           at the coarsest level, finer levels search +/-1 voxel around\n");
+  printf("                           the candidates carried over from the previous level\n");
+  printf("  -bm-topk K             : number of candidate offsets kept per block (def: 4)\n");
+  printf("  -bm-sigma S            : smoothing (in voxels) used to turn block offsets into a dense\n");
+  printf("                           warp (def: block size). The output can be passed to -id\n");
   printf("Specific to moments of inertia mode (-moments 2): \n");
   printf("  -det <-1|1>            : Force the determinant of transform to be either 1 (no flip) or -1 (flip)\n");
   printf("  -cov-id                : Assume identity covariance (match centers and do flips only, no rotation)\n");
+  printf("  -moments-ds N          : Compute moments using every N-th voxel along each dimension (def: 1)\n");
   printf("Specific to reslice mode (-r): \n");
   printf("  -rf fixed.nii          : fixed image for reslicing\n");
   printf("  -rm mov.nii out.nii    : moving/output image pair (may be repeated)\n");
   printf("  -rs mov.vtk out.vtk    : moving/output surface pair (vertices are warped from fixed space to moving)\n");
+  printf("                           point lists may be given as .csv (x,y,z per line) or .gpt (binary) files\n");
   printf("  -ri interp_mode        : interpolation for the next pair (NN, LINEAR*, LABEL sigma)\n");
   printf("  -rb value              : background (i.e. outside) intensity for the next pair (default 0)\n");
+  printf("  -rjm <0|1>             : multiply the next pairs by the Jacobian determinant of the warp, computed\n");
+  printf("                           in the same pass (preserves totals of density images; default 0)\n");
   printf("  -rc outwarp            : write composed transforms to outwarp \n");
   printf("  -rj outjacobian        : write Jacobian determinant image to outjacobian \n");
+  printf("  -rfuse                 : reslice -rm images that share the same grid and interpolation options\n");
+  printf("                           together, in a single pass over the warp (uses more memory)\n");
   printf("For developers: \n");
   printf("  -debug-deriv           : enable periodic checks of derivatives (debug) \n");
   printf("  -debug-deriv-eps       : epsilon for derivative debugging \n");
@@ -152,6 +221,8 @@ int usage()
   printf("  -dump-freq N           : dump frequency\n");
   printf("  -powell                : use Powell's method instead of LGBFS\n");
   printf("  -float                 : use single precision floating point (off by default)\n");
+  printf("  -lean                  : release input images once the multi-resolution pyramid is built, and\n");
+  printf("                           share the full resolution buffer for a single scalar image pair\n");
   printf("  -version               : print version info\n");
   printf("  -V <level>             : set verbosity level (0: none, 1: default, 2: verbose)\n");
 
@@ -56,6 +56,9 @@
 #include "itkShiftScaleImageFilter.h"
 
 #include "FastWarpCompositeImageFilter.h"
+#include "JacobianDeterminantImageFilter.h"
+#include "SeparableLinearResampleImageFilter.h"
+#include "ImageBufferPlacement.h"
 
 template <class TFloat, uint VDim>
 void 
@@ -75,7 +78,9 @@ LDDMMData<TFloat, VDim>
   img->SetRegions(ref->GetBufferedRegion());
   img->CopyInformation(ref);
   img->Allocate();
-  img->FillBuffer(Vec(0.0));
+  ImageBufferPlacement::ZeroFill(img->GetBufferPointer(),
+                                 img->GetPixelContainer()->Size() * sizeof(Vec),
+                                 img->GetBufferedRegion());
 }
 
 template <class TFloat, uint VDim>
@@ -118,11 +123,9 @@ LDDMMData<TFloat, VDim>
   img->CopyInformation(ref);
   img->SetNumberOfComponentsPerPixel(n_comp);
   img->Allocate();
-
-  typename CompositeImageType::PixelType cpix;
-  cpix.SetSize(n_comp);
-  cpix.Fill(0.0);
-  img->FillBuffer(cpix);
+  ImageBufferPlacement::ZeroFill(img->GetBufferPointer(),
+                                 img->GetPixelContainer()->Size() * sizeof(TFloat),
+                                 img->GetBufferedRegion());
 }
 
 template <class TFloat, uint VDim>
@@ -143,7 +146,9 @@ LDDMMData<TFloat, VDim>
   img->SetRegions(ref->GetBufferedRegion());
   img->CopyInformation(ref);
   img->Allocate();
-  img->FillBuffer(0.0);
+  ImageBufferPlacement::ZeroFill(img->GetBufferPointer(),
+                                 img->GetPixelContainer()->Size() * sizeof(TFloat),
+                                 img->GetBufferedRegion());
 }
 
 template <class TFloat, uint VDim>
@@ -225,12 +230,14 @@ template <class TFloat, uint VDim>
 void 
 LDDMMData<TFloat, VDim>
 ::interp_vimg(VectorImageType *data, VectorImageType *field,
-  TFloat def_scale, VectorImageType *out, bool use_nn, bool phys_space)
+  TFloat def_scale, VectorImageType *out, bool use_nn, bool phys_space, ImageType *active_mask)
 {
   typedef FastWarpCompositeImageFilter<VectorImageType, VectorImageType, VectorImageType> WF;
   typename WF::Pointer wf = WF::New();
   wf->SetDeformationField(field);
   wf->SetMovingImage(data);
+  if(active_mask)
+    wf->SetActiveMask(active_mask);
   wf->GraftOutput(out);
   wf->SetDeformationScaling(def_scale);
   wf->SetUseNearestNeighbor(use_nn);
@@ -367,7 +374,7 @@ template <class TFloat, uint VDim>
 void
 LDDMMData<TFloat, VDim>
 ::interp_cimg(CompositeImageType *data, VectorImageType *field, CompositeImageType *out,
-              bool use_nn, bool phys_space, TFloat outside_value)
+              bool use_nn, bool phys_space, TFloat outside_value, bool jacobian_modulate)
 {
   typedef FastWarpCompositeImageFilter<CompositeImageType, CompositeImageType, VectorImageType> WF;
   typename WF::Pointer wf = WF::New();
@@ -377,6 +384,7 @@ LDDMMData<TFloat, VDim>
   wf->SetUseNearestNeighbor(use_nn);
   wf->SetUsePhysicalSpace(phys_space);
   wf->SetOutsideValue(outside_value);
+  wf->SetJacobianModulation(jacobian_modulate);
   wf->Update();
 }
 
@@ -662,6 +670,47 @@ LDDMMData<TFloat, VDim>
   flt->Update();
 }
 
+template <class TFloat, uint VDim>
+class VectorComponentScaleFunctor
+{
+public:
+  typedef itk::CovariantVector<TFloat,VDim> Vec;
+
+  Vec operator() (const Vec &x)
+    {
+    Vec y;
+    for(unsigned int d = 0; d < VDim; d++)
+      y[d] = x[d] * Scale[d];
+    return y;
+    }
+
+  bool operator== (const VectorComponentScaleFunctor<TFloat, VDim> &other)
+    { return Scale == other.Scale; }
+
+  bool operator!= (const VectorComponentScaleFunctor<TFloat, VDim> &other)
+    { return Scale != other.Scale; }
+
+  Vec Scale;
+};
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_scale_in_place(VectorImageType *trg, const Vec &s)
+{
+  typedef VectorComponentScaleFunctor<TFloat, VDim> Functor;
+  typedef itk::UnaryFunctorImageFilter<
+    VectorImageType, VectorImageType, Functor> Filter;
+  typename Filter::Pointer flt = Filter::New();
+
+  Functor func;
+  func.Scale = s;
+  flt->SetFunctor(func);
+  flt->SetInput(trg);
+  flt->GraftOutput(trg);
+  flt->Update();
+}
+
 template <class TFloat, uint VDim>
 void 
 LDDMMData<TFloat, VDim>
@@ -1104,6 +1153,18 @@ LDDMMData<TFloat, VDim>
   filter->Update();
 }
 
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::field_jacobian_det_direct(VectorImageType *vec, ImageType *out)
+{
+  typedef JacobianDeterminantImageFilter<VectorImageType, ImageType> Filter;
+  typename Filter::Pointer filter = Filter::New();
+  filter->SetInput(vec);
+  filter->GraftOutput(out);
+  filter->Update();
+}
+
 template <class TFloat, uint VDim>
 void 
 LDDMMData<TFloat, VDim>
@@ -1643,25 +1704,20 @@ void
 LDDMMData<TFloat, VDim>
 ::img_downsample(ImageType *src, ImageType *trg, double factor)
 {
-  // Begin by smoothing the image
-  typedef itk::SmoothingRecursiveGaussianImageFilter<ImageType, ImageType> SmoothType;
-  typename SmoothType::Pointer fltSmooth = SmoothType::New();
-  fltSmooth->SetInput(src);
-  fltSmooth->SetSigmaArray(0.5 * factor * src->GetSpacing());
-
-  // Now resample the image to occupy the same physical space
-  typedef itk::ResampleImageFilter<ImageType, ImageType, TFloat> ResampleFilter;
-  typedef itk::IdentityTransform<TFloat, VDim> TranType;
-  typedef itk::LinearInterpolateImageFunction<ImageType, TFloat> InterpType;
-
-  typename ResampleFilter::Pointer filter = ResampleFilter::New();
-  typename TranType::Pointer tran = TranType::New();
-  typename InterpType::Pointer func = InterpType::New();
+  Vec factors;
+  factors.Fill(factor);
+  img_downsample(src, trg, factors);
+}
 
+template <class TFloat, uint VDim>
+typename LDDMMData<TFloat, VDim>::ImageBaseType::Pointer
+LDDMMData<TFloat, VDim>
+::img_downsample_space(ImageBaseType *src, const Vec &factors)
+{
   // Compute the size of the new image
   typename ImageType::SizeType sz;
   for(int i = 0; i < VDim; i++)
-    sz[i] = (unsigned long) vcl_ceil(src->GetBufferedRegion().GetSize()[i] / factor);
+    sz[i] = (unsigned long) vcl_ceil(src->GetBufferedRegion().GetSize()[i] / factors[i]);
 
   // Compute the spacing of the new image
   typename ImageType::SpacingType spc_pre = src->GetSpacing();
@@ -1678,6 +1734,43 @@ LDDMMData<TFloat, VDim>
   typename ImageType::SpacingType off_post = (src->GetDirection() * spc_post) * 0.5;
   typename ImageType::PointType origin_post = origin_pre - off_pre + off_post;
 
+  typename ImageBaseType::Pointer space = ImageBaseType::New();
+  space->SetRegions(sz);
+  space->SetOrigin(origin_post);
+  space->SetSpacing(spc_post);
+  space->SetDirection(src->GetDirection());
+  return space;
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::img_downsample(ImageType *src, ImageType *trg, const Vec &factors)
+{
+  // Begin by smoothing the image
+  typedef itk::SmoothingRecursiveGaussianImageFilter<ImageType, ImageType> SmoothType;
+  typename SmoothType::Pointer fltSmooth = SmoothType::New();
+  typename SmoothType::SigmaArrayType sigmas;
+  for(unsigned int i = 0; i < VDim; i++)
+    sigmas[i] = 0.5 * factors[i] * src->GetSpacing()[i];
+  fltSmooth->SetInput(src);
+  fltSmooth->SetSigmaArray(sigmas);
+
+  // Now resample the image to occupy the same physical space
+  typedef itk::ResampleImageFilter<ImageType, ImageType, TFloat> ResampleFilter;
+  typedef itk::IdentityTransform<TFloat, VDim> TranType;
+  typedef itk::LinearInterpolateImageFunction<ImageType, TFloat> InterpType;
+
+  typename ResampleFilter::Pointer filter = ResampleFilter::New();
+  typename TranType::Pointer tran = TranType::New();
+  typename InterpType::Pointer func = InterpType::New();
+
+  // Compute the geometry of the new image
+  typename ImageBaseType::Pointer space = img_downsample_space(src, factors);
+  typename ImageType::SizeType sz = space->GetBufferedRegion().GetSize();
+  typename ImageType::SpacingType spc_post = space->GetSpacing();
+  typename ImageType::PointType origin_post = space->GetOrigin();
+
   // Weird - have to allocate the output image?
   trg->SetRegions(sz);
   trg->SetOrigin(origin_post);
@@ -1706,6 +1799,19 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_resample_identity(VectorImageType *src, ImageBaseType *ref, VectorImageType *trg)
 {
+  // When the grids have the same orientation (e.g., pyramid levels), use the faster
+  // separable resampler, which produces the same result as the generic filter below
+  typedef SeparableLinearResampleImageFilter<VectorImageType> SeparableFilter;
+  if(SeparableFilter::CanResample(src, ref))
+    {
+    typename SeparableFilter::Pointer filter = SeparableFilter::New();
+    filter->SetInput(src);
+    filter->SetReferenceSpace(ref);
+    filter->GraftOutput(trg);
+    filter->Update();
+    return;
+    }
+
   typedef itk::VectorResampleImageFilter<VectorImageType, VectorImageType, TFloat> ResampleFilter;
   typedef itk::IdentityTransform<TFloat, VDim> TranType;
   typedef itk::OptVectorLinearInterpolateImageFunction<VectorImageType, TFloat> InterpType;
@@ -1822,6 +1928,104 @@ LDDMMData<TFloat, VDim>
 }
 
 
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include <algorithm>
+
+template<class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_block_max_norm(VectorImageType *src, int block, ImageType *trg)
+{
+  RegionType region = src->GetBufferedRegion();
+
+  // Allocate the block image, with one pixel per (possibly partial) block
+  typename ImageType::SizeType bsize;
+  for(uint d = 0; d < VDim; d++)
+    bsize[d] = (region.GetSize()[d] + block - 1) / block;
+  if(trg->GetBufferedRegion().GetSize() != bsize)
+    {
+    trg->SetRegions(RegionType(bsize));
+    trg->Allocate();
+    }
+  trg->FillBuffer(0.0);
+
+  // Traverse the source line by line, the block row is the same along the line
+  typedef itk::ImageLinearConstIteratorWithIndex<VectorImageType> IterType;
+  IterType it(src, region);
+  it.SetDirection(0);
+  int nx = region.GetSize()[0];
+  for(; !it.IsAtEnd(); it.NextLine())
+    {
+    typename ImageType::IndexType bidx;
+    for(uint d = 0; d < VDim; d++)
+      bidx[d] = (it.GetIndex()[d] - region.GetIndex()[d]) / block;
+
+    const Vec *p = src->GetBufferPointer() + src->ComputeOffset(it.GetIndex());
+    TFloat *p_blk = trg->GetBufferPointer() + trg->ComputeOffset(bidx);
+    for(int x = 0; x < nx; x++)
+      {
+      TFloat len2 = p[x].GetSquaredNorm();
+      if(len2 > p_blk[x / block])
+        p_blk[x / block] = len2;
+      }
+    }
+
+  // Convert squared lengths to lengths
+  TFloat *p_blk = trg->GetBufferPointer();
+  for(size_t i = 0; i < trg->GetPixelContainer()->Size(); i++)
+    p_blk[i] = sqrt(p_blk[i]);
+}
+
+template<class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::img_block_expand(ImageType *src, int block, int radius, ImageType *trg)
+{
+  // Dilate the block image by taking the maximum over the neighbor blocks, one axis at a time
+  ImagePointer dil = new_img(src);
+  img_copy(src, dil);
+  if(radius > 0)
+    {
+    ImagePointer tmp = new_img(src);
+    typename ImageType::SizeType bsize = src->GetBufferedRegion().GetSize();
+    for(uint d = 0; d < VDim; d++)
+      {
+      img_copy(dil, tmp);
+      for(ImageIterator it(dil, dil->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+        {
+        typename ImageType::IndexType idx = it.GetIndex();
+        long i0 = std::max(0l, (long) idx[d] - radius);
+        long i1 = std::min((long) bsize[d] - 1, (long) idx[d] + radius);
+        TFloat v = it.Get();
+        for(long i = i0; i <= i1; i++)
+          {
+          idx[d] = i;
+          v = std::max(v, tmp->GetPixel(idx));
+          }
+        it.Set(v);
+        }
+      }
+    }
+
+  // Fill the target voxels from their blocks
+  RegionType region = trg->GetBufferedRegion();
+  typedef itk::ImageLinearConstIteratorWithIndex<ImageType> IterType;
+  IterType it(trg, region);
+  it.SetDirection(0);
+  int nx = region.GetSize()[0];
+  for(; !it.IsAtEnd(); it.NextLine())
+    {
+    typename ImageType::IndexType bidx;
+    for(uint d = 0; d < VDim; d++)
+      bidx[d] = (it.GetIndex()[d] - region.GetIndex()[d]) / block;
+
+    TFloat *p = trg->GetBufferPointer() + trg->ComputeOffset(it.GetIndex());
+    const TFloat *p_blk = dil->GetBufferPointer() + dil->ComputeOffset(bidx);
+    for(int x = 0; x < nx; x++)
+      p[x] = p_blk[x / block];
+    }
+}
+
 template <class TImage>
 struct VoxelToPhysicalFunctor
 {
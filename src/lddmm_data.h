@@ -112,19 +112,22 @@ public:
     ImageType *fix, ImageType *mov, 
     uint nt, double alpha, double gamma, double sigma);
 
-  // Apply deformation to data
+  // Apply deformation to data. Where the optional active mask is zero, data is copied
+  // to out without interpolation (data must then have the grid of field)
   static void interp_vimg(
     VectorImageType *data, VectorImageType *field, 
     TFloat def_scale, VectorImageType *out,
-    bool use_nn = false, bool phys_space = false);
+    bool use_nn = false, bool phys_space = false, ImageType *active_mask = NULL);
 
   // Apply deformation to data
   static void interp_img(ImageType *data, VectorImageType *field, ImageType *out,
                          bool use_nn = false, bool phys_space = false, TFloat outside_value = 0.0);
 
   // Apply deformation to data
+  // When jacobian_modulate is set, the output is multiplied by the Jacobian determinant of the warp
   static void interp_cimg(CompositeImageType *data, VectorImageType *field, CompositeImageType *out,
-                          bool use_nn = false, bool phys_space = false, TFloat outside_value = 0.0);
+                          bool use_nn = false, bool phys_space = false, TFloat outside_value = 0.0,
+                          bool jacobian_modulate = false);
 
   // Apply deformation to matrix data
   static void interp_mimg(MatrixImageType *data, VectorImageType *field, MatrixImageType *out,
@@ -160,6 +163,10 @@ public:
   // Take Jacobian of deformation field
   static void field_jacobian_det(VectorImageType *vec, ImageType *out);
 
+  // Compute det(I + Du) of a voxel-unit displacement field in a single pass that does
+  // not store the Jacobian matrices
+  static void field_jacobian_det_direct(VectorImageType *vec, ImageType *out);
+
   // Compute the Lie bracket by computing two Jacobians and multiplying. This should be made faster
   // by making a custom ITK filter
   static void lie_bracket(VectorImageType *v, VectorImageType *u, MatrixImageType *work, VectorImageType *out);
@@ -181,6 +188,9 @@ public:
   static void vimg_subtract_in_place(VectorImageType *trg, VectorImageType *a);
   static void vimg_scale_in_place(VectorImageType *trg, TFloat s);
 
+  // Scale each component of the vectors by a different factor
+  static void vimg_scale_in_place(VectorImageType *trg, const Vec &s);
+
   // compute trg = trg + s * a
   static void vimg_add_scaled_in_place(VectorImageType *trg, VectorImageType *a, TFloat s);
 
@@ -217,6 +227,10 @@ public:
 
   // Downsample and upsample images (includes smoothing, use sparingly)
   static void img_downsample(ImageType *src, ImageType *trg, double factor);
+  static void img_downsample(ImageType *src, ImageType *trg, const Vec &factors);
+
+  // Grid of the image produced by img_downsample
+  static typename ImageBaseType::Pointer img_downsample_space(ImageBaseType *src, const Vec &factors);
   static void img_shrink(ImageType *src, ImageType *trg, int factor);
   static void img_resample_identity(ImageType *src, ImageBaseType *ref, ImageType *trg);
   static void vimg_resample_identity(VectorImageType *src, ImageBaseType *ref, VectorImageType *trg);
@@ -234,6 +248,14 @@ public:
   // Replace NaNs in an image using a mask
   static void img_reconstitute_nans_in_place(ImageType *src, ImageType *nan_mask);
 
+  // Maximum vector length in each block of a partition of the image into cubes of the
+  // given size. The target is allocated with one pixel per block
+  static void vimg_block_max_norm(VectorImageType *src, int block, ImageType *trg);
+
+  // Expand a block image produced by vimg_block_max_norm to the voxels of the target,
+  // taking the maximum over the blocks within the given radius (in blocks)
+  static void img_block_expand(ImageType *src, int block, int radius, ImageType *trg);
+
   // Convert voxel-space warp to a physical space warp
   static void warp_voxel_to_physical(VectorImageType *src, ImageBaseType *ref_space, VectorImageType *trg);
   
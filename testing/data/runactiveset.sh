@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Compare deformable SSD registration with the active set (-active-set) against
+# the dense run on a phantom pair. Fails if the SSD reached with the active set
+# is not within the tolerance of the SSD reached by the dense run.
+
+# Parameters
+# $1 - fixed phantom number
+# $2 - moving phantom number
+# $3 - active set threshold, in voxels (default 0.01)
+# $4 - relative tolerance on the final SSD (default 0.05)
+
+GREEDY=${GREEDY:-../../../xc64rel/greedy}
+THRESH=${3:-0.01}
+TOL=${4:-0.05}
+
+rm -rf /tmp/test_as_affine.mat /tmp/test_as_dense.nii.gz /tmp/test_as_active.nii.gz
+
+# Common affine initialization
+$GREEDY -d 3 -m SSD -a -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+  -o /tmp/test_as_affine.mat -n 40x40 || exit 1
+
+# Deformable registration with the given extra options
+function run_deformable()
+{
+  $GREEDY -d 3 -m SSD -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+    -it /tmp/test_as_affine.mat -o $3 -n 40x40x20 $4 > /dev/null
+}
+
+# SSD between the fixed image and the moving image under a warp
+function ssd_metric()
+{
+  $GREEDY -d 3 -metric -m SSD -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+    -it $3 /tmp/test_as_affine.mat | grep "Total =" | sed -e "s/.*Total = *//"
+}
+
+run_deformable $1 $2 /tmp/test_as_dense.nii.gz "" || exit 1
+run_deformable $1 $2 /tmp/test_as_active.nii.gz "-active-set $THRESH" || exit 1
+
+M_DENSE=$(ssd_metric $1 $2 /tmp/test_as_dense.nii.gz)
+M_ACTIVE=$(ssd_metric $1 $2 /tmp/test_as_active.nii.gz)
+if [[ -z $M_DENSE || -z $M_ACTIVE ]]; then
+  echo "FAILED: could not compute the metric"
+  exit 1
+fi
+
+echo "Dense:      metric $M_DENSE"
+echo "Active set: metric $M_ACTIVE"
+
+if [[ $(echo "d = $M_ACTIVE - $M_DENSE; if(d < 0) d = -d; \
+              m = $M_DENSE; if(m < 0) m = -m; d > $TOL * m" | bc -l) -eq 1 ]]; then
+  echo "FAILED: active set metric is not within $TOL of the dense metric"
+  exit 1
+fi
+
+echo "PASSED"
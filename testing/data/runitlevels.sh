@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Compare deformable registration with the moving pyramid sampled through the
+# pre-transforms (-it-levels) against the default, in which the pre-warped image
+# is downsampled. Fails if the NCC reached with -it-levels is not within the
+# tolerance of the NCC reached by default.
+
+# Parameters
+# $1 - fixed phantom number
+# $2 - moving phantom number
+# $3 - relative tolerance on the final NCC (default 0.05)
+
+GREEDY=${GREEDY:-../../../xc64rel/greedy}
+TOL=${3:-0.05}
+
+rm -rf /tmp/test_itl_affine.mat /tmp/test_itl_default.nii.gz /tmp/test_itl_levels.nii.gz
+
+# Common affine initialization, used as the pre-transform
+$GREEDY -d 3 -m NCC 2x2x2 -a -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+  -o /tmp/test_itl_affine.mat -n 40x40 || exit 1
+
+# Deformable registration with the given extra options
+function run_deformable()
+{
+  $GREEDY -d 3 -m NCC 2x2x2 -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+    -it /tmp/test_itl_affine.mat -o $3 -n 40x40x20 $4 > /dev/null
+}
+
+# Exact NCC value between the fixed image and the moving image under a warp
+function ncc_metric()
+{
+  $GREEDY -d 3 -metric -m NCC 2x2x2 -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+    -it $3 /tmp/test_itl_affine.mat | grep "Total =" | sed -e "s/.*Total = *//"
+}
+
+run_deformable $1 $2 /tmp/test_itl_default.nii.gz "" || exit 1
+run_deformable $1 $2 /tmp/test_itl_levels.nii.gz "-it-levels" || exit 1
+
+M_DEFAULT=$(ncc_metric $1 $2 /tmp/test_itl_default.nii.gz)
+M_LEVELS=$(ncc_metric $1 $2 /tmp/test_itl_levels.nii.gz)
+if [[ -z $M_DEFAULT || -z $M_LEVELS ]]; then
+  echo "FAILED: could not compute the metric"
+  exit 1
+fi
+
+echo "Pre-warped pyramid: metric $M_DEFAULT"
+echo "-it-levels:         metric $M_LEVELS"
+
+if [[ $(echo "d = $M_LEVELS - $M_DEFAULT; if(d < 0) d = -d; \
+              m = $M_DEFAULT; if(m < 0) m = -m; d > $TOL * m" | bc -l) -eq 1 ]]; then
+  echo "FAILED: -it-levels metric is not within $TOL of the default metric"
+  exit 1
+fi
+
+echo "PASSED"
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Compare deformable registration with the approximate NCC metric (-ncc-approx)
+# against the exact NCC metric on a phantom pair. Fails if the NCC reached with
+# the approximate metric is not within the tolerance of the exact metric. The run
+# times are printed for information only.
+
+# Parameters
+# $1 - fixed phantom number
+# $2 - moving phantom number
+# $3 - number of finest levels using exact NCC with -ncc-approx (default 1)
+# $4 - relative tolerance on the final NCC (default 0.05)
+
+GREEDY=${GREEDY:-../../../xc64rel/greedy}
+EXACT_LEVELS=${3:-1}
+TOL=${4:-0.05}
+
+rm -rf /tmp/test_ncc_affine.mat /tmp/test_ncc_exact.nii.gz /tmp/test_ncc_approx.nii.gz
+
+# Common affine initialization
+$GREEDY -d 3 -m NCC 2x2x2 -a -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+  -o /tmp/test_ncc_affine.mat -n 40x40 || exit 1
+
+# Deformable registration with the given extra options, prints the run time in seconds
+function run_deformable()
+{
+  local t0=$(date +%s.%N)
+  $GREEDY -d 3 -m NCC 2x2x2 -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+    -it /tmp/test_ncc_affine.mat -o $3 -n 40x40x20 $4 > /dev/null || return 1
+  local t1=$(date +%s.%N)
+  echo "$t1 - $t0" | bc -l
+}
+
+# Exact NCC value between the fixed image and the moving image under a warp
+function ncc_metric()
+{
+  $GREEDY -d 3 -metric -m NCC 2x2x2 -i phantom${1}_fixed.nii.gz phantom${2}_moving.nii.gz \
+    -it $3 /tmp/test_ncc_affine.mat | grep "Total =" | sed -e "s/.*Total = *//"
+}
+
+T_EXACT=$(run_deformable $1 $2 /tmp/test_ncc_exact.nii.gz "") || exit 1
+T_APPROX=$(run_deformable $1 $2 /tmp/test_ncc_approx.nii.gz "-ncc-approx $EXACT_LEVELS") || exit 1
+
+M_EXACT=$(ncc_metric $1 $2 /tmp/test_ncc_exact.nii.gz)
+M_APPROX=$(ncc_metric $1 $2 /tmp/test_ncc_approx.nii.gz)
+if [[ -z $M_EXACT || -z $M_APPROX ]]; then
+  echo "FAILED: could not compute the metric"
+  exit 1
+fi
+
+echo "Exact NCC:       metric $M_EXACT, time $T_EXACT s"
+echo "Approximate NCC: metric $M_APPROX, time $T_APPROX s"
+
+# Accuracy envelope: the final metric is within the relative tolerance
+if [[ $(echo "d = $M_APPROX - $M_EXACT; if(d < 0) d = -d; \
+              m = $M_EXACT; if(m < 0) m = -m; d > $TOL * m" | bc -l) -eq 1 ]]; then
+  echo "FAILED: approximate NCC metric is not within $TOL of the exact metric"
+  exit 1
+fi
+
+echo "PASSED"
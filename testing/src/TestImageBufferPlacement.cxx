@@ -0,0 +1,147 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "GreedyAPI.h"
+#include "CommandLineHelper.h"
+#include "ImageBufferPlacement.h"
+#include <iostream>
+#include <cstdlib>
+
+/**
+ * Allocates images through LDDMMData with the placement options given on the command
+ * line (e.g., -numa pin thp) and checks that the buffers are zeroed, that the calling
+ * thread gets its CPU affinity back, and that the CPU list matches the allowed CPUs on
+ * a machine with a single NUMA node. Runs on any Linux machine, NUMA or not.
+ */
+typedef LDDMMData<float, 3> LDDMMType;
+
+// Check that a buffer is all zero bytes
+bool CheckZero(const void *buffer, size_t n_bytes, const char *what)
+{
+  const char *p = static_cast<const char *>(buffer);
+  for(size_t i = 0; i < n_bytes; i++)
+    {
+    if(p[i])
+      {
+      std::cerr << what << ": non-zero byte at offset " << i << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  GreedyParameters param;
+  GreedyParameters::SetToDefaults(param);
+
+  try
+    {
+    CommandLineHelper cl(argc, argv);
+    while(!cl.is_at_end())
+      {
+      std::string cmd = cl.read_command();
+      if(!param.ParseCommandLine(cmd, cl))
+        {
+        std::cerr << "Unknown parameter " << cmd << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+  catch(std::exception &exc)
+    {
+    std::cerr << "ERROR: " << exc.what() << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  GreedyApproach<3, float>::ConfigThreads(param);
+
+#ifdef __linux__
+  cpu_set_t before, after;
+  CPU_ZERO(&before);
+  pthread_getaffinity_np(pthread_self(), sizeof(before), &before);
+#endif
+
+  // The CPU list is never empty, and with one node it holds exactly the allowed CPUs
+  int n_nodes;
+  const std::vector<int> &cpus = ImageBufferPlacement::GetCPUList(&n_nodes);
+  if(cpus.empty())
+    {
+    std::cerr << "Empty CPU list" << std::endl;
+    return EXIT_FAILURE;
+    }
+#ifdef __linux__
+  if(n_nodes == 1 && (int) cpus.size() != CPU_COUNT(&before))
+    {
+    std::cerr << "CPU list has " << cpus.size() << " CPUs, expected "
+              << CPU_COUNT(&before) << " on a single node" << std::endl;
+    return EXIT_FAILURE;
+    }
+#endif
+
+  // Large enough to be zeroed in slabs and to span several huge pages
+  LDDMMType::ImagePointer ref = LDDMMType::ImageType::New();
+  itk::ImageRegion<3> region;
+  region.SetSize(0, 128); region.SetSize(1, 128); region.SetSize(2, 64);
+  ref->SetRegions(region);
+
+  LDDMMType::ImagePointer img = LDDMMType::ImageType::New();
+  LDDMMType::VectorImagePointer vimg = LDDMMType::VectorImageType::New();
+  LDDMMType::CompositeImagePointer cimg = LDDMMType::CompositeImageType::New();
+
+  // Each image is allocated, dirtied and allocated again: ITK keeps the buffer when its
+  // size does not change, so the second allocation must zero it
+  for(int pass = 0; pass < 2; pass++)
+    {
+    LDDMMType::alloc_img(img, ref);
+    LDDMMType::alloc_vimg(vimg, ref);
+    LDDMMType::alloc_cimg(cimg, ref, 2);
+
+    if(!CheckZero(img->GetBufferPointer(), img->GetPixelContainer()->Size() * sizeof(float), "alloc_img")
+       || !CheckZero(vimg->GetBufferPointer(), vimg->GetPixelContainer()->Size() * sizeof(LDDMMType::Vec), "alloc_vimg")
+       || !CheckZero(cimg->GetBufferPointer(), cimg->GetPixelContainer()->Size() * sizeof(float), "alloc_cimg"))
+      return EXIT_FAILURE;
+
+    img->FillBuffer(1.0f);
+    vimg->FillBuffer(LDDMMType::Vec(1.0f));
+    memset(cimg->GetBufferPointer(), 0xff, cimg->GetPixelContainer()->Size() * sizeof(float));
+    }
+
+#ifdef __linux__
+  // The calling thread zeroes the first slab, pinned, and must be unpinned afterwards
+  CPU_ZERO(&after);
+  pthread_getaffinity_np(pthread_self(), sizeof(after), &after);
+  if(!CPU_EQUAL(&before, &after))
+    {
+    std::cerr << "CPU affinity of the calling thread was not restored" << std::endl;
+    return EXIT_FAILURE;
+    }
+#endif
+
+  std::cout << "Allocated and zeroed 3 images, " << cpus.size() << " CPUs on "
+            << n_nodes << " node(s)" << std::endl;
+  return EXIT_SUCCESS;
+}